@@ -23,6 +23,7 @@
 
 #include <assert.h>
 #include <sys/types.h>
+#include <sys/param.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -121,6 +122,32 @@ _notify_shm_id(void)
 #endif
 }
 
+/*
+ * Segments after the first are named <base>.<segment>.  POSIX shared memory
+ * names are limited to PSHMNAMLEN, so only the tail of the base name is
+ * kept; in the simulator that is the part derived from the UDID.
+ */
+#define NOTIFY_SHM_SEGMENT_ID_BASE_LEN 23
+
+void
+_notify_shm_segment_id(const char *base, uint32_t segment, char *buf, size_t len)
+{
+	size_t n = strlen(base);
+
+	if (n > NOTIFY_SHM_SEGMENT_ID_BASE_LEN) base += n - NOTIFY_SHM_SEGMENT_ID_BASE_LEN;
+	snprintf(buf, len, "%s.%u", base, segment);
+}
+
+/* state segments are named <base>.s<segment>, shortened the same way */
+void
+_notify_shm_state_id(const char *base, uint32_t segment, char *buf, size_t len)
+{
+	size_t n = strlen(base);
+
+	if (n > NOTIFY_SHM_SEGMENT_ID_BASE_LEN) base += n - NOTIFY_SHM_SEGMENT_ID_BASE_LEN;
+	snprintf(buf, len, "%s.s%u", base, segment);
+}
+
 inline uint64_t
 make_client_id(pid_t pid, int token)
 {
@@ -131,9 +158,85 @@ make_client_id(pid_t pid, int token)
 	return cid.hash_key;
 }
 
+#pragma mark -
+#pragma mark pools
+
+#define NOTIFY_POOL_SLAB_SIZE 16384
+#define NOTIFY_POOL_ALIGN 16
+
+/* total size of a name_info_t plus its name */
+static const uint16_t name_pool_sizes[NOTIFY_NAME_POOL_CLASSES] = {
+	128, 160, 192, 256, 384, NOTIFY_NAME_POOL_MAX_SIZE
+};
+
+_Static_assert(sizeof(name_info_t) + NOTIFY_MIG_NAME_MAX <= NOTIFY_NAME_POOL_MAX_SIZE, "largest name pool class must fit any MIG name");
+
+static void
+_internal_pool_init(notify_pool_t *pool, size_t object_size)
+{
+	*pool = (notify_pool_t){
+		.object_size = (uint32_t)roundup(object_size, NOTIFY_POOL_ALIGN),
+	};
+}
+
+static void *
+_internal_pool_alloc(notify_pool_t *pool)
+{
+	void *obj;
+
+	if (pool->free_list == NULL)
+	{
+		uint32_t i, count = NOTIFY_POOL_SLAB_SIZE / pool->object_size;
+		char *slab = malloc(NOTIFY_POOL_SLAB_SIZE);
+		if (slab == NULL) return NULL;
+
+		/* slabs are never returned, the pool stays at its high-water mark */
+		pool->slab_count++;
+		for (i = count; i > 0; i--)
+		{
+			obj = slab + (i - 1) * pool->object_size;
+			*(void **)obj = pool->free_list;
+			pool->free_list = obj;
+		}
+		pool->free_count += count;
+	}
+
+	obj = pool->free_list;
+	pool->free_list = *(void **)obj;
+	pool->free_count--;
+
+	memset(obj, 0, pool->object_size);
+	return obj;
+}
+
+static void
+_internal_pool_free(notify_pool_t *pool, void *obj)
+{
+	*(void **)obj = pool->free_list;
+	pool->free_list = obj;
+	pool->free_count++;
+}
+
+/* returns NOTIFY_NAME_POOL_CLASSES for names too long to be pooled */
+static uint32_t
+_internal_name_pool_class(size_t namelen)
+{
+	size_t size = sizeof(name_info_t) + namelen;
+	uint32_t i;
+
+	for (i = 0; i < NOTIFY_NAME_POOL_CLASSES; i++)
+	{
+		if (size <= name_pool_sizes[i]) break;
+	}
+
+	return i;
+}
+
 void
 _notify_lib_notify_state_init(notify_state_t * ns, uint32_t flags)
 {
+	mach_timebase_info_data_t tbi;
+
 #ifdef SINGLE_THREADED_NOTIFY_STATE
 	assert((flags & NOTIFY_STATE_USE_LOCKS) == 0);
 #endif
@@ -146,6 +249,19 @@ _notify_lib_notify_state_init(notify_state_t * ns, uint32_t flags)
 	_nc_table_init_n(&ns->port_table, offsetof(port_data_t, port));
 	_nc_table_init_n(&ns->proc_table, offsetof(proc_data_t, pid));
 	_nc_table_init_64(&ns->event_table, offsetof(event_data_t, event_token));
+
+	_internal_pool_init(&ns->client_pool, sizeof(client_t));
+	for (uint32_t i = 0; i < NOTIFY_NAME_POOL_CLASSES; i++)
+	{
+		_internal_pool_init(&ns->name_pool[i], name_pool_sizes[i]);
+	}
+
+	memset(ns->port_batch, 0, sizeof(ns->port_batch));
+	ns->port_batch_depth = 0;
+	ns->fanout_shards = 1;
+
+	mach_timebase_info(&tbi);
+	ns->ack_timeout = (uint64_t)NOTIFY_ACK_TIMEOUT_MSEC * NSEC_PER_MSEC * tbi.denom / tbi.numer;
 }
 
 // We only need to lock in the client
@@ -177,15 +293,32 @@ _internal_client_new(notify_state_t *ns, pid_t pid, int token, name_info_t *n)
 	c = _nc_table_find_64(&ns->client_table, cid);
 	if (c != NULL) return NULL;
 
-	c = calloc(1, sizeof(client_t));
+	c = _internal_pool_alloc(&ns->client_pool);
 	if (c == NULL) return NULL;
 
+	if (n->subscriber_count == n->subscriber_size)
+	{
+		uint32_t size = (n->subscriber_size == 0) ? 4 : n->subscriber_size * 2;
+		notify_subscriber_t *subscribers = realloc(n->subscribers, size * sizeof(notify_subscriber_t));
+		if (subscribers == NULL)
+		{
+			_internal_pool_free(&ns->client_pool, c);
+			return NULL;
+		}
+
+		n->subscribers = subscribers;
+		n->subscriber_size = size;
+	}
+
 	ns->stat_client_alloc++;
 	c->cid.hash_key = cid;
 	c->name_info = n;
 
 	LIST_INSERT_HEAD(&n->subscriptions, c, client_subscription_entry);
 
+	c->subscriber_index = n->subscriber_count++;
+	n->subscribers[c->subscriber_index] = (notify_subscriber_t){ .client = c };
+
 	_nc_table_insert_64(&ns->client_table, &c->cid.hash_key);
 	return c;
 }
@@ -202,114 +335,360 @@ _internal_client_release(notify_state_t *ns, client_t *c)
 		mach_port_deallocate(mach_task_self(), c->deliver.port);
 	}
 
-	free(c);
+	_internal_pool_free(&ns->client_pool, c);
 	ns->stat_client_free++;
 }
 
 static name_info_t *
-_internal_new_name(notify_state_t *ns, const char *name)
+_internal_new_name(notify_state_t *ns, const char *name, uint64_t hash)
 {
 	name_info_t *n;
 	size_t namelen;
+	uint32_t class;
 
 	if (name == NULL) return NULL;
 
 	namelen = strlen(name) + 1;
 
-	n = (name_info_t *)calloc(1, sizeof(name_info_t) + namelen);
+	class = _internal_name_pool_class(namelen);
+	if (class < NOTIFY_NAME_POOL_CLASSES) n = _internal_pool_alloc(&ns->name_pool[class]);
+	else n = (name_info_t *)calloc(1, sizeof(name_info_t) + namelen);
 	if (n == NULL) return NULL;
 
 	ns->stat_name_alloc++;
 
 	n->name = (char *)n + sizeof(name_info_t);
 	memcpy(n->name, name, namelen);
+	n->name_hash = hash;
 
 	n->name_id = ns->name_id++;
 	n->access = NOTIFY_ACCESS_DEFAULT;
 	n->slot = (uint32_t)-1;
 	n->val = 1;
+	n->stat_epoch = ns->stat_epoch;
 
 	LIST_INIT(&n->subscriptions);
 
-	_nc_table_insert(&ns->name_table, &n->name);
+	_nc_table_insert_hashed(&ns->name_table, &n->name, n->name_hash);
 	_nc_table_insert_64(&ns->name_id_table, &n->name_id);
 
 	return n;
 }
 
+#pragma mark -
+#pragma mark post statistics
+
+/*
+ * Post counts roll over lazily.  Starting a new hour only bumps the state's
+ * epoch; a name's counts are moved along the next time it is posted or its
+ * counts are read, so a reset costs the same however many names there are.
+ */
+void
+_notify_lib_stats_reset(notify_state_t *ns)
+{
+	ns->stat_epoch++;
+}
+
+void
+_notify_lib_name_stats(notify_state_t *ns, name_info_t *n)
+{
+	if (n->stat_epoch == ns->stat_epoch) return;
+
+	/* a name that was not posted in the last full hour has nothing to carry */
+	if ((ns->stat_epoch - n->stat_epoch) == 1) n->last_hour_postcount = n->postcount;
+	else n->last_hour_postcount = 0;
+
+	n->postcount = 0;
+	n->stat_epoch = ns->stat_epoch;
+}
+
+void
+_notify_lib_name_posted(notify_state_t *ns, name_info_t *n)
+{
+	_notify_lib_name_stats(ns, n);
+	n->postcount++;
+}
+
+#pragma mark -
+#pragma mark controlled names
+
+/*
+ * Controlled names live in a radix tree keyed on the bytes of the name.
+ * A node's label is the part of the name consumed by the edge leading to it,
+ * and `controlled` is set when a controlled name ends exactly at that node.
+ *
+ * Access to a name is decided by its deepest controlled ancestor, that is
+ * the longest controlled name that is a (byte-wise) prefix of it.
+ */
+typedef struct notify_prefix_node_s
+{
+	struct notify_prefix_node_s **children; /* sorted by label[0] */
+	name_info_t *controlled;
+	uint32_t child_count;
+	uint32_t label_len;
+	char label[];
+} notify_prefix_node_t;
+
+static notify_prefix_node_t *
+_internal_prefix_node_new(const char *label, size_t len)
+{
+	notify_prefix_node_t *node = calloc(1, sizeof(notify_prefix_node_t) + len);
+	if (node == NULL) return NULL;
+
+	memcpy(node->label, label, len);
+	node->label_len = (uint32_t)len;
+	return node;
+}
+
+static void
+_internal_prefix_node_free(notify_prefix_node_t *node)
+{
+	free(node->children);
+	free(node);
+}
+
+/* returns the index of the child starting with c, or where it would be inserted */
+static uint32_t
+_internal_prefix_child_index(notify_prefix_node_t *node, char c, bool *found)
+{
+	uint32_t lo = 0, hi = node->child_count;
+
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) / 2;
+		unsigned char m = (unsigned char)node->children[mid]->label[0];
+
+		if (m == (unsigned char)c)
+		{
+			*found = true;
+			return mid;
+		}
+
+		if (m < (unsigned char)c) lo = mid + 1;
+		else hi = mid;
+	}
+
+	*found = false;
+	return lo;
+}
+
+static bool
+_internal_prefix_child_insert(notify_prefix_node_t *node, uint32_t i, notify_prefix_node_t *child)
+{
+	notify_prefix_node_t **children;
+
+	children = realloc(node->children, (node->child_count + 1) * sizeof(notify_prefix_node_t *));
+	if (children == NULL) return false;
+
+	memmove(&children[i + 1], &children[i], (node->child_count - i) * sizeof(notify_prefix_node_t *));
+	children[i] = child;
+	node->children = children;
+	node->child_count++;
+	return true;
+}
+
 static void
 _internal_insert_controlled_name(notify_state_t *ns, name_info_t *n)
 {
-	uint32_t i, j;
+	notify_prefix_node_t *node, *child;
+	size_t len, pos = 0;
 
 	if (n == NULL) return;
 
-	if (ns->controlled_name == NULL) ns->controlled_name_count = 0;
+	if (ns->controlled_names == NULL)
+	{
+		ns->controlled_names = _internal_prefix_node_new("", 0);
+		if (ns->controlled_names == NULL) return;
+	}
+
+	node = ns->controlled_names;
+	len = strlen(n->name);
 
-	for (i = 0; i < ns->controlled_name_count; i++)
+	while (pos < len)
 	{
-		if (ns->controlled_name[i] == n) return;
+		bool found;
+		uint32_t i = _internal_prefix_child_index(node, n->name[pos], &found);
+
+		if (!found)
+		{
+			child = _internal_prefix_node_new(n->name + pos, len - pos);
+			if (child == NULL) return;
+
+			if (!_internal_prefix_child_insert(node, i, child))
+			{
+				_internal_prefix_node_free(child);
+				return;
+			}
+
+			node = child;
+			break;
+		}
+
+		child = node->children[i];
+
+		uint32_t common = 1;
+		while ((common < child->label_len) && (pos + common < len) && (child->label[common] == n->name[pos + common])) common++;
+
+		if (common < child->label_len)
+		{
+			/* split the edge, child keeps the tail of its label */
+			notify_prefix_node_t *mid = _internal_prefix_node_new(child->label, common);
+			if (mid == NULL) return;
+
+			mid->children = malloc(sizeof(notify_prefix_node_t *));
+			if (mid->children == NULL)
+			{
+				_internal_prefix_node_free(mid);
+				return;
+			}
+
+			memmove(child->label, child->label + common, child->label_len - common);
+			child->label_len -= common;
+
+			mid->children[0] = child;
+			mid->child_count = 1;
+			node->children[i] = mid;
+			child = mid;
+		}
+
+		node = child;
+		pos += common;
 	}
 
-	ns->controlled_name = (name_info_t **)reallocf(ns->controlled_name, (ns->controlled_name_count + 1) * sizeof(name_info_t *));
+	if (node->controlled == NULL) ns->controlled_name_count++;
+	node->controlled = n;
+}
 
-	/*
-	 * Insert name in reverse sorted order (longer names preceed shorter names).
-	 * this means that in _internal_check_access, we check subspaces from the bottom up
-	 * i.e. we check access for the "deepest" controlled subspace.
-	 */
+static void
+_internal_prefix_remove(notify_state_t *ns, notify_prefix_node_t *node, const char *rest, size_t len, name_info_t *n)
+{
+	notify_prefix_node_t *child;
+	bool found;
+	uint32_t i;
 
-	for (i = 0; i < ns->controlled_name_count; i++)
+	if (len == 0)
 	{
-		if (strcmp(n->name, ns->controlled_name[i]->name) > 0) break;
+		if (node->controlled == n)
+		{
+			node->controlled = NULL;
+			ns->controlled_name_count--;
+		}
+
+		return;
 	}
 
-	for (j = ns->controlled_name_count; j > i; j--)
+	i = _internal_prefix_child_index(node, rest[0], &found);
+	if (!found) return;
+
+	child = node->children[i];
+	if ((child->label_len > len) || memcmp(child->label, rest, child->label_len)) return;
+
+	_internal_prefix_remove(ns, child, rest + child->label_len, len - child->label_len, n);
+
+	if (child->controlled != NULL) return;
+
+	if (child->child_count == 0)
 	{
-		ns->controlled_name[j] = ns->controlled_name[j-1];
+		/* prune the leaf */
+		_internal_prefix_node_free(child);
+		memmove(&node->children[i], &node->children[i + 1], (node->child_count - i - 1) * sizeof(notify_prefix_node_t *));
+		node->child_count--;
+		if (node->child_count == 0)
+		{
+			free(node->children);
+			node->children = NULL;
+		}
 	}
+	else if (child->child_count == 1)
+	{
+		/* merge the pass-through node into its only child */
+		notify_prefix_node_t *grandchild = child->children[0];
+		size_t glen = grandchild->label_len;
+
+		grandchild = realloc(grandchild, sizeof(notify_prefix_node_t) + child->label_len + glen);
+		if (grandchild == NULL) return;
 
-	ns->controlled_name[i] = n;
-	ns->controlled_name_count++;
+		memmove(grandchild->label + child->label_len, grandchild->label, glen);
+		memcpy(grandchild->label, child->label, child->label_len);
+		grandchild->label_len += child->label_len;
+
+		node->children[i] = grandchild;
+		_internal_prefix_node_free(child);
+	}
 }
 
 static void
 _internal_remove_controlled_name(notify_state_t *ns, name_info_t *n)
 {
-	uint32_t i, j;
+	notify_prefix_node_t *root = ns->controlled_names;
+
+	if ((n == NULL) || (root == NULL)) return;
+
+	_internal_prefix_remove(ns, root, n->name, strlen(n->name), n);
 
-	for (i = 0; i < ns->controlled_name_count; i++)
+	if ((root->controlled == NULL) && (root->child_count == 0))
 	{
-		if (ns->controlled_name[i] == n)
-		{
-			for (j = i + 1; j < ns->controlled_name_count; j++)
-			{
-				ns->controlled_name[j-1] = ns->controlled_name[j];
-			}
+		_internal_prefix_node_free(root);
+		ns->controlled_names = NULL;
+	}
+}
 
-			ns->controlled_name_count--;
-			if (ns->controlled_name_count == 0)
-			{
-				free(ns->controlled_name);
-				ns->controlled_name = NULL;
-			}
-			else
-			{
-				ns->controlled_name = (name_info_t **)reallocf(ns->controlled_name, ns->controlled_name_count * sizeof(name_info_t *));
-			}
+/* deepest controlled name that is a prefix of name, or NULL */
+static name_info_t *
+_internal_controlled_ancestor(notify_state_t *ns, const char *name, size_t len)
+{
+	notify_prefix_node_t *node = ns->controlled_names;
+	name_info_t *best = NULL;
+	size_t pos = 0;
 
-			return;
-		}
+	while (node != NULL)
+	{
+		notify_prefix_node_t *child;
+		bool found;
+		uint32_t i;
+
+		if (node->controlled != NULL) best = node->controlled;
+		if (pos >= len) break;
+
+		i = _internal_prefix_child_index(node, name[pos], &found);
+		if (!found) break;
+
+		child = node->children[i];
+		if ((child->label_len > len - pos) || memcmp(child->label, name + pos, child->label_len)) break;
+
+		pos += child->label_len;
+		node = child;
+	}
+
+	return best;
+}
+
+static bool
+_internal_prefix_walk(notify_prefix_node_t *node, OS_NOESCAPE bool (^handler)(name_info_t *n))
+{
+	/* deepest names first, the order in which they take precedence */
+	for (uint32_t i = node->child_count; i > 0; i--)
+	{
+		if (!_internal_prefix_walk(node->children[i - 1], handler)) return false;
 	}
+
+	if (node->controlled != NULL) return handler(node->controlled);
+	return true;
+}
+
+void
+_notify_lib_foreach_controlled_name(notify_state_t *ns, OS_NOESCAPE bool (^handler)(name_info_t *n))
+{
+	_notify_state_lock(&ns->lock);
+	if (ns->controlled_names != NULL) _internal_prefix_walk(ns->controlled_names, handler);
+	_notify_state_unlock(&ns->lock);
 }
 
 static uint32_t
 _internal_check_access(notify_state_t *ns, const char *name, uid_t uid, gid_t gid, int req)
 {
-    uint32_t i;
-    size_t len, plen;
 	name_info_t *p;
-	char str[64];
+	bool allowed;
 
 	if (name == NULL) return NOTIFY_STATUS_NULL_INPUT;
 
@@ -317,38 +696,41 @@ _internal_check_access(notify_state_t *ns, const char *name, uid_t uid, gid_t gi
 	if (uid == 0) return NOTIFY_STATUS_OK;
 
 	/* if name has "user.uid." as a prefix, it is a user-protected namespace */
-	if (!strncmp(name, USER_PROTECTED_UID_PREFIX, USER_PROTECTED_UID_PREFIX_LEN))
-    {
-        snprintf(str, sizeof(str) - 1, "%s%d", USER_PROTECTED_UID_PREFIX, uid);
-        len = strlen(str);
+	if (_notify_user_uid_name(name, uid, &allowed))
+	{
+		return allowed ? NOTIFY_STATUS_OK : NOTIFY_STATUS_NOT_AUTHORIZED;
+	}
 
-        /* user <uid> may access user.uid.<uid> or a subtree name */
-        if ((!strncmp(name, str, len)) && ((name[len] == '\0') || (name[len] == '.'))) return NOTIFY_STATUS_OK;
-        return NOTIFY_STATUS_NOT_AUTHORIZED;
-    }
+	p = _internal_controlled_ancestor(ns, name, strlen(name));
+	if (p == NULL) return NOTIFY_STATUS_OK;
 
-    len = strlen(name);
+	/* Found a match or a prefix, check if restrictions apply to this uid/gid */
+	if ((p->uid == uid) && (p->access & (req << NOTIFY_ACCESS_USER_SHIFT))) return NOTIFY_STATUS_OK;
+	if ((p->gid == gid) && (p->access & (req << NOTIFY_ACCESS_GROUP_SHIFT))) return NOTIFY_STATUS_OK;
+	if (p->access & (req << NOTIFY_ACCESS_OTHER_SHIFT)) return NOTIFY_STATUS_OK;
 
-	if (ns->controlled_name == NULL) ns->controlled_name_count = 0;
-	for (i = 0; i < ns->controlled_name_count; i++)
-	{
-		p = ns->controlled_name[i];
-		if (p == NULL) break;
-		if (p->name == NULL) continue;
+	return NOTIFY_STATUS_NOT_AUTHORIZED;
+}
 
-		plen = strlen(p->name);
-		if (plen > len) continue;
-		if (strncmp(p->name, name, plen)) continue;
+/*
+ * True if any user may read name.  notifyd only publishes state for these
+ * names in shared memory, since every process can map it.
+ */
+bool
+_notify_lib_world_readable(notify_state_t *ns, const char *name)
+{
+	name_info_t *p;
+	bool allowed, result;
 
-		/* Found a match or a prefix, check if restrictions apply to this uid/gid */
-		if ((p->uid == uid) && (p->access & (req << NOTIFY_ACCESS_USER_SHIFT))) break;
-		if ((p->gid == gid) && (p->access & (req << NOTIFY_ACCESS_GROUP_SHIFT))) break;
-		if (p->access & (req << NOTIFY_ACCESS_OTHER_SHIFT)) break;
+	if (name == NULL) return false;
+	if (_notify_user_uid_name(name, (uid_t)-2, &allowed)) return false;
 
-		return NOTIFY_STATUS_NOT_AUTHORIZED;
-	}
+	_notify_state_lock(&ns->lock);
+	p = _internal_controlled_ancestor(ns, name, strlen(name));
+	result = ((p == NULL) || (p->access & (NOTIFY_ACCESS_READ << NOTIFY_ACCESS_OTHER_SHIFT)));
+	_notify_state_unlock(&ns->lock);
 
-	return NOTIFY_STATUS_OK;
+	return result;
 }
 
 uint32_t
@@ -363,17 +745,102 @@ _notify_lib_check_controlled_access(notify_state_t *ns, char *name, uid_t uid, g
 	return status;
 }
 
-static inline uint32_t
-_internal_send_port(notify_state_t *ns, client_t *c, port_data_t *port_data, mach_port_t port)
+/*
+ * Only a common port that has fallen behind is asked for acks.
+ * Clients on other ports read their own messages, so they are not tracked.
+ */
+static inline bool
+_internal_ack_wanted(notify_state_t *ns, port_data_t *port_data)
+{
+	if ((ns->flags & NOTIFY_STATE_TRACK_IN_FLIGHT) == 0) return false;
+	return (port_data != NULL) && ((port_data->flags & (NOTIFY_PORT_FLAG_COMMON | NOTIFY_PORT_FLAG_BACKLOGGED)) == (NOTIFY_PORT_FLAG_COMMON | NOTIFY_PORT_FLAG_BACKLOGGED));
+}
+
+/* a receiver that has not acked in time may never ack, so posts stop waiting for it */
+static inline bool
+_internal_ack_overdue(port_data_t *port_data)
+{
+	return mach_absolute_time() >= port_data->ack_deadline;
+}
+
+/* the client stays in flight until it acks the token, or the port's ack is overdue */
+static inline void
+_internal_mark_in_flight(notify_state_t *ns, client_t *c, port_data_t *port_data)
+{
+	c->state_and_type |= NOTIFY_CLIENT_STATE_IN_FLIGHT;
+	if (_internal_ack_overdue(port_data)) port_data->ack_deadline = mach_absolute_time() + ns->ack_timeout;
+}
+
+/* a timed out send to a common port means its receiver is behind */
+static inline void
+_internal_mark_backlogged(port_data_t *port_data)
+{
+	if ((port_data != NULL) && (port_data->flags & NOTIFY_PORT_FLAG_COMMON)) port_data->flags |= NOTIFY_PORT_FLAG_BACKLOGGED;
+}
+
+/*
+ * One message carrying every token.  It asks for an ack if the port is
+ * backlogged, and is then sent even for a single token.
+ */
+static uint32_t
+_internal_port_batch_send(notify_state_t *ns, port_data_t *port_data, client_t **clients, uint32_t count)
 {
 	kern_return_t kstatus;
-	mach_msg_empty_send_t msg;
+	notify_port_batch_msg_t msg;
 	mach_msg_option_t opts = MACH_SEND_MSG | MACH_SEND_TIMEOUT;
+	bool ack = _internal_ack_wanted(ns, port_data);
+	uint32_t i;
 
-	if (port_data == NULL)
+	if (ns->flags & NOTIFY_STATE_ENABLE_RESEND) opts |= MACH_SEND_NOTIFY;
+
+	memset(&msg.header, 0, sizeof(mach_msg_header_t));
+	msg.header.msgh_size = (mach_msg_size_t)(offsetof(notify_port_batch_msg_t, tokens) + count * sizeof(int32_t));
+	msg.header.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, MACH_MSGH_BITS_ZERO);
+	msg.header.msgh_local_port = MACH_PORT_NULL;
+	msg.header.msgh_remote_port = port_data->port;
+	msg.header.msgh_id = ack ? NOTIFY_PORT_BATCH_ACK_MSG_ID : NOTIFY_PORT_BATCH_MSG_ID;
+	msg.count = count;
+	for (i = 0; i < count; i++) msg.tokens[i] = (int32_t)clients[i]->cid.token;
+
+	kstatus = mach_msg(&msg.header, opts, msg.header.msgh_size, 0, MACH_PORT_NULL, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+
+	if (kstatus == MACH_SEND_TIMED_OUT)
+	{
+		mach_msg_destroy(&msg.header);
+		_internal_mark_backlogged(port_data);
+		if ((ns->flags & NOTIFY_STATE_ENABLE_RESEND) == 0) return NOTIFY_STATUS_MACH_MSG_TIMEOUT;
+
+		/* as in _internal_send_port, every client waits for send-possible */
+		for (i = 0; i < count; i++)
+		{
+			clients[i]->suspend_count++;
+			clients[i]->state_and_type |= NOTIFY_CLIENT_STATE_SUSPENDED;
+			clients[i]->state_and_type |= NOTIFY_CLIENT_STATE_PENDING;
+			clients[i]->state_and_type |= NOTIFY_CLIENT_STATE_TIMEOUT;
+		}
+		port_data->flags |= NOTIFY_PORT_PROC_STATE_SUSPENDED;
+		return NOTIFY_STATUS_OK;
+	}
+	else if (kstatus != KERN_SUCCESS) return NOTIFY_STATUS_MACH_MSG_FAILED;
+
+	for (i = 0; i < count; i++)
 	{
-		port_data = _nc_table_find_n(&ns->port_table, port);
+		clients[i]->state_and_type &= ~NOTIFY_CLIENT_STATE_PENDING;
+		clients[i]->state_and_type &= ~NOTIFY_CLIENT_STATE_TIMEOUT;
+		if (ack) _internal_mark_in_flight(ns, clients[i], port_data);
 	}
+
+	return NOTIFY_STATUS_OK;
+}
+
+/* port_data is NULL if the port is not in the port table; nothing is looked up here */
+static inline uint32_t
+_internal_send_port_resolved(notify_state_t *ns, client_t *c, port_data_t *port_data, mach_port_t port)
+{
+	kern_return_t kstatus;
+	mach_msg_empty_send_t msg;
+	mach_msg_option_t opts = MACH_SEND_MSG | MACH_SEND_TIMEOUT;
+
 	if ((port_data != NULL) && (port_data->flags & NOTIFY_PORT_PROC_STATE_SUSPENDED))
 	{
 		c->suspend_count++;
@@ -382,6 +849,9 @@ _internal_send_port(notify_state_t *ns, client_t *c, port_data_t *port_data, mac
 		return NOTIFY_STATUS_OK;
 	}
 
+	/* the ack request only fits in a batch message */
+	if (notify_is_type(c->state_and_type, NOTIFY_TYPE_COMMON_PORT) && _internal_ack_wanted(ns, port_data)) return _internal_port_batch_send(ns, port_data, &c, 1);
+
 	if (ns->flags & NOTIFY_STATE_ENABLE_RESEND) opts |= MACH_SEND_NOTIFY;
 
 	memset(&msg, 0, sizeof(mach_msg_empty_send_t));
@@ -397,6 +867,7 @@ _internal_send_port(notify_state_t *ns, client_t *c, port_data_t *port_data, mac
 	{
 		/* deallocate port rights obtained via pseudo-receive after failed mach_msg() send */
 		mach_msg_destroy(&msg.header);
+		_internal_mark_backlogged(port_data);
 		if (ns->flags & NOTIFY_STATE_ENABLE_RESEND)
 		{
 			/*
@@ -429,11 +900,159 @@ _internal_send_port(notify_state_t *ns, client_t *c, port_data_t *port_data, mac
 	return NOTIFY_STATUS_OK;
 }
 
+static inline uint32_t
+_internal_send_port(notify_state_t *ns, client_t *c, port_data_t *port_data, mach_port_t port)
+{
+	if (port_data == NULL) port_data = _nc_table_find_n(&ns->port_table, port);
+	return _internal_send_port_resolved(ns, c, port_data, port);
+}
+
 /*
- * Send notification to a subscriber
+ * Tokens waiting to go to one common port.  A batch only lives for the
+ * call that opened it, so nothing can cancel its clients or free its
+ * port before it is flushed.
+ */
+typedef struct notify_port_batch_s
+{
+	port_data_t *port_data;
+	uint32_t count;
+	client_t *clients[NOTIFY_PORT_BATCH_MAX];
+} notify_port_batch_t;
+
+/*
+ * The fan-out shard that sends to this client.  Everything that shares
+ * a destination lands in the same shard.
+ */
+static inline uint32_t
+_internal_fanout_shard(notify_state_t *ns, client_t *c)
+{
+	if (ns->fanout_shards <= 1) return 0;
+	if (notify_is_type(c->state_and_type, NOTIFY_TYPE_XPC_EVENT)) return 0;
+	if (notify_is_type(c->state_and_type, NOTIFY_TYPE_PORT)) return c->deliver.port % ns->fanout_shards;
+	return c->cid.pid % ns->fanout_shards;
+}
+
+static void
+_internal_port_batch_flush(notify_state_t *ns, notify_port_batch_t *b)
+{
+	port_data_t *port_data = b->port_data;
+
+	if (b->count == 0) return;
+
+	if (b->count == 1) _internal_send_port(ns, b->clients[0], port_data, port_data->port);
+	else _internal_port_batch_send(ns, port_data, b->clients, b->count);
+
+	b->count = 0;
+}
+
+/*
+ * Queue a common port send on the port's batch.
+ * Falls back to sending right away if the batch table can't grow.
  */
 static uint32_t
-_internal_send(notify_state_t *ns, client_t *c,
+_internal_port_batch_add(notify_state_t *ns, client_t *c, port_data_t *port_data)
+{
+	notify_port_batch_table_t *t = &ns->port_batch[_internal_fanout_shard(ns, c)];
+	notify_port_batch_t *b;
+
+	if (port_data->flags & NOTIFY_PORT_PROC_STATE_SUSPENDED)
+	{
+		return _internal_send_port(ns, c, port_data, port_data->port);
+	}
+
+	if (port_data->batch_index == 0)
+	{
+		if (t->count == t->size)
+		{
+			uint32_t size = (t->size == 0) ? 16 : t->size * 2;
+			notify_port_batch_t *batches = realloc(t->batches, size * sizeof(notify_port_batch_t));
+			if (batches == NULL) return _internal_send_port(ns, c, port_data, port_data->port);
+
+			t->batches = batches;
+			t->size = size;
+		}
+
+		b = &t->batches[t->count++];
+		b->port_data = port_data;
+		b->count = 0;
+		port_data->batch_index = t->count;
+	}
+
+	b = &t->batches[port_data->batch_index - 1];
+	if (b->count == NOTIFY_PORT_BATCH_MAX) _internal_port_batch_flush(ns, b);
+
+	/* a timed out flush may have suspended the port */
+	if (port_data->flags & NOTIFY_PORT_PROC_STATE_SUSPENDED)
+	{
+		return _internal_send_port(ns, c, port_data, port_data->port);
+	}
+
+	c->state_and_type |= NOTIFY_CLIENT_STATE_PENDING;
+	b->clients[b->count++] = c;
+
+	return NOTIFY_STATUS_OK;
+}
+
+static void
+_internal_port_batch_begin(notify_state_t *ns)
+{
+	if (ns->flags & NOTIFY_STATE_BATCH_COMMON_PORT) ns->port_batch_depth++;
+}
+
+static void
+_internal_port_batch_end(notify_state_t *ns)
+{
+	uint32_t pending = 0;
+
+	if ((ns->flags & NOTIFY_STATE_BATCH_COMMON_PORT) == 0) return;
+	if (--ns->port_batch_depth > 0) return;
+
+	void (^flush)(size_t) = ^(size_t shard) {
+		notify_port_batch_table_t *t = &ns->port_batch[shard];
+
+		for (uint32_t i = 0; i < t->count; i++)
+		{
+			_internal_port_batch_flush(ns, &t->batches[i]);
+			t->batches[i].port_data->batch_index = 0;
+		}
+
+		t->count = 0;
+	};
+
+	for (uint32_t k = 0; k < ns->fanout_shards; k++) pending += ns->port_batch[k].count;
+
+	if (pending >= NOTIFY_FANOUT_SHARD_MIN) dispatch_apply(ns->fanout_shards, DISPATCH_APPLY_AUTO, flush);
+	else for (uint32_t k = 0; k < ns->fanout_shards; k++) flush(k);
+}
+
+/*
+ * Open a batch around several posts, so that a process subscribed to
+ * many of the names gets one message on its common port.
+ */
+void
+_notify_lib_port_batch_begin(notify_state_t *ns)
+{
+	_notify_state_lock(&ns->lock);
+	_internal_port_batch_begin(ns);
+	_notify_state_unlock(&ns->lock);
+}
+
+void
+_notify_lib_port_batch_end(notify_state_t *ns)
+{
+	_notify_state_lock(&ns->lock);
+	_internal_port_batch_end(ns);
+	_notify_state_unlock(&ns->lock);
+}
+
+/*
+ * Send notification to a subscriber whose proc and port data have been
+ * looked up already; NULL means the table has none.  This never touches
+ * the tables, since a lookup can move entries of a table being resized,
+ * which lets fan-out shards call it concurrently.
+ */
+static uint32_t
+_internal_send_resolved(notify_state_t *ns, client_t *c,
 		proc_data_t *proc_data, port_data_t *port_data)
 {
 
@@ -443,10 +1062,6 @@ _internal_send(notify_state_t *ns, client_t *c,
 		return NOTIFY_STATUS_OK;
 	}
 
-	if (proc_data == NULL)
-	{
-		proc_data = _nc_table_find_n(&ns->proc_table, c->cid.pid);
-	}
 	if ((proc_data != NULL) && (proc_data->flags & NOTIFY_PORT_PROC_STATE_SUSPENDED))
 	{
 		c->suspend_count++;
@@ -496,7 +1111,7 @@ _internal_send(notify_state_t *ns, client_t *c,
 
 		case NOTIFY_TYPE_PORT:
 		{
-			return _internal_send_port(ns, c, port_data, c->deliver.port);
+			return _internal_send_port_resolved(ns, c, port_data, c->deliver.port);
 		}
 
 		case NOTIFY_TYPE_XPC_EVENT:
@@ -504,10 +1119,7 @@ _internal_send(notify_state_t *ns, client_t *c,
 			xpc_object_t payload = xpc_dictionary_create(NULL, NULL, 0);
 			xpc_dictionary_set_string(payload, NOTIFY_XPC_EVENT_PAYLOAD_KEY_NAME, c->name_info->name);
 
-			name_info_t *n = _nc_table_find_64(&ns->name_id_table, c->name_info->name_id);
-			if (n != NULL) {
-				xpc_dictionary_set_uint64(payload, NOTIFY_XPC_EVENT_PAYLOAD_KEY_STATE, n->state);
-			}
+			xpc_dictionary_set_uint64(payload, NOTIFY_XPC_EVENT_PAYLOAD_KEY_STATE, c->name_info->state);
 
 			int rc = xpc_event_publisher_fire_noboost(ns->event_publisher, c->deliver.event_token, payload);
 			xpc_release(payload);
@@ -527,7 +1139,20 @@ _internal_send(notify_state_t *ns, client_t *c,
 			{
 				return NOTIFY_STATUS_OK;
 			}
-			return _internal_send_port(ns, c, port_data, proc_data->common_port_data->port);
+			if (port_data == NULL) port_data = proc_data->common_port_data;
+			if (c->state_and_type & NOTIFY_CLIENT_STATE_IN_FLIGHT)
+			{
+				if (!_internal_ack_overdue(port_data))
+				{
+					/* the last message is still queued, the ack will send another */
+					c->state_and_type |= NOTIFY_CLIENT_STATE_PENDING;
+					return NOTIFY_STATUS_OK;
+				}
+
+				c->state_and_type &= ~NOTIFY_CLIENT_STATE_IN_FLIGHT;
+			}
+			if (ns->port_batch_depth > 0) return _internal_port_batch_add(ns, c, port_data);
+			return _internal_send_port_resolved(ns, c, port_data, proc_data->common_port_data->port);
 		}
 
 		default:
@@ -542,6 +1167,23 @@ _internal_send(notify_state_t *ns, client_t *c,
 	return NOTIFY_STATUS_OK;
 }
 
+/*
+ * Send notification to a subscriber, looking up whichever of its proc
+ * and port data the caller does not have.
+ */
+static uint32_t
+_internal_send(notify_state_t *ns, client_t *c,
+		proc_data_t *proc_data, port_data_t *port_data)
+{
+	if (proc_data == NULL) proc_data = _nc_table_find_n(&ns->proc_table, c->cid.pid);
+	if ((port_data == NULL) && notify_is_type(c->state_and_type, NOTIFY_TYPE_PORT))
+	{
+		port_data = _nc_table_find_n(&ns->port_table, c->deliver.port);
+	}
+
+	return _internal_send_resolved(ns, c, proc_data, port_data);
+}
+
 uint32_t
 _notify_lib_post_client(notify_state_t *ns, client_t *c)
 {
@@ -556,11 +1198,66 @@ _notify_lib_post_client(notify_state_t *ns, client_t *c)
 	return status;
 }
 
+/*
+ * Every table lookup a delivery needs happens here, on the posting thread.
+ * A subscriber without proc or port data (a pid -1 client, or a port that
+ * is gone) looks again on each post, since that is cheap and rare.
+ */
+static inline void
+_internal_subscriber_prepare(notify_state_t *ns, notify_subscriber_t *s)
+{
+	client_t *c = s->client;
+
+	if (s->proc_data == NULL) s->proc_data = _nc_table_find_n(&ns->proc_table, c->cid.pid);
+	if ((s->port_data == NULL) && notify_is_type(c->state_and_type, NOTIFY_TYPE_PORT))
+	{
+		s->port_data = _nc_table_find_n(&ns->port_table, c->deliver.port);
+	}
+}
+
+static inline void
+_internal_subscriber_send(notify_state_t *ns, notify_subscriber_t *s)
+{
+	_internal_send_resolved(ns, s->client, s->proc_data, s->port_data);
+
+	/* xpc event clients are not on their pid's client list, so nothing pins the proc past this post */
+	if (notify_is_type(s->client->state_and_type, NOTIFY_TYPE_XPC_EVENT)) s->proc_data = NULL;
+}
+
+static void
+_internal_deliver_name(notify_state_t *ns, name_info_t *n)
+{
+	_internal_port_batch_begin(ns);
+
+	if ((ns->fanout_shards > 1) && (n->subscriber_count >= NOTIFY_FANOUT_SHARD_MIN))
+	{
+		/* resolve every lookup first; the shards never touch the tables */
+		for (uint32_t i = 0; i < n->subscriber_count; i++) _internal_subscriber_prepare(ns, &n->subscribers[i]);
+
+		dispatch_apply(ns->fanout_shards, DISPATCH_APPLY_AUTO, ^(size_t shard) {
+			for (uint32_t i = 0; i < n->subscriber_count; i++)
+			{
+				notify_subscriber_t *s = &n->subscribers[i];
+				if (_internal_fanout_shard(ns, s->client) == shard) _internal_subscriber_send(ns, s);
+			}
+		});
+	}
+	else
+	{
+		for (uint32_t i = 0; i < n->subscriber_count; i++)
+		{
+			_internal_subscriber_prepare(ns, &n->subscribers[i]);
+			_internal_subscriber_send(ns, &n->subscribers[i]);
+		}
+	}
+
+	_internal_port_batch_end(ns);
+}
+
 static uint32_t
 _internal_post_name(notify_state_t *ns, name_info_t *n, uid_t uid, gid_t gid)
 {
 	int auth;
-	client_t *c;
 
 	if (n == NULL) return NOTIFY_STATUS_INVALID_NAME;
 
@@ -568,11 +1265,53 @@ _internal_post_name(notify_state_t *ns, name_info_t *n, uid_t uid, gid_t gid)
 	if (auth != 0) return NOTIFY_STATUS_NOT_AUTHORIZED;
 
 	n->val++;
+	_internal_deliver_name(ns, n);
 
-	LIST_FOREACH(c, &n->subscriptions, client_subscription_entry) {
-		_internal_send(ns, c, NULL, NULL);
+	return NOTIFY_STATUS_OK;
+}
+
+/*
+ * Post without sending anything.  Only the name's value changes, which
+ * is all that check clients look at.  notifyd uses this for posts that a
+ * coalescing window folds into one later _notify_lib_deliver_nid.
+ */
+uint32_t
+_notify_lib_post_nid_quiet(notify_state_t *ns, uint64_t nid, uid_t uid, gid_t gid)
+{
+	name_info_t *n;
+	uint32_t status = NOTIFY_STATUS_OK;
+
+	_notify_state_lock(&ns->lock);
+
+	n = _nc_table_find_64(&ns->name_id_table, nid);
+	if (n == NULL) status = NOTIFY_STATUS_INVALID_NAME;
+	else if (_internal_check_access(ns, n->name, uid, gid, NOTIFY_ACCESS_WRITE) != 0) status = NOTIFY_STATUS_NOT_AUTHORIZED;
+	else n->val++;
+
+	_notify_state_unlock(&ns->lock);
+	return status;
+}
+
+/*
+ * Send to the subscribers of a name without changing its value.
+ */
+uint32_t
+_notify_lib_deliver_nid(notify_state_t *ns, uint64_t nid)
+{
+	name_info_t *n;
+
+	_notify_state_lock(&ns->lock);
+
+	n = _nc_table_find_64(&ns->name_id_table, nid);
+	if (n == NULL)
+	{
+		_notify_state_unlock(&ns->lock);
+		return NOTIFY_STATUS_INVALID_NAME;
 	}
 
+	_internal_deliver_name(ns, n);
+
+	_notify_state_unlock(&ns->lock);
 	return NOTIFY_STATUS_OK;
 }
 
@@ -630,9 +1369,13 @@ _internal_release_name_info(notify_state_t *ns, name_info_t *n)
 	if (n->refcount == 0)
 	{
 		_internal_remove_controlled_name(ns, n);
-		_nc_table_delete(&ns->name_table, n->name);
+		_nc_table_delete_hashed(&ns->name_table, n->name, n->name_hash);
 		_nc_table_delete_64(&ns->name_id_table, n->name_id);
-		free(n);
+		free(n->subscribers);
+
+		uint32_t class = _internal_name_pool_class(strlen(n->name) + 1);
+		if (class < NOTIFY_NAME_POOL_CLASSES) _internal_pool_free(&ns->name_pool[class], n);
+		else free(n);
 		ns->stat_name_free++;
 	}
 }
@@ -644,8 +1387,18 @@ static void
 _internal_cancel(notify_state_t *ns, client_t *c)
 {
 	name_info_t *n = c->name_info;
+	uint32_t last = n->subscriber_count - 1;
 
 	LIST_REMOVE(c, client_subscription_entry);
+
+	/* move the last subscriber into the hole */
+	if (c->subscriber_index != last)
+	{
+		n->subscribers[c->subscriber_index] = n->subscribers[last];
+		n->subscribers[c->subscriber_index].client->subscriber_index = c->subscriber_index;
+	}
+	n->subscriber_count = last;
+
 	_internal_client_release(ns, c);
 	_internal_release_name_info(ns, n);
 }
@@ -718,6 +1471,53 @@ _notify_lib_resume_client(notify_state_t *ns, client_t *c,
 	_notify_state_unlock(&ns->lock);
 }
 
+/*
+ * The client has read the messages for these tokens.
+ * Any post that arrived while they were in flight is sent now.  If none
+ * did, the receiver has caught up and its port is no longer backlogged.
+ */
+void
+_notify_lib_ack(notify_state_t *ns, pid_t pid, const int *tokens, uint32_t count)
+{
+	proc_data_t *proc_data;
+	port_data_t *port_data;
+	bool resent = false;
+	client_t *c;
+
+	_notify_state_lock(&ns->lock);
+
+	proc_data = _nc_table_find_n(&ns->proc_table, pid);
+	port_data = (proc_data == NULL) ? NULL : proc_data->common_port_data;
+	if (port_data == NULL)
+	{
+		_notify_state_unlock(&ns->lock);
+		return;
+	}
+
+	/* the receiver is reading, so the clients still in flight wait a while longer */
+	port_data->ack_deadline = mach_absolute_time() + ns->ack_timeout;
+
+	_internal_port_batch_begin(ns);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		c = _nc_table_find_64(&ns->client_table, make_client_id(pid, tokens[i]));
+		if ((c == NULL) || ((c->state_and_type & NOTIFY_CLIENT_STATE_IN_FLIGHT) == 0)) continue;
+
+		c->state_and_type &= ~NOTIFY_CLIENT_STATE_IN_FLIGHT;
+		if (c->state_and_type & NOTIFY_CLIENT_STATE_PENDING)
+		{
+			_internal_send(ns, c, proc_data, port_data);
+			resent = true;
+		}
+	}
+
+	if (!resent) port_data->flags &= ~NOTIFY_PORT_FLAG_BACKLOGGED;
+
+	_internal_port_batch_end(ns);
+	_notify_state_unlock(&ns->lock);
+}
+
 uint32_t
 _notify_lib_resume(notify_state_t *ns, pid_t pid, int token)
 {
@@ -882,6 +1682,7 @@ _internal_register_common(notify_state_t *ns, const char *name, pid_t pid, int t
 	client_t *c;
 	name_info_t *n;
 	uint32_t status;
+	uint64_t hash;
 
 	if (name == NULL) return NOTIFY_STATUS_INVALID_NAME;
 	if (outc == NULL) return NOTIFY_STATUS_OK;
@@ -891,10 +1692,11 @@ _internal_register_common(notify_state_t *ns, const char *name, pid_t pid, int t
 
 	*outc = NULL;
 
-	n = _nc_table_find(&ns->name_table, name);
+	hash = _nc_string_hash(name, strlen(name));
+	n = _nc_table_find_hashed(&ns->name_table, name, hash);
 	if (n == NULL)
 	{
-		n = _internal_new_name(ns, name);
+		n = _internal_new_name(ns, name, hash);
 		if (n == NULL) return NOTIFY_STATUS_NEW_NAME_FAILED;
 	}
 
@@ -1111,16 +1913,19 @@ uint32_t
 _notify_lib_set_owner(notify_state_t *ns, const char *name, uid_t uid, gid_t gid)
 {
 	name_info_t *n;
+	uint64_t hash;
 
 	if (name == NULL) return NOTIFY_STATUS_INVALID_NAME;
 
+	hash = _nc_string_hash(name, strlen(name));
+
 	_notify_state_lock(&ns->lock);
 
-	n = _nc_table_find(&ns->name_table, name);
+	n = _nc_table_find_hashed(&ns->name_table, name, hash);
 	if (n == NULL)
 	{
 		/* create new name */
-		n = _internal_new_name(ns, name);
+		n = _internal_new_name(ns, name, hash);
 		if (n == NULL)
 		{
 			_notify_state_unlock(&ns->lock);
@@ -1148,16 +1953,19 @@ uint32_t
 _notify_lib_set_access(notify_state_t *ns, const char *name, uint32_t mode)
 {
 	name_info_t *n;
+	uint64_t hash;
 
 	if (name == NULL) return NOTIFY_STATUS_INVALID_NAME;
 
+	hash = _nc_string_hash(name, strlen(name));
+
 	_notify_state_lock(&ns->lock);
 
-	n = _nc_table_find(&ns->name_table, name);
+	n = _nc_table_find_hashed(&ns->name_table, name, hash);
 	if (n == NULL)
 	{
 		/* create new name */
-		n = _internal_new_name(ns, name);
+		n = _internal_new_name(ns, name, hash);
 		if (n == NULL)
 		{
 			_notify_state_unlock(&ns->lock);
@@ -37,6 +37,33 @@
 extern const char *_notify_shm_id(void);
 #define SHM_ID _notify_shm_id()
 
+/*
+ * The shared memory table starts as one segment named SHM_ID and grows by
+ * adding segments of the same size.  Slot n lives in segment
+ * n / (slots per segment).
+ */
+#define NOTIFY_SHM_MAX_SEGMENTS 256
+#define NOTIFY_SHM_SEGMENT_ID_LEN 32
+extern void _notify_shm_segment_id(const char *base, uint32_t segment, char *buf, size_t len);
+
+/*
+ * Each segment has a companion state segment with one record per slot,
+ * so notify_get_state can read a name's state without IPC.  notifyd is
+ * the only writer: seq is odd while a write is in progress, and readers
+ * retry until they see the same even seq before and after reading.  nid
+ * is the name the record currently belongs to (0 if none, or if the name
+ * is not world-readable); slots are reused, and nids never are.
+ */
+typedef struct
+{
+	uint32_t seq;
+	uint32_t reserved;
+	uint64_t nid;
+	uint64_t state;
+} notify_shm_state_t;
+
+extern void _notify_shm_state_id(const char *base, uint32_t segment, char *buf, size_t len);
+
 #define NOTIFY_IPC_VERSION_NAME "com.apple.system.notify.ipc_version"
 #define NOTIFY_IPC_VERSION_NAME_LEN 35
 #define NOTIFY_SERVICE_NAME "com.apple.system.notification_center"
@@ -44,6 +71,160 @@ extern const char *_notify_shm_id(void);
 #define NOTIFY_IPC_VERSION_MIN_SUPPORTED 3
 #define NOTIFY_IPC_VERSION 3
 
+/*
+ * Per-message limits for the batched routines.  Names travel as a buffer
+ * of NUL-terminated strings; _notify_server_post_many sends names with a
+ * known name ID as IDs instead, and _notify_server_register_common_port_many
+ * sends one token per name.  These must match the array bounds in
+ * notify_ipc.defs.
+ */
+#define NOTIFY_BATCH_NAME_BYTES 4096
+#define NOTIFY_POST_MANY_MAX_IDS 64
+#define NOTIFY_REGISTER_MANY_MAX_TOKENS 64
+
+typedef uint64_t *notify_nid_list_t;
+typedef int *notify_token_list_t;
+
+/*
+ * _notify_server_regenerate_many takes an out-of-line buffer of
+ * registrations, each a notify_regen_entry_t followed by name_len bytes
+ * of NUL-terminated name and path_len bytes of NUL-terminated path (or
+ * none), padded to a multiple of 8 bytes.  It returns one
+ * notify_regen_result_t per entry, in the same order.  Clients split
+ * their registrations into buffers of at most NOTIFY_REGEN_MANY_MAX_BYTES.
+ */
+#define NOTIFY_REGEN_MANY_MAX_BYTES (256 * 1024)
+#define NOTIFY_REGEN_NAME_MAX 512
+
+typedef struct
+{
+	int32_t token;
+	uint32_t reg_type;
+	int32_t sig;
+	int32_t prev_slot;
+	uint64_t prev_state;
+	uint64_t prev_time;
+	uint32_t path_flags;
+	uint16_t name_len;
+	uint16_t path_len;
+} notify_regen_entry_t;
+
+typedef struct
+{
+	uint64_t nid;
+	int32_t slot;
+	int32_t status;
+} notify_regen_result_t;
+
+#define NOTIFY_REGEN_ENTRY_SIZE(name_len, path_len) ((sizeof(notify_regen_entry_t) + (size_t)(name_len) + (size_t)(path_len) + 7) & ~(size_t)7)
+
+/* reports notifyd writes for _notify_server_dump_2 */
+#define NOTIFY_DUMP_STATUS 0
+#define NOTIFY_DUMP_TOP_POSTERS 2
+#define NOTIFY_DUMP_HISTOGRAMS 3
+#define NOTIFY_DUMP_BINARY 4
+
+/*
+ * Binary state dump, written for NOTIFY_DUMP_BINARY.  The file is a
+ * notify_dump_header_t followed by records, each a notify_dump_record_t
+ * and length bytes of payload, padded to a multiple of 8 bytes; readers
+ * skip record types they do not know.  Each name record is followed by the client records of its
+ * subscribers.  notifyd writes the file a chunk at a time, serving other
+ * requests in between, so a file that does not end with an empty
+ * NOTIFY_DUMP_REC_END record is still being written.  Names and clients
+ * may change while a dump is in progress; each record is consistent, the
+ * dump as a whole is not a snapshot.
+ */
+#define NOTIFY_DUMP_MAGIC 0x706d646e /* "ndmp" */
+#define NOTIFY_DUMP_VERSION 1
+
+#define NOTIFY_DUMP_REC_END 0
+#define NOTIFY_DUMP_REC_GLOBALS 1
+#define NOTIFY_DUMP_REC_STAT 2
+#define NOTIFY_DUMP_REC_NAME 3
+#define NOTIFY_DUMP_REC_CLIENT 4
+#define NOTIFY_DUMP_REC_PROC 5
+#define NOTIFY_DUMP_REC_PORT 6
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	int64_t time;
+	uint32_t pid;
+	uint32_t reserved;
+} notify_dump_header_t;
+
+typedef struct
+{
+	uint32_t type;
+	uint32_t length;
+} notify_dump_record_t;
+
+typedef struct
+{
+	int64_t last_reset_time;
+	uint32_t nslots;
+	uint32_t shm_segment_count;
+	uint32_t slots_in_use;
+	uint32_t log_cutoff;
+	uint32_t log_default;
+	uint32_t fanout_shards;
+	uint32_t name_count;
+	uint32_t client_count;
+	uint32_t proc_count;
+	uint32_t port_count;
+} notify_dump_globals_t;
+
+/* NOTIFY_DUMP_REC_STAT: a counter, followed by its label */
+typedef struct
+{
+	uint64_t value;
+} notify_dump_stat_t;
+
+/* NOTIFY_DUMP_REC_NAME: followed by the name, NUL-terminated */
+typedef struct
+{
+	uint64_t name_id;
+	uint64_t state;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t access;
+	uint32_t refcount;
+	uint32_t postcount;
+	uint32_t last_hour_postcount;
+	uint32_t slot;
+	uint32_t slot_value;
+	uint32_t slot_refcount;
+	uint32_t val;
+} notify_dump_name_t;
+
+/* NOTIFY_DUMP_REC_CLIENT: deliver is the port, fd, signal or event token, by type */
+typedef struct
+{
+	uint64_t deliver;
+	uint32_t pid;
+	uint32_t token;
+	uint32_t lastval;
+	uint8_t suspend_count;
+	uint8_t type;
+	uint16_t reserved;
+} notify_dump_client_t;
+
+typedef struct
+{
+	uint32_t pid;
+	uint32_t flags;
+	uint32_t common_port;
+	uint32_t reserved;
+} notify_dump_proc_t;
+
+typedef struct
+{
+	uint32_t port;
+	uint32_t flags;
+} notify_dump_port_t;
+
 /* extra internal flags to notify_register_mach_port */
 /* Make sure this doesn't conflict with any flags in notify.h or notify_private.h */
 #define _NOTIFY_COMMON_PORT 0x40000000
@@ -102,6 +283,7 @@ extern const char *_notify_shm_id(void);
 #define NOTIFY_SERVICE_DIR_FILE_ADD    0x10
 #define NOTIFY_SERVICE_DIR_FILE_DELETE 0x20
 
+#define NOTIFY_CLIENT_STATE_IN_FLIGHT 0x00000010
 #define NOTIFY_CLIENT_STATE_SUSPENDED 0x00000020
 #define NOTIFY_CLIENT_STATE_PENDING   0x00000040
 #define NOTIFY_CLIENT_STATE_TIMEOUT   0x00000080
@@ -111,10 +293,13 @@ extern const char *_notify_shm_id(void);
 #define NOTIFY_PORT_PROC_STATE_SUSPENDED	0x00000001
 #define NOTIFY_PORT_FLAG_COMMON			0x00000002
 #define NOTIFY_PORT_FLAG_COMMON_READY_TO_FREE   0x00000004
+#define NOTIFY_PORT_FLAG_BACKLOGGED		0x00000008
 
 /* notify state flags */
 #define NOTIFY_STATE_USE_LOCKS 0x00000001
 #define NOTIFY_STATE_ENABLE_RESEND 0x00000002
+#define NOTIFY_STATE_BATCH_COMMON_PORT 0x00000004
+#define NOTIFY_STATE_TRACK_IN_FLIGHT 0x00000008
 
 #define NOTIFY_XPC_EVENT_PAYLOAD_KEY_NAME "Notification"
 #define NOTIFY_XPC_EVENT_PAYLOAD_KEY_STATE "_State"
@@ -127,7 +312,12 @@ extern const char *_notify_shm_id(void);
 typedef struct
 {
 	LIST_HEAD(, client_s) subscriptions;
+	struct notify_subscriber_s *subscribers;
+	uint32_t subscriber_count;
+	uint32_t subscriber_size;
+	struct notify_coalesce_s *coalesce;
 	char *name;
+	uint64_t name_hash;
 	uint64_t name_id;
 	uint64_t state;
 	uint64_t state_time;
@@ -135,10 +325,13 @@ typedef struct
 	uint32_t gid;
 	uint32_t access;
 	uint32_t slot;
+	/* memory registrations using slot */
+	uint32_t slot_refcount;
 	uint32_t refcount;
 	uint32_t val;
 	uint32_t postcount;
 	uint32_t last_hour_postcount;
+	uint32_t stat_epoch;
 } name_info_t;
 
 typedef union client_delivery_u
@@ -164,6 +357,7 @@ typedef struct client_s
 		uint64_t hash_key;
 	} cid;
 	uint32_t lastval;
+	uint32_t subscriber_index;
 	uint16_t service_index;
 	uint8_t suspend_count;
 	uint8_t state_and_type;
@@ -174,6 +368,9 @@ typedef struct
 	LIST_HEAD(, client_s) clients;
 	mach_port_t port;
 	uint32_t flags;
+	uint32_t batch_index;
+	/* mach_absolute_time() by which an ack is due while clients are in flight */
+	uint64_t ack_deadline;
 } port_data_t;
 
 typedef struct
@@ -185,12 +382,95 @@ typedef struct
 	port_data_t *common_port_data;
 } proc_data_t;
 
+/*
+ * Entry in a name's packed subscriber array, which _internal_post_name
+ * scans instead of walking the subscriptions list.  proc_data and
+ * port_data are looked up on the first send and then kept: notifyd frees
+ * them only after their client lists are empty, and a client leaves this
+ * array when it is cancelled.  xpc event clients are on no proc list, so
+ * they are never cached.
+ */
+typedef struct notify_subscriber_s
+{
+	client_t *client;
+	proc_data_t *proc_data;
+	port_data_t *port_data;
+} notify_subscriber_t;
+
 typedef struct
 {
 	client_t *client;
 	uint64_t event_token;
 } event_data_t;
 
+/*
+ * Common port batching.  With NOTIFY_STATE_BATCH_COMMON_PORT set, sends
+ * to common ports made while a batch is open are collected per port and
+ * flushed as one message carrying every token, with msgh_id set to
+ * NOTIFY_PORT_BATCH_MSG_ID.  Tokens are positive, so the id can not be
+ * mistaken for one.  A port with a single pending token still gets the
+ * usual empty message with msgh_id = token.
+ *
+ * With NOTIFY_STATE_TRACK_IN_FLIGHT set, a common port whose receiver
+ * has fallen behind (a send to it timed out) is marked
+ * NOTIFY_PORT_FLAG_BACKLOGGED.  Messages to a backlogged port use
+ * NOTIFY_PORT_BATCH_ACK_MSG_ID, even for a single token, and ask the
+ * client library to acknowledge their tokens with _notify_server_ack.
+ * Each client sent one is marked NOTIFY_CLIENT_STATE_IN_FLIGHT, and posts
+ * until the ack only mark it pending; the ack sends one more message, so
+ * a slow receiver has at most one message queued per token.  An ack that
+ * finds nothing pending clears the backlog.  A port with no ack for
+ * NOTIFY_ACK_TIMEOUT_MSEC stops holding posts back.  Ports that keep up
+ * get plain messages and send no acks.
+ */
+#define NOTIFY_PORT_BATCH_MSG_ID INT32_MIN
+#define NOTIFY_PORT_BATCH_ACK_MSG_ID (INT32_MIN + 1)
+#define NOTIFY_PORT_BATCH_MAX 64
+#define NOTIFY_ACK_TIMEOUT_MSEC 1000
+
+typedef struct
+{
+	mach_msg_header_t header;
+	uint32_t count;
+	int32_t tokens[NOTIFY_PORT_BATCH_MAX];
+} notify_port_batch_msg_t;
+
+/*
+ * Fan-out shards.  A post to a name with at least NOTIFY_FANOUT_SHARD_MIN
+ * subscribers makes its sends from fanout_shards threads at once.
+ * Subscribers are split by destination (the port for port clients, the
+ * pid for everything else, xpc events always in shard 0), so every
+ * client, port_data_t and port batch is only touched by one thread.
+ */
+#define NOTIFY_FANOUT_MAX_SHARDS 16
+#define NOTIFY_FANOUT_SHARD_MIN 128
+
+typedef struct
+{
+	struct notify_port_batch_s *batches;
+	uint32_t count;
+	uint32_t size;
+} notify_port_batch_table_t;
+
+/*
+ * Slab pool of fixed size objects.
+ * Freed objects are threaded on free_list through their first word.
+ */
+typedef struct
+{
+	void *free_list;
+	uint32_t object_size;
+	uint32_t free_count;
+	uint32_t slab_count;
+} notify_pool_t;
+
+/* name_info_t and its inline name are carved from size-classed pools */
+#define NOTIFY_NAME_POOL_CLASSES 6
+#define NOTIFY_NAME_POOL_MAX_SIZE 640
+
+/* longest name a notify_name in notify_ipc.defs carries, NUL included */
+#define NOTIFY_MIG_NAME_MAX 512
+
 typedef struct
 {
 	/* last allocated name id */
@@ -201,7 +481,7 @@ typedef struct
 	table_n_t port_table;
 	table_n_t proc_table;
 	table_64_t event_table;
-	name_info_t **controlled_name;
+	struct notify_prefix_node_s *controlled_names;
 	xpc_event_publisher_t event_publisher;
 	uint32_t flags;
 	uint32_t controlled_name_count;
@@ -213,13 +493,32 @@ typedef struct
 	uint32_t stat_client_free;
 	uint32_t stat_portproc_alloc;
 	uint32_t stat_portproc_free;
+	/* bumped hourly; postcount is for this epoch, last_hour_postcount the one before */
+	uint32_t stat_epoch;
+	notify_pool_t client_pool;
+	notify_pool_t name_pool[NOTIFY_NAME_POOL_CLASSES];
+	notify_port_batch_table_t port_batch[NOTIFY_FANOUT_MAX_SHARDS];
+	uint32_t port_batch_depth;
+	uint32_t fanout_shards;
+	/* NOTIFY_ACK_TIMEOUT_MSEC in mach_absolute_time() units */
+	uint64_t ack_timeout;
 } notify_state_t;
 
 void _notify_lib_notify_state_init(notify_state_t * ns, uint32_t flags);
+void _notify_lib_foreach_controlled_name(notify_state_t *ns, OS_NOESCAPE bool (^handler)(name_info_t *n));
 
 uint32_t _notify_lib_post(notify_state_t *ns, const char *name, uint32_t uid, uint32_t gid);
 uint32_t _notify_lib_post_nid(notify_state_t *ns, uint64_t nid, uid_t uid, gid_t gid);
+uint32_t _notify_lib_post_nid_quiet(notify_state_t *ns, uint64_t nid, uid_t uid, gid_t gid);
+uint32_t _notify_lib_deliver_nid(notify_state_t *ns, uint64_t nid);
 uint32_t _notify_lib_post_client(notify_state_t *ns, client_t *c);
+void _notify_lib_port_batch_begin(notify_state_t *ns);
+void _notify_lib_port_batch_end(notify_state_t *ns);
+void _notify_lib_ack(notify_state_t *ns, pid_t pid, const int *tokens, uint32_t count);
+
+void _notify_lib_stats_reset(notify_state_t *ns);
+void _notify_lib_name_stats(notify_state_t *ns, name_info_t *n);
+void _notify_lib_name_posted(notify_state_t *ns, name_info_t *n);
 
 uint32_t _notify_lib_check(notify_state_t *ns, pid_t pid, int token, int *check);
 uint32_t _notify_lib_get_state(notify_state_t *ns, uint64_t nid, uint64_t *state, uint32_t uid, uint32_t gid);
@@ -243,6 +542,7 @@ uint32_t _notify_lib_suspend(notify_state_t *ns, pid_t pid, int token);
 uint32_t _notify_lib_resume(notify_state_t *ns, pid_t pid, int token);
 
 uint32_t _notify_lib_check_controlled_access(notify_state_t *ns, char *name, uid_t uid, gid_t gid, int req);
+bool _notify_lib_world_readable(notify_state_t *ns, const char *name);
 
 uint64_t make_client_id(pid_t pid, int token);
 
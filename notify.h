@@ -27,6 +27,7 @@
 #define __NOTIFICATION_H__
 
 #include <sys/cdefs.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <mach/message.h>
 #include <os/base.h>
@@ -118,6 +119,22 @@ __BEGIN_DECLS
  */
 OS_EXPORT uint32_t notify_post(const char *name);
 
+/*!
+ * Post notifications for several names.
+ *
+ * Equivalent to calling notify_post for each name in turn, but the names are
+ * sent to the server in as few messages as possible, so posting a group
+ * of related names costs roughly one IPC rather than one per name.
+ * Every name is posted even if an earlier one fails.
+ * Returns NOTIFY_STATUS_OK, or the status of the first name that failed.
+ *
+ * @param names
+ *     (input) array of notification names
+ * @param count
+ *     (input) number of names in the array
+ */
+OS_EXPORT uint32_t notify_post_many(const char **names, size_t count);
+
 
 #ifdef __BLOCKS__
 typedef void (^notify_handler_t)(int token);
@@ -145,6 +162,24 @@ typedef void (^notify_handler_t)(int token);
  */
 OS_EXPORT uint32_t notify_register_dispatch(const char *name, int *out_token, dispatch_queue_t queue, notify_handler_t handler)
 __OSX_AVAILABLE_STARTING(__MAC_10_6,__IPHONE_3_2);
+
+/*!
+ * @function   notify_register_dispatch_many
+ * @abstract   Request notification delivery to a dispatch queue for several names.
+ * @discussion Equivalent to calling notify_register_dispatch for each name
+ *             with the same queue and handler, but the registrations reach
+ *             the server in as few messages as possible.  Either all names
+ *             are registered, or none are and every token is set to
+ *             NOTIFY_TOKEN_INVALID.
+ * @param names (input) Array of notification names.
+ * @param count (input) Number of names in the array.
+ * @param out_tokens (output) Array of count registration tokens, one per name.
+ * @param queue (input) The dispatch queue to which the Block is submitted.
+ * @param handler (input) The Block to invoke on the dispatch queue in response
+ *              to a notification for any of the names.
+ * @result Returns status.
+ */
+OS_EXPORT uint32_t notify_register_dispatch_many(const char **names, size_t count, int *out_tokens, dispatch_queue_t queue, notify_handler_t handler);
 #endif /* __BLOCKS__ */
 
 /*!
@@ -96,6 +96,9 @@ static uint32_t _libnotify_debug = DEBUG_ALL;
 // NOTIFY_SERVER_RETRY_WAIT_US microseconds.
 #define NOTIFY_SERVER_RETRY_WAIT_US 100000
 #define NOTIFY_SERVER_RETRY_NUMBER 50
+// Regeneration retries instead wait a random time from a window that starts
+// at NOTIFY_REGEN_RETRY_MIN_WAIT_US and doubles up to NOTIFY_SERVER_RETRY_WAIT_US.
+#define NOTIFY_REGEN_RETRY_MIN_WAIT_US 1000
 
 /*
  * Details about registrations, tokens, dispatch (NOTIFY_OPT_DISPATCH), IPC versions, and etc.
@@ -159,9 +162,17 @@ typedef struct
 	TAILQ_HEAD(, __registration_node_s) coalesced;
 	struct __registration_node_s *coalesce_base;
 	char *name;
+	uint64_t name_hash;
 	os_unfair_lock lock;
 	atomic_uint_fast32_t refcount;
 	uint32_t coalesce_base_token;
+	/* the base is queued on a notify_register_dispatch_many batch notifyd has not seen yet; global lock */
+	bool coalesce_base_unsent;
+	/* notify_set_state calls sent, and how many of them an IPC get has seen */
+	uint32_t state_sets;
+	uint32_t state_synced;
+	/* NOTIFY_OPT_COALESCE_POSTS: a post is waiting on the background send queue */
+	atomic_bool post_pending;
 	bool has_been_warned;
 	bool needs_free;
 } name_node_t;
@@ -212,6 +223,19 @@ typedef struct __registration_node_s
 	name_node_t *name_node;
 } registration_node_t;
 
+/*
+ * Base registrations for common port names, queued by
+ * notify_register_dispatch_many so that notifyd hears about all
+ * of them in one _notify_server_register_common_port_many message.
+ */
+typedef struct
+{
+	mach_msg_type_number_t token_count;
+	mach_msg_type_number_t names_len;
+	int tokens[NOTIFY_REGISTER_MANY_MAX_TOKENS];
+	char names[NOTIFY_BATCH_NAME_BYTES];
+} common_port_batch_t;
+
 
 /* FORWARD */
 static void _notify_lib_server_restart_handler(void *ctxt);
@@ -221,7 +245,8 @@ static void registration_node_release(registration_node_t *r);
 static void registration_node_release_locked(notify_globals_t globals, registration_node_t *r);
 static void notify_release_file_descriptor_locked(notify_globals_t globals, int fd);
 static void notify_release_mach_port_locked(notify_globals_t globals, mach_port_t mp, uint32_t flags);
-static uint32_t notify_register_coalesced_registration(const char *name, int flags, int *out_token, notify_globals_t globals, mach_port_t extra_mp);
+static uint32_t notify_register_coalesced_registration(const char *name, int flags, int *out_token, notify_globals_t globals, mach_port_t extra_mp, common_port_batch_t *batch);
+static kern_return_t common_port_batch_flush(notify_globals_t globals, common_port_batch_t *batch);
 
 // TSAN doesn't know about os_unfair_lock_with_options
 #if defined(__has_feature)
@@ -402,9 +427,11 @@ _notify_init_globals(void * /* notify_globals_t */ _globals)
 	globals->notify_lock = OS_UNFAIR_LOCK_INIT;
 	os_atomic_store(&globals->token_id, INITIAL_TOKEN_ID, relaxed);
 	globals->notify_common_token = -1;
-	globals->check_lock = OS_UNFAIR_LOCK_INIT;
+
+	/* a fork child starts over at INITIAL_TOKEN_ID, so the parent's registrations must not be found */
+	memset(&globals->registration_index, 0, sizeof(globals->registration_index));
+	globals->registration_free_list = NULL;
 	_nc_table_init(&globals->name_node_table, offsetof(name_node_t, name));
-	_nc_table_init_n(&globals->registration_table, offsetof(registration_node_t, token));
 
 	_notify_lib_notify_state_init(&globals->self_state, NOTIFY_STATE_USE_LOCKS);
 }
@@ -476,7 +503,8 @@ name_node_for_name_locked(notify_globals_t globals, const char *name, uint64_t n
 
 	if (name == NULL) return NULL;
 
-	name_node_t *n = _nc_table_find(&globals->name_node_table, name);
+	uint64_t hash = _nc_string_hash(name, strlen(name));
+	name_node_t *n = _nc_table_find_hashed(&globals->name_node_table, name, hash);
 	if (n != NULL)
 	{
 		name_node_retain(n);
@@ -501,13 +529,15 @@ name_node_for_name_locked(notify_globals_t globals, const char *name, uint64_t n
 		}
 
 		os_atomic_store(&n->refcount, 1, relaxed);
+		n->name_hash = hash;
 		n->name_id = nid;
 		TAILQ_INIT(&n->coalesced);
 		n->coalesce_base_token = NOTIFY_TOKEN_INVALID;
+		n->coalesce_base_unsent = false;
 		n->lock = OS_UNFAIR_LOCK_INIT;
 		n->has_been_warned = false;
 
-		_nc_table_insert(&globals->name_node_table, &n->name);
+		_nc_table_insert_hashed(&globals->name_node_table, &n->name, n->name_hash);
 	}
 
 done:
@@ -544,7 +574,7 @@ name_node_delete_locked(notify_globals_t globals, name_node_t *n)
 	if (_libnotify_debug & DEBUG_NODES) _notify_client_log(ASL_LEVEL_NOTICE, "name_node_release name %s refcount %d %p FREE", n->name, n->refcount, n);
 #endif
 
-	_nc_table_delete(&globals->name_node_table, n->name);
+	_nc_table_delete_hashed(&globals->name_node_table, n->name, n->name_hash);
 	if (n->needs_free) {
 		free(n->name);
 	}
@@ -639,15 +669,147 @@ name_node_set_nid(name_node_t *n, uint64_t nid)
 #pragma mark -
 #pragma mark registration_node_t
 
+/*
+ * Registrations are indexed by token in a radix array of
+ * NOTIFY_TOKEN_LEVELS levels, each taking NOTIFY_TOKEN_PAGE_BITS of the
+ * token, most significant bits first.  Tokens are handed out sequentially,
+ * so a process only ever touches a handful of pages.
+ *
+ * The index is only modified with the global lock held, but lookups take
+ * no lock at all.  That is safe because index pages are never freed once
+ * published, and registration nodes are type-stable: when freed they go
+ * on registration_free_list instead of back to malloc.  A lookup can
+ * therefore always try to retain whatever node it finds, and then check
+ * that the node is still the one indexed under its token.
+ */
+#define NOTIFY_TOKEN_LEVELS 4
+
+static void **
+registration_index_entry(notify_globals_t globals, uint32_t token, bool create)
+{
+	notify_token_page_t *page = &globals->registration_index;
+
+	for (uint32_t level = NOTIFY_TOKEN_LEVELS - 1; level > 0; level--)
+	{
+		void **entry = &page->entry[(token >> (level * NOTIFY_TOKEN_PAGE_BITS)) & (NOTIFY_TOKEN_PAGE_SIZE - 1)];
+		notify_token_page_t *next = os_atomic_load(entry, acquire);
+
+		if (next == NULL)
+		{
+			if (!create) return NULL;
+
+			os_unfair_lock_assert_owner(&globals->notify_lock);
+			next = calloc(1, sizeof(notify_token_page_t));
+			if (next == NULL) return NULL;
+			os_atomic_store(entry, next, release);
+		}
+
+		page = next;
+	}
+
+	return &page->entry[token & (NOTIFY_TOKEN_PAGE_SIZE - 1)];
+}
+
+// must be called with the global lock held
+static registration_node_t *
+registration_index_find_locked(notify_globals_t globals, uint32_t token)
+{
+	os_unfair_lock_assert_owner(&globals->notify_lock);
+
+	void **entry = registration_index_entry(globals, token, false);
+	if (entry == NULL) return NULL;
+	return os_atomic_load(entry, relaxed);
+}
+
+static bool
+registration_index_foreach_page(notify_token_page_t *page, uint32_t level, OS_NOESCAPE bool (^block)(registration_node_t *))
+{
+	for (uint32_t i = 0; i < NOTIFY_TOKEN_PAGE_SIZE; i++)
+	{
+		void *entry = os_atomic_load(&page->entry[i], relaxed);
+		if (entry == NULL) continue;
+
+		if (level > 0)
+		{
+			if (!registration_index_foreach_page(entry, level - 1, block)) return false;
+		}
+		else if (!block(entry))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// must be called with the global lock held
+static void
+registration_index_foreach_locked(notify_globals_t globals, OS_NOESCAPE bool (^block)(registration_node_t *))
+{
+	os_unfair_lock_assert_owner(&globals->notify_lock);
+	registration_index_foreach_page(&globals->registration_index, NOTIFY_TOKEN_LEVELS - 1, block);
+}
+
+// must be called with the global lock held
+static registration_node_t *
+registration_node_alloc_locked(notify_globals_t globals)
+{
+	os_unfair_lock_assert_owner(&globals->notify_lock);
+
+	registration_node_t *r = globals->registration_free_list;
+	if (r == NULL) return (registration_node_t *)calloc(1, sizeof(registration_node_t));
+
+	/* free nodes are linked through their (unused) coalesced list entry */
+	globals->registration_free_list = r->registration_coalesced_entry.tqe_next;
+
+	/* refcount is already zero, which keeps lookups from retaining the node */
+	memset(r, 0, offsetof(registration_node_t, refcount));
+	memset((char *)r + offsetof(registration_node_t, refcount) + sizeof(r->refcount), 0,
+	       sizeof(registration_node_t) - offsetof(registration_node_t, refcount) - sizeof(r->refcount));
+	return r;
+}
+
+// must be called with the global lock held
+static void
+registration_node_dealloc_locked(notify_globals_t globals, registration_node_t *r)
+{
+	os_unfair_lock_assert_owner(&globals->notify_lock);
+
+	r->registration_coalesced_entry.tqe_next = globals->registration_free_list;
+	globals->registration_free_list = r;
+}
+
+/* retain, unless the node is already on its way to the free list */
+static bool
+registration_node_try_retain(registration_node_t *r)
+{
+	uint_fast32_t old = os_atomic_load(&r->refcount, relaxed);
+
+	do
+	{
+		if (old == 0) return false;
+	} while (!atomic_compare_exchange_weak_explicit(&r->refcount, &old, old + 1, memory_order_acquire, memory_order_relaxed));
+
+	return true;
+}
+
 static registration_node_t *
 registration_node_find(uint32_t token)
 {
 	notify_globals_t globals = _notify_globals();
+	registration_node_t *r = NULL;
 
-	mutex_lock("global", &globals->notify_lock, __func__, __LINE__);
-	registration_node_t *r = _nc_table_find_n(&globals->registration_table, token);
-	if (r != NULL) registration_node_retain(r);
-	mutex_unlock("global", &globals->notify_lock, __func__, __LINE__);
+	void **entry = registration_index_entry(globals, token, false);
+	if (entry != NULL) r = os_atomic_load(entry, acquire);
+
+	if ((r != NULL) && !registration_node_try_retain(r)) r = NULL;
+
+	/* the node may have been freed and reused since we loaded it */
+	if ((r != NULL) && ((os_atomic_load(entry, relaxed) != r) || (r->token != token)))
+	{
+		registration_node_release(r);
+		r = NULL;
+	}
 
 #ifdef DEBUG
 	if (_libnotify_debug & DEBUG_NODES) _notify_client_log(ASL_LEVEL_NOTICE, "registration_node_find token %u refcount %d -> %p", token, r ? r->refcount : -1, r);
@@ -668,13 +830,11 @@ notify_is_valid_token(int val)
 	if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "-> %s\n", __func__);
 #endif
 	bool valid = true;
-	notify_globals_t globals = _notify_globals();
 
-	mutex_lock("global", &globals->notify_lock, __func__, __LINE__);
-	registration_node_t *r = _nc_table_find_n(&globals->registration_table, val);
+	registration_node_t *r = registration_node_find(val);
 	if (r == NULL) valid = false;
 	else if (r->flags & NOTIFY_FLAG_COALESCE_BASE) valid = false;
-	mutex_unlock("global", &globals->notify_lock, __func__, __LINE__);
+	registration_node_release(r);
 
 #ifdef DEBUG
 	if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "<- %s [%d]\n", __func__, __LINE__ + 2);
@@ -699,6 +859,7 @@ registration_node_free_locked(notify_globals_t globals, registration_node_t *r)
 		mutex_lock(n->name, &n->lock, __func__, __LINE__);
 		n->coalesce_base_token = NOTIFY_TOKEN_INVALID;
 		n->coalesce_base = NULL;
+		n->coalesce_base_unsent = false;
 		mutex_unlock(n->name, &n->lock, __func__, __LINE__);
 
 		/* cancel the registration with notifyd */
@@ -722,7 +883,7 @@ registration_node_free_locked(notify_globals_t globals, registration_node_t *r)
 	if (r->queue != NULL) dispatch_release(r->queue);
 	r->queue = NULL;
 
-	free(r);
+	registration_node_dealloc_locked(globals, r);
 
 	name_node_release_locked(globals, n);
 }
@@ -739,7 +900,8 @@ registration_node_delete_locked(notify_globals_t globals, registration_node_t *r
 	if (_libnotify_debug & DEBUG_NODES) _notify_client_log(ASL_LEVEL_NOTICE, "%s token %u refcount %d flags 0x%08x %p FREE", __func__, r->token, r->refcount, r->flags, r);
 #endif
 
-	_nc_table_delete_n(&globals->registration_table, r->token);
+	void **entry = registration_index_entry(globals, r->token, false);
+	if ((entry != NULL) && (*entry == r)) os_atomic_store(entry, NULL, relaxed);
 
 	uint32_t reg_token = r->token;
 	uint32_t reg_flags = r->flags;
@@ -803,6 +965,15 @@ registration_node_delete_locked(notify_globals_t globals, registration_node_t *r
 static void
 registration_node_release(registration_node_t *r)
 {
+	if (r == NULL) return;
+
+	/* only dropping the last reference needs the global lock */
+	uint_fast32_t old = os_atomic_load(&r->refcount, relaxed);
+	while (old > 1)
+	{
+		if (atomic_compare_exchange_weak_explicit(&r->refcount, &old, old - 1, memory_order_release, memory_order_relaxed)) return;
+	}
+
 	notify_globals_t globals = _notify_globals();
 	mutex_lock("global", &globals->notify_lock, __func__, __LINE__);
 	registration_node_release_locked(globals, r);
@@ -828,6 +999,30 @@ registration_node_release_locked(notify_globals_t globals, registration_node_t *
 }
 
 #if !TARGET_OS_SIMULATOR
+/*
+ * notify_lock is required.
+ * Maps the state records for a segment.  They only save IPC in
+ * notify_get_state, so failing to map them is not an error.
+ */
+static void
+shm_state_attach(notify_globals_t globals, uint32_t segment)
+{
+	char name[NOTIFY_SHM_SEGMENT_ID_LEN];
+	void *base;
+	int32_t shmfd;
+
+	if (globals->shm_state[segment] != NULL) return;
+
+	_notify_shm_state_id(SHM_ID, segment, name, sizeof(name));
+	shmfd = shm_open(name, O_RDONLY, 0);
+	if (shmfd == -1) return;
+
+	base = mmap(NULL, globals->shm_segment_slots * sizeof(notify_shm_state_t), PROT_READ, MAP_SHARED, shmfd, 0);
+	close(shmfd);
+
+	if (base != MAP_FAILED) os_atomic_store(&globals->shm_state[segment], (notify_shm_state_t *)base, release);
+}
+
 static bool
 shm_attach(uint32_t size)
 {
@@ -848,16 +1043,118 @@ shm_attach(uint32_t size)
 		REPORT_BAD_BEHAVIOR("Libnotify: %s failed on line %d with errno %d", __func__, __LINE__, errno);
 		result = false;
 	} else {
+		globals->shm_segment_slots = size / sizeof(uint32_t);
+		globals->shm_segment[0] = shm_base;
 		globals->shm_base = shm_base;
 		result = true;
 	}
 
 	close(shmfd);
 
+	if (result) shm_state_attach(globals, 0);
+
 	return result;
 }
+
+/*
+ * notify_lock is required.
+ * Maps the shared memory segment holding slot, if it isn't mapped yet.
+ * Segments are never unmapped, so lock-free readers can use them as soon
+ * as they are published.
+ */
+static bool
+shm_attach_slot(notify_globals_t globals, uint32_t slot)
+{
+	char name[NOTIFY_SHM_SEGMENT_ID_LEN];
+	uint32_t segment;
+	size_t size;
+	void *base;
+	int32_t shmfd;
+
+	if ((globals->shm_base == NULL) || (globals->shm_segment_slots == 0)) return false;
+
+	segment = slot / globals->shm_segment_slots;
+	if (segment >= NOTIFY_SHM_MAX_SEGMENTS) return false;
+	if (globals->shm_segment[segment] != NULL) return true;
+
+	_notify_shm_segment_id(SHM_ID, segment, name, sizeof(name));
+	shmfd = shm_open(name, O_RDONLY, 0);
+	if (shmfd == -1)
+	{
+		REPORT_BAD_BEHAVIOR("Libnotify: %s failed on line %d with errno %d", __func__, __LINE__, errno);
+		return false;
+	}
+
+	size = globals->shm_segment_slots * sizeof(uint32_t);
+	base = mmap(NULL, size, PROT_READ, MAP_SHARED, shmfd, 0);
+	close(shmfd);
+
+	if (base == MAP_FAILED)
+	{
+		REPORT_BAD_BEHAVIOR("Libnotify: %s failed on line %d with errno %d", __func__, __LINE__, errno);
+		return false;
+	}
+
+	os_atomic_store(&globals->shm_segment[segment], (uint32_t *)base, release);
+	shm_state_attach(globals, segment);
+	return true;
+}
 #endif /* TARGET_OS_SIMULATOR */
 
+/* address of a shared memory slot, or NULL if its segment isn't mapped */
+static inline uint32_t *
+shm_slot_addr(notify_globals_t globals, uint32_t slot)
+{
+	uint32_t *base;
+
+	if (slot < globals->shm_segment_slots) return &globals->shm_base[slot];
+	if (globals->shm_segment_slots == 0) return NULL;
+	if ((slot / globals->shm_segment_slots) >= NOTIFY_SHM_MAX_SEGMENTS) return NULL;
+
+	base = os_atomic_load(&globals->shm_segment[slot / globals->shm_segment_slots], acquire);
+	if (base == NULL) return NULL;
+
+	return &base[slot % globals->shm_segment_slots];
+}
+
+/*
+ * Reads a name's state from its slot's state record.  Returns false if
+ * the record is not mapped or belongs to some other name.
+ */
+static inline bool
+shm_state_read(notify_globals_t globals, uint32_t slot, uint64_t nid, uint64_t *state)
+{
+	notify_shm_state_t *base, *rec;
+	uint32_t seq;
+	uint64_t rnid, val;
+
+	if ((globals->shm_segment_slots == 0) || ((slot / globals->shm_segment_slots) >= NOTIFY_SHM_MAX_SEGMENTS)) return false;
+
+	base = os_atomic_load(&globals->shm_state[slot / globals->shm_segment_slots], acquire);
+	if (base == NULL) return false;
+
+	rec = &base[slot % globals->shm_segment_slots];
+
+	for (uint32_t tries = 0; tries < 64; tries++)
+	{
+		seq = os_atomic_load(&rec->seq, acquire);
+		if (seq & 1) continue;
+
+		rnid = os_atomic_load(&rec->nid, relaxed);
+		val = os_atomic_load(&rec->state, relaxed);
+
+		os_atomic_thread_fence(acquire);
+		if (os_atomic_load(&rec->seq, relaxed) != seq) continue;
+
+		if (rnid != nid) return false;
+
+		*state = val;
+		return true;
+	}
+
+	return false;
+}
+
 #ifdef NOTDEF
 static void
 shm_detach(void)
@@ -1059,6 +1356,9 @@ _notify_fork_child(void)
 	globals->mp_list = NULL;
 
 	globals->shm_base = NULL;
+	globals->shm_segment_slots = 0;
+	memset(globals->shm_segment, 0, sizeof(globals->shm_segment));
+	memset(globals->shm_state, 0, sizeof(globals->shm_state));
 }
 
 /*
@@ -1073,19 +1373,22 @@ client_registration_create_base( __attribute__((nonnull)) const char * name, uin
 	name_node_t *name_node = NULL;
 	registration_node_t *reg_node;
 	uint32_t warn_count = 0;
+	void **entry;
 	notify_globals_t globals = _notify_globals();
 
 	mutex_lock("global", &globals->notify_lock, __func__, __LINE__);
 
+	entry = registration_index_entry(globals, token, true);
+	if (entry == NULL) goto client_registration_create_fail;
+
 	/* should never happen, but check if the registration exists */
-	reg_node = _nc_table_find_n(&globals->registration_table, token);
-	if (reg_node != NULL) goto client_registration_create_fail;
+	if (*entry != NULL) goto client_registration_create_fail;
 
 	name_node = name_node_for_name_locked(globals, name, nid, true);
 	if (name_node == NULL) goto client_registration_create_fail;
 	mutex_lock(name_node->name, &name_node->lock, __func__, __LINE__);
 
-	reg_node = (registration_node_t *)calloc(1, sizeof(registration_node_t));
+	reg_node = registration_node_alloc_locked(globals);
 	if (reg_node == NULL)
 	{
 #ifdef DEBUG
@@ -1097,7 +1400,6 @@ client_registration_create_base( __attribute__((nonnull)) const char * name, uin
 
 	os_atomic_store(&reg_node->refcount, 1, relaxed);
 	reg_node->token = token;
-	_nc_table_insert_n(&globals->registration_table, &reg_node->token);
 
 #ifdef DEBUG
 	if (_libnotify_debug & DEBUG_NODES) _notify_client_log(ASL_LEVEL_NOTICE, "client_registration_create token %u refcount %d -> %p", token, reg_node->refcount, reg_node);
@@ -1158,6 +1460,9 @@ client_registration_create_base( __attribute__((nonnull)) const char * name, uin
 		REPORT_BAD_BEHAVIOR("notify name \"%s\" has been registered %d times - this may be a leak", name, warn_count);
 	}
 
+	/* publish to lock-free lookups only once the node is complete */
+	os_atomic_store(entry, reg_node, release);
+
 	mutex_unlock(name_node->name, &name_node->lock, __func__, __LINE__);
 	mutex_unlock("global", &globals->notify_lock, __func__, __LINE__);
 	return NOTIFY_STATUS_OK;
@@ -1183,12 +1488,15 @@ base_registration_create_locked(notify_globals_t globals, __attribute__((nonnull
 
 	name_node_t *name_node = NULL;
 	registration_node_t *reg_node;
+	void **entry;
+
+	entry = registration_index_entry(globals, token, true);
+	if (entry == NULL) return NOTIFY_STATUS_ALLOC_FAILED;
 
 	/* should never happen, but check if the registration exists */
-	reg_node = _nc_table_find_n(&globals->registration_table, token);
-	if (reg_node != NULL) return NOTIFY_STATUS_DOUBLE_REG;
+	if (*entry != NULL) return NOTIFY_STATUS_DOUBLE_REG;
 
-	reg_node = (registration_node_t *)calloc(1, sizeof(registration_node_t));
+	reg_node = registration_node_alloc_locked(globals);
 	if (reg_node == NULL)
 	{
 #ifdef DEBUG
@@ -1200,7 +1508,7 @@ base_registration_create_locked(notify_globals_t globals, __attribute__((nonnull
 	name_node = name_node_for_name_locked(globals, name, nid, true);
 	if (name_node == NULL)
 	{
-		free(reg_node);
+		registration_node_dealloc_locked(globals, reg_node);
 		return NOTIFY_STATUS_NEW_NAME_FAILED;
 	}
 
@@ -1233,31 +1541,72 @@ base_registration_create_locked(notify_globals_t globals, __attribute__((nonnull
 	name_node->coalesce_base = reg_node;
 	name_node->coalesce_base_token = token;
 
-	_nc_table_insert_n(&globals->registration_table, &reg_node->token);
+	os_atomic_store(entry, reg_node, release);
 	return NOTIFY_STATUS_OK;
 }
 
 static bool
 check_name_access(char *name, uid_t uid)
 {
-	char str[64];
-	size_t len;
+	bool allowed;
 
 	/* root may do anything */
 	if (uid == 0) return true;
 
 	/* if name does not have "user.uid." as a prefix, it is not a user-protected namespace */
-	if (strncmp(name, USER_PROTECTED_UID_PREFIX, USER_PROTECTED_UID_PREFIX_LEN))
+	if (!_notify_user_uid_name(name, uid, &allowed)) return true;
+
+	return allowed;
+}
+
+/*
+ * Waits before retrying a regeneration.  Every process notices a notifyd
+ * restart at the same moment, so the wait is drawn at random from the
+ * upper half of a window that doubles with each attempt; retries spread
+ * out instead of arriving at notifyd in lock step.
+ */
+static void
+regenerate_backoff(uint32_t attempt)
+{
+	uint32_t window = NOTIFY_SERVER_RETRY_WAIT_US;
+
+	if ((attempt < 16) && ((NOTIFY_REGEN_RETRY_MIN_WAIT_US << attempt) < window)) window = NOTIFY_REGEN_RETRY_MIN_WAIT_US << attempt;
+
+	usleep((window / 2) + arc4random_uniform((window / 2) + 1));
+}
+
+static bool
+regenerate_wanted(registration_node_t *r)
+{
+	if (r->flags & NOTIFY_FLAG_SELF) return false;
+	if ((r->flags & NOTIFY_FLAG_REGEN) == 0) return false;
+
+	if(!check_name_access(r->name_node->name, geteuid()))
 	{
-		return true;
+		REPORT_BAD_BEHAVIOR("BUG IN LIBNOTIFY CLIENT: registration held for restricted name %s with process uid %d",
+				    r->name_node->name, geteuid());
+	}
+
+	return true;
+}
+
+static void
+regenerate_apply(registration_node_t *r, int status, int new_slot, uint64_t new_nid)
+{
+	if(status != NOTIFY_STATUS_OK && status != NOTIFY_STATUS_DUP_CLIENT &&
+	   status != NOTIFY_STATUS_NO_REGEN_NEEDED)
+	{
+		REPORT_BAD_BEHAVIOR("Libnotify: _notify_server_regnerate failed for name %s with status %d", r->name_node->name, status);
 	}
 
-	snprintf(str, sizeof(str) - 1, "%s%d", USER_PROTECTED_UID_PREFIX, uid);
-	len = strlen(str);
 
-	/* user <uid> may access user.uid.<uid> or a subtree name */
-	return ((!strncmp(name, str, len)) && ((name[len] == '\0') || (name[len] == '.')));
+#if !TARGET_OS_SIMULATOR
+	/* notify_lock is held; the new slot may be in a segment we haven't mapped */
+	if (notify_is_type(r->flags, NOTIFY_TYPE_MEMORY) && ((uint32_t)new_slot != SLOT_NONE)) (void)shm_attach_slot(_notify_globals(), (uint32_t)new_slot);
+#endif
 
+	r->slot = new_slot;
+	r->name_node->name_id = new_nid;
 }
 
 static void
@@ -1273,41 +1622,105 @@ _notify_lib_regenerate_registration(registration_node_t *r)
 
 	notify_globals_t globals = _notify_globals();
 
-	if (r->flags & NOTIFY_FLAG_SELF) return;
-	if ((r->flags & NOTIFY_FLAG_REGEN) == 0) return;
-
-	if(!check_name_access(name, geteuid()))
-	{
-		REPORT_BAD_BEHAVIOR("BUG IN LIBNOTIFY CLIENT: registration held for restricted name %s with process uid %d",
-				    name, geteuid());
-	}
-
 	pathlen = 0;
 	if (r->path != NULL) pathlen = strlen(r->path) + 1;
 	type = r->flags & NOTIFY_TYPE_MASK;
 
-	int remaining_retries = NOTIFY_SERVER_RETRY_NUMBER;
-	do {
+	for (uint32_t attempt = 0; ; attempt++)
+	{
 		kstatus = _notify_server_regenerate(globals->notify_server_port, (caddr_t)name, r->token, type, MACH_PORT_NULL, (type == NOTIFY_TYPE_SIGNAL) ? r->signal_or_xtra_mp : 0,
 				r->slot, r->set_state_val, r->set_state_time, r->path, (mach_msg_type_number_t)pathlen,
 				r->path_flags, &new_slot, &new_nid, &status);
-		if (kstatus == KERN_SUCCESS) {
-			break;
-		}
-		usleep(NOTIFY_SERVER_RETRY_WAIT_US);
-	} while (remaining_retries-- > 0);
+		if ((kstatus == KERN_SUCCESS) || (attempt == NOTIFY_SERVER_RETRY_NUMBER)) break;
+		regenerate_backoff(attempt);
+	}
 
 	assert(kstatus == KERN_SUCCESS);
 
-	if(status != NOTIFY_STATUS_OK && status != NOTIFY_STATUS_DUP_CLIENT &&
-	   status != NOTIFY_STATUS_NO_REGEN_NEEDED)
+	regenerate_apply(r, status, new_slot, new_nid);
+}
+
+#define REGEN_BATCH_MAX_ENTRIES (NOTIFY_REGEN_MANY_MAX_BYTES / NOTIFY_REGEN_ENTRY_SIZE(2, 0))
+
+/* registrations packed for one _notify_server_regenerate_many message */
+typedef struct
+{
+	uint32_t count;
+	size_t len;
+	registration_node_t *nodes[REGEN_BATCH_MAX_ENTRIES];
+	uint64_t buf[NOTIFY_REGEN_MANY_MAX_BYTES / sizeof(uint64_t)];
+} regenerate_batch_t;
+
+static void
+regenerate_batch_flush(notify_globals_t globals, regenerate_batch_t *batch)
+{
+	kern_return_t kstatus;
+	caddr_t results = NULL;
+	mach_msg_type_number_t results_len = 0;
+	notify_regen_result_t *result;
+	int status = NOTIFY_STATUS_OK;
+
+	if (batch->count == 0) return;
+
+	for (uint32_t attempt = 0; ; attempt++)
 	{
-		REPORT_BAD_BEHAVIOR("Libnotify: _notify_server_regnerate failed for name %s with status %d", name, status);
+		kstatus = _notify_server_regenerate_many(globals->notify_server_port, (caddr_t)batch->buf, (mach_msg_type_number_t)batch->len, &results, &results_len, &status);
+		if ((kstatus == KERN_SUCCESS) || (kstatus == MIG_BAD_ID) || (attempt == NOTIFY_SERVER_RETRY_NUMBER)) break;
+		regenerate_backoff(attempt);
 	}
 
+	assert((kstatus == KERN_SUCCESS) || (kstatus == MIG_BAD_ID));
 
-	r->slot = new_slot;
-	r->name_node->name_id = new_nid;
+	if ((kstatus == KERN_SUCCESS) && (status == NOTIFY_STATUS_OK) && (results_len == (batch->count * sizeof(notify_regen_result_t))))
+	{
+		result = (notify_regen_result_t *)results;
+		for (uint32_t i = 0; i < batch->count; i++) regenerate_apply(batch->nodes[i], result[i].status, result[i].slot, result[i].nid);
+	}
+	else
+	{
+		/* a notifyd without the batched routine, or a buffer it turned down */
+		for (uint32_t i = 0; i < batch->count; i++) _notify_lib_regenerate_registration(batch->nodes[i]);
+	}
+
+	if (results != NULL) vm_deallocate(mach_task_self(), (vm_address_t)results, results_len);
+
+	batch->count = 0;
+	batch->len = 0;
+}
+
+static void
+regenerate_batch_add(notify_globals_t globals, regenerate_batch_t *batch, registration_node_t *r)
+{
+	notify_regen_entry_t *e;
+	uint32_t type = r->flags & NOTIFY_TYPE_MASK;
+	size_t name_len = strlen(r->name_node->name) + 1;
+	size_t path_len = (r->path == NULL) ? 0 : strlen(r->path) + 1;
+	size_t size = NOTIFY_REGEN_ENTRY_SIZE(name_len, path_len);
+
+	if ((name_len > NOTIFY_REGEN_NAME_MAX) || (path_len > UINT16_MAX))
+	{
+		_notify_lib_regenerate_registration(r);
+		return;
+	}
+
+	if ((batch->count == REGEN_BATCH_MAX_ENTRIES) || ((batch->len + size) > sizeof(batch->buf))) regenerate_batch_flush(globals, batch);
+
+	e = (notify_regen_entry_t *)((char *)batch->buf + batch->len);
+	memset(e, 0, size);
+	e->token = (int32_t)r->token;
+	e->reg_type = type;
+	e->sig = (type == NOTIFY_TYPE_SIGNAL) ? r->signal_or_xtra_mp : 0;
+	e->prev_slot = (int32_t)r->slot;
+	e->prev_state = r->set_state_val;
+	e->prev_time = r->set_state_time;
+	e->path_flags = (uint32_t)r->path_flags;
+	e->name_len = (uint16_t)name_len;
+	e->path_len = (uint16_t)path_len;
+	memcpy(e + 1, r->name_node->name, name_len);
+	if (path_len > 0) memcpy((char *)(e + 1) + name_len, r->path, path_len);
+
+	batch->nodes[batch->count++] = r;
+	batch->len += size;
 }
 
 /*
@@ -1329,10 +1742,22 @@ _notify_lib_regenerate_locked(notify_globals_t globals)
 	}
 
 	if (result == NOTIFY_STATUS_OK) {
-		_nc_table_foreach_n(&globals->registration_table, ^bool(void *reg) {
-			_notify_lib_regenerate_registration(reg);
+		/* registrations go to notifyd a buffer at a time; one at a time if there is no memory for a buffer */
+		regenerate_batch_t *batch = calloc(1, sizeof(regenerate_batch_t));
+
+		registration_index_foreach_locked(globals, ^bool(registration_node_t *reg) {
+			if (!regenerate_wanted(reg)) return true;
+
+			if (batch == NULL) _notify_lib_regenerate_registration(reg);
+			else regenerate_batch_add(globals, batch, reg);
 			return true;
 		});
+
+		if (batch != NULL)
+		{
+			regenerate_batch_flush(globals, batch);
+			free(batch);
+		}
 	}
 
 	return result;
@@ -1675,6 +2100,51 @@ should_claim_root_access(void)
 	return has_root_entitlement;
 }
 
+static dispatch_queue_t
+background_send_queue(notify_globals_t globals)
+{
+	dispatch_once(&globals->make_background_send_queue_once, ^{
+		globals->background_send_queue = dispatch_queue_create("com.apple.notify.background.local.notification", NULL);
+	});
+
+	return globals->background_send_queue;
+}
+
+/*
+ * Sends the post that NOTIFY_OPT_COALESCE_POSTS held back for a name.
+ * post_pending is cleared under the name's lock before the send, so
+ * every notify_post that found it set is covered by a send that starts
+ * after it.  The lock is not held for the send itself, so posting
+ * threads only wait for the bit.
+ */
+static void
+coalesced_post_send(void *ctx)
+{
+	name_node_t *n = ctx;
+	notify_globals_t globals = _notify_globals();
+	kern_return_t kstatus;
+	uint64_t nid;
+
+	mutex_lock(n->name, &n->lock, __func__, __LINE__);
+	os_atomic_store(&n->post_pending, false, relaxed);
+	nid = n->name_id;
+	mutex_unlock(n->name, &n->lock, __func__, __LINE__);
+
+	/* notifyd restarted since, and the name ID is not known yet */
+	if ((nid == NID_UNSET) || (nid == NID_CALLED_ONCE)) kstatus = _notify_server_post_4(globals->notify_server_port, (caddr_t)n->name, should_claim_root_access());
+	else kstatus = _notify_server_post_3(globals->notify_server_port, nid, should_claim_root_access());
+
+	if (kstatus != KERN_SUCCESS)
+	{
+		REPORT_BAD_BEHAVIOR("Libnotify: %s failed with code %d (%d) on line %d", __func__,
+				    NOTIFY_STATUS_SERVER_POST_3_FAILED, kstatus, __LINE__);
+	}
+
+	mutex_lock("global", &globals->notify_lock, __func__, __LINE__);
+	name_node_release_locked(globals, n);
+	mutex_unlock("global", &globals->notify_lock, __func__, __LINE__);
+}
+
 /*
  * PUBLIC API
  */
@@ -1830,6 +2300,15 @@ notify_post(const char *name)
 				name_node_set_nid_locked(n, nid);
 			}
 		}
+		else if ((client_opts(globals) & NOTIFY_OPT_COALESCE_POSTS) && (background_send_queue(globals) != NULL))
+		{
+			/* a post already waiting to be sent covers this one */
+			if (!os_atomic_xchg(&n->post_pending, true, relaxed))
+			{
+				name_node_retain(n);
+				dispatch_async_f(globals->background_send_queue, n, coalesced_post_send);
+			}
+		}
 		else
 		{
 			/* We have the name ID.  Do an async post using the name ID.  Very fast. */
@@ -1871,6 +2350,154 @@ notify_post(const char *name)
 	return NOTIFY_STATUS_OK;
 }
 
+static uint32_t
+post_many_flush(notify_globals_t globals, uint64_t *nids, mach_msg_type_number_t *nid_count, char *names, mach_msg_type_number_t *names_len)
+{
+	kern_return_t kstatus;
+
+	if ((*nid_count == 0) && (*names_len == 0)) return NOTIFY_STATUS_OK;
+
+	kstatus = _notify_server_post_many(globals->notify_server_port, nids, *nid_count, (caddr_t)names, *names_len, should_claim_root_access());
+	*nid_count = 0;
+	*names_len = 0;
+
+	if (kstatus != KERN_SUCCESS)
+	{
+		REPORT_BAD_BEHAVIOR("Libnotify: %s failed with code %d (%d) on line %d", __func__,
+				NOTIFY_STATUS_SERVER_POST_MANY_FAILED, kstatus, __LINE__);
+		return NOTIFY_STATUS_FAILED;
+	}
+
+	return NOTIFY_STATUS_OK;
+}
+
+/*
+ * notify_post_many follows the same zero/one/many heuristic as
+ * notify_post, but packs everything it can into one simpleroutine:
+ * names with a known name ID are sent as IDs, cold names (and names
+ * posted for the first time) are sent as strings.  A name in the
+ * NID_CALLED_ONCE state goes through notify_post so that its ID gets
+ * fetched, after which it rides in the batch as an ID.
+ *
+ * Names are posted in the order given.  Anything posted on its own
+ * (self names, names too long for the batch, NID_CALLED_ONCE names)
+ * first flushes the batch, and since notifyd posts a batch's IDs before
+ * its strings, an ID that follows a string starts a new batch.
+ */
+uint32_t
+notify_post_many(const char **names, size_t count)
+{
+#ifdef DEBUG
+	if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "-> %s\n", __func__);
+#endif
+
+	uint64_t nids[NOTIFY_POST_MANY_MAX_IDS];
+	char buf[NOTIFY_BATCH_NAME_BYTES];
+	mach_msg_type_number_t nid_count = 0, buf_len = 0;
+	uint32_t status, result = NOTIFY_STATUS_OK;
+	notify_globals_t globals = _notify_globals();
+
+	if ((names == NULL) && (count != 0))
+	{
+#ifdef DEBUG
+		if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "<- %s [%d]\n", __func__, __LINE__ + 2);
+#endif
+		return NOTIFY_STATUS_INVALID_NAME;
+	}
+
+	status = regenerate_check(globals);
+	if (status == NOTIFY_STATUS_OK && globals->notify_server_port == MACH_PORT_NULL)
+	{
+		status = _notify_lib_init(globals, EVENT_INIT);
+	}
+
+	if (status != NOTIFY_STATUS_OK)
+	{
+		if(IS_INTERNAL_ERROR(status))
+		{
+			REPORT_BAD_BEHAVIOR("Libnotify: %s failed with code %d on line %d", __func__, status, __LINE__);
+			status = NOTIFY_STATUS_FAILED;
+		}
+#ifdef DEBUG
+		if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "<- %s [%d]\n", __func__, __LINE__ + 2);
+#endif
+		return status;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const char *name = names[i];
+		name_node_t *n;
+		uint64_t nid = NID_UNSET;
+		size_t len;
+
+		status = NOTIFY_STATUS_OK;
+
+		if (name == NULL)
+		{
+			if (result == NOTIFY_STATUS_OK) result = NOTIFY_STATUS_INVALID_NAME;
+			continue;
+		}
+
+		NOTIFY_POST(name);
+
+		if (!strncmp(name, SELF_PREFIX, SELF_PREFIX_LEN))
+		{
+			status = post_many_flush(globals, nids, &nid_count, buf, &buf_len);
+			if (result == NOTIFY_STATUS_OK) result = status;
+			_notify_lib_post(&globals->self_state, name, 0, 0);
+			continue;
+		}
+
+		len = strlen(name) + 1;
+		if (len > sizeof(buf))
+		{
+			status = post_many_flush(globals, nids, &nid_count, buf, &buf_len);
+			if (result == NOTIFY_STATUS_OK) result = status;
+			status = notify_post(name);
+			if (result == NOTIFY_STATUS_OK) result = status;
+			continue;
+		}
+
+		n = name_node_for_name(name, NID_UNSET, false);
+		if (n != NULL)
+		{
+			mutex_lock(n->name, &n->lock, __func__, __LINE__);
+			nid = n->name_id;
+			if (nid == NID_UNSET) name_node_set_nid_locked(n, NID_CALLED_ONCE);
+			name_node_unlock_and_release(n);
+		}
+
+		if (nid == NID_CALLED_ONCE)
+		{
+			status = post_many_flush(globals, nids, &nid_count, buf, &buf_len);
+			if (result == NOTIFY_STATUS_OK) result = status;
+			status = notify_post(name);
+		}
+		else if (nid != NID_UNSET)
+		{
+			if ((nid_count == NOTIFY_POST_MANY_MAX_IDS) || (buf_len > 0)) status = post_many_flush(globals, nids, &nid_count, buf, &buf_len);
+			nids[nid_count++] = nid;
+		}
+		else
+		{
+			if (buf_len + len > sizeof(buf)) status = post_many_flush(globals, nids, &nid_count, buf, &buf_len);
+			memcpy(buf + buf_len, name, len);
+			buf_len += (mach_msg_type_number_t)len;
+		}
+
+		if (result == NOTIFY_STATUS_OK) result = status;
+	}
+
+	status = post_many_flush(globals, nids, &nid_count, buf, &buf_len);
+	if (result == NOTIFY_STATUS_OK) result = status;
+
+#ifdef DEBUG
+	if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "<- %s [%d]\n", __func__, __LINE__ + 2);
+#endif
+	return result;
+}
+
 
 
 static void
@@ -1940,8 +2567,61 @@ _notify_dispatch_local_notification(registration_node_t *r)
 #endif
 	});
 
-	dispatch_async(thequeue, detached_block);
-	Block_release(detached_block);
+	dispatch_async(thequeue, detached_block);
+	Block_release(detached_block);
+}
+
+static void
+_notify_dispatch_token(int token)
+{
+	name_node_t *n;
+	registration_node_t *r;
+
+#ifdef DEBUG
+	if (_libnotify_debug & DEBUG_NOTIFICATION) _notify_client_log(ASL_LEVEL_NOTICE, "_notify_dispatch_handle token %d", token);
+#endif
+
+	r = registration_node_find(token);
+	if (r == NULL) return;
+
+	n = r->name_node;
+	if (n == NULL)
+	{
+		/* should not happen */
+		registration_node_release(r);
+		return;
+	}
+
+	mutex_lock(n->name, &n->lock, __func__, __LINE__);
+
+	if (r->flags & NOTIFY_FLAG_COALESCE_BASE)
+	{
+		registration_node_t *x;
+		TAILQ_FOREACH(x, &n->coalesced, registration_coalesced_entry)
+		{
+			if (x != r) _notify_dispatch_local_notification(x);
+		}
+	}
+	else
+	{
+		_notify_dispatch_local_notification(r);
+	}
+
+	mutex_unlock(n->name, &n->lock, __func__, __LINE__);
+
+	registration_node_release(r);
+}
+
+static void
+_notify_dispatch_ack(notify_globals_t globals, int *acks, uint32_t *ack_count, int token)
+{
+	if (*ack_count == NOTIFY_PORT_BATCH_MAX)
+	{
+		(void)_notify_server_ack(globals->notify_server_port, acks, *ack_count);
+		*ack_count = 0;
+	}
+
+	acks[(*ack_count)++] = token;
 }
 
 static void
@@ -1949,65 +2629,71 @@ _notify_dispatch_handle(void *context)
 {
 	notify_globals_t globals = context;
 	mach_port_t port = globals->notify_common_port;
-	name_node_t *n;
-	registration_node_t *r;
-	int token;
-	mach_msg_empty_rcv_t msg;
+	struct {
+		notify_port_batch_msg_t batch;
+		mach_msg_trailer_t trailer;
+	} msg;
+	int acks[NOTIFY_PORT_BATCH_MAX];
+	uint32_t ack_count = 0;
 	kern_return_t status;
 
 	if (port == MACH_PORT_NULL) return;
 
 	for (int retries = 5; retries-- > 0; ) {
-		memset(&msg, 0, sizeof(msg));
+		memset(&msg.batch.header, 0, sizeof(mach_msg_header_t));
 
 		/*
 		 * The dispatch source watching our multiplexed mach port has fired.
-		 * Read the message that is waiting and get the token ID from the mach header.
+		 * Read the message that is waiting and get the token ID from the mach header,
+		 * or the token array if notifyd sent a batch.
 		 */
-		status = mach_msg(&msg.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(msg), port, 0, MACH_PORT_NULL);
-		if (status != KERN_SUCCESS) return;
-
-		token = msg.header.msgh_id;
-
-#ifdef DEBUG
-		if (_libnotify_debug & DEBUG_NOTIFICATION) _notify_client_log(ASL_LEVEL_NOTICE, "_notify_dispatch_handle token %d", token);
-#endif
+		status = mach_msg(&msg.batch.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(msg), port, 0, MACH_PORT_NULL);
+		if (status != KERN_SUCCESS) break;
 
-		r = registration_node_find(token);
-		if (r == NULL) continue;
-
-		n = r->name_node;
-		if (n == NULL)
+		if (((msg.batch.header.msgh_id == NOTIFY_PORT_BATCH_MSG_ID) || (msg.batch.header.msgh_id == NOTIFY_PORT_BATCH_ACK_MSG_ID)) &&
+			(msg.batch.header.msgh_size >= offsetof(notify_port_batch_msg_t, tokens)))
 		{
-			/* should not happen */
-			registration_node_release(r);
-			continue;
-		}
-
-		mutex_lock(n->name, &n->lock, __func__, __LINE__);
+			uint32_t count = (msg.batch.header.msgh_size - offsetof(notify_port_batch_msg_t, tokens)) / sizeof(int32_t);
+			if (msg.batch.count < count) count = msg.batch.count;
 
-		if (r->flags & NOTIFY_FLAG_COALESCE_BASE)
-		{
-			registration_node_t *x;
-			TAILQ_FOREACH(x, &n->coalesced, registration_coalesced_entry)
+			for (uint32_t i = 0; i < count; i++)
 			{
-				if (x != r) _notify_dispatch_local_notification(x);
+				_notify_dispatch_token(msg.batch.tokens[i]);
+
+				/* notifyd only asks for acks once we have fallen behind */
+				if (msg.batch.header.msgh_id == NOTIFY_PORT_BATCH_ACK_MSG_ID) _notify_dispatch_ack(globals, acks, &ack_count, msg.batch.tokens[i]);
 			}
-		}
-		else
-		{
-			_notify_dispatch_local_notification(r);
+			continue;
 		}
 
-		mutex_unlock(n->name, &n->lock, __func__, __LINE__);
-
-		registration_node_release(r);
+		_notify_dispatch_token(msg.batch.header.msgh_id);
 	}
+
+	/* let notifyd send these tokens again */
+	if (ack_count > 0) (void)_notify_server_ack(globals->notify_server_port, acks, ack_count);
 }
 
 #pragma mark -
 #pragma mark registration
 
+static uint32_t
+registration_set_dispatch(int token, dispatch_queue_t queue, notify_handler_t handler)
+{
+	registration_node_t *r = registration_node_find(token);
+	if (r == NULL)
+	{
+		REPORT_BAD_BEHAVIOR("Libnotify: %s failed with code %d on line %d", __func__, NOTIFY_STATUS_TOKEN_NOT_FOUND, __LINE__);
+		return NOTIFY_STATUS_FAILED;
+	}
+
+	r->queue = queue;
+	dispatch_retain(r->queue);
+	r->block = Block_copy(handler);
+
+	registration_node_release(r);
+	return NOTIFY_STATUS_OK;
+}
+
 static uint32_t
 _notify_register_dispatch_with_extra_mp(const char *name, int *out_token, dispatch_queue_t queue, notify_handler_t handler, mach_port_t extra_mp)
 {
@@ -2016,7 +2702,6 @@ _notify_register_dispatch_with_extra_mp(const char *name, int *out_token, dispat
 #endif
 
 	uint32_t status;
-	registration_node_t *r;
 	notify_globals_t globals = _notify_globals();
 
 	status = regenerate_check(globals);
@@ -2052,7 +2737,7 @@ _notify_register_dispatch_with_extra_mp(const char *name, int *out_token, dispat
 	/* client is using dispatch: enable local demux / dispatch and regeneration */
 	notify_set_options(NOTIFY_OPT_DISPATCH | NOTIFY_OPT_REGEN);
 
-	status = notify_register_coalesced_registration(name, NOTIFY_REUSE | _NOTIFY_COMMON_PORT, out_token, globals, extra_mp);
+	status = notify_register_coalesced_registration(name, NOTIFY_REUSE | _NOTIFY_COMMON_PORT, out_token, globals, extra_mp, NULL);
 	if (status != NOTIFY_STATUS_OK)
 	{
 #ifdef DEBUG
@@ -2061,32 +2746,120 @@ _notify_register_dispatch_with_extra_mp(const char *name, int *out_token, dispat
 		return status;
 	}
 
-	r = registration_node_find(*out_token);
-	if (r == NULL)
+	status = registration_set_dispatch(*out_token, queue, handler);
+
+#ifdef DEBUG
+	if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "<- %s [%d]\n", __func__, __LINE__ + 2);
+#endif
+	return status;
+}
+
+uint32_t
+notify_register_dispatch(const char *name, int *out_token, dispatch_queue_t queue, notify_handler_t handler)
+{
+	return _notify_register_dispatch_with_extra_mp(name, out_token, queue, handler, MACH_PORT_NULL);
+}
+
+/*
+ * Same as notify_register_dispatch for each name, except that the base
+ * registrations that need to reach notifyd are sent in batches.  Either
+ * every name is registered, or none are and every token is left invalid.
+ */
+uint32_t
+notify_register_dispatch_many(const char **names, size_t count, int *out_tokens, dispatch_queue_t queue, notify_handler_t handler)
+{
+#ifdef DEBUG
+	if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "-> %s\n", __func__);
+#endif
+
+	uint32_t status;
+	size_t i, registered = 0;
+	common_port_batch_t *batch;
+	notify_globals_t globals = _notify_globals();
+
+	status = regenerate_check(globals);
+	if (status != NOTIFY_STATUS_OK)
+	{
+		if(IS_INTERNAL_ERROR(status))
+		{
+			REPORT_BAD_BEHAVIOR("Libnotify: %s failed with code %d on line %d", __func__, status, __LINE__);
+			status = NOTIFY_STATUS_FAILED;
+		}
+#ifdef DEBUG
+		if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "<- %s [%d]\n", __func__, __LINE__ + 2);
+#endif
+		return status;
+	}
+
+	if ((count != 0) && ((names == NULL) || (out_tokens == NULL)))
+	{
+#ifdef DEBUG
+		if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "<- %s [%d]\n", __func__, __LINE__ + 2);
+#endif
+		return NOTIFY_STATUS_NULL_INPUT;
+	}
+
+	if ((queue == NULL) || (handler == NULL))
+	{
+#ifdef DEBUG
+		if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "<- %s [%d]\n", __func__, __LINE__ + 2);
+#endif
+		return NOTIFY_STATUS_NULL_INPUT;
+	}
+
+	for (i = 0; i < count; i++) out_tokens[i] = NOTIFY_TOKEN_INVALID;
+
+	batch = calloc(1, sizeof(common_port_batch_t));
+	if (batch == NULL)
 	{
 #ifdef DEBUG
 		if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "<- %s [%d]\n", __func__, __LINE__ + 2);
 #endif
-		REPORT_BAD_BEHAVIOR("Libnotify: %s failed with code %d on line %d", __func__, NOTIFY_STATUS_TOKEN_NOT_FOUND, __LINE__);
 		return NOTIFY_STATUS_FAILED;
 	}
 
-	r->queue = queue;
-	dispatch_retain(r->queue);
-	r->block = Block_copy(handler);
+	/* client is using dispatch: enable local demux / dispatch and regeneration */
+	notify_set_options(NOTIFY_OPT_DISPATCH | NOTIFY_OPT_REGEN);
 
-	registration_node_release(r);
+	for (i = 0; i < count; i++)
+	{
+		if (names[i] == NULL)
+		{
+			status = NOTIFY_STATUS_INVALID_NAME;
+			break;
+		}
+
+		status = notify_register_coalesced_registration(names[i], NOTIFY_REUSE | _NOTIFY_COMMON_PORT, &out_tokens[i], globals, MACH_PORT_NULL, batch);
+		if (status != NOTIFY_STATUS_OK) break;
+
+		registered++;
+
+		status = registration_set_dispatch(out_tokens[i], queue, handler);
+		if (status != NOTIFY_STATUS_OK) break;
+	}
+
+	/* notifyd must see every base registration before any cancel below */
+	if (common_port_batch_flush(globals, batch) != KERN_SUCCESS)
+	{
+		REPORT_BAD_BEHAVIOR("Libnotify: %s failed with code %d on line %d", __func__, NOTIFY_STATUS_REG_MACH_PORT_2_FAILED, __LINE__);
+		if (status == NOTIFY_STATUS_OK) status = NOTIFY_STATUS_FAILED;
+	}
+
+	free(batch);
+
+	if (status != NOTIFY_STATUS_OK)
+	{
+		for (i = 0; i < registered; i++)
+		{
+			notify_cancel(out_tokens[i]);
+			out_tokens[i] = NOTIFY_TOKEN_INVALID;
+		}
+	}
 
 #ifdef DEBUG
 	if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "<- %s [%d]\n", __func__, __LINE__ + 2);
 #endif
-	return NOTIFY_STATUS_OK;
-}
-
-uint32_t
-notify_register_dispatch(const char *name, int *out_token, dispatch_queue_t queue, notify_handler_t handler)
-{
-	return _notify_register_dispatch_with_extra_mp(name, out_token, queue, handler, MACH_PORT_NULL);
+	return status;
 }
 
 /* note this does not get self names */
@@ -2100,7 +2873,7 @@ notify_register_mux_fd(const char *name, int *out_token, int rfd, int wfd)
 
 	if (globals->notify_common_port == MACH_PORT_NULL) return NOTIFY_STATUS_COMMON_PORT_NULL;
 
-	status = notify_register_coalesced_registration(name, NOTIFY_REUSE | _NOTIFY_COMMON_PORT, out_token, globals, MACH_PORT_NULL);
+	status = notify_register_coalesced_registration(name, NOTIFY_REUSE | _NOTIFY_COMMON_PORT, out_token, globals, MACH_PORT_NULL, NULL);
 	
 	if (status != NOTIFY_STATUS_OK)
 	{
@@ -2286,6 +3059,16 @@ notify_register_check(const char *name, int *out_token)
 				return NOTIFY_STATUS_FAILED;
 			}
 		}
+
+		/* the table may have grown past the segments this process has mapped */
+		if (!shm_attach_slot(globals, (uint32_t)slot))
+		{
+#ifdef DEBUG
+			if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "<- %s [%d]\n", __func__, __LINE__ + 2);
+#endif
+			mutex_unlock("global", &globals->notify_lock, __func__, __LINE__);
+			return NOTIFY_STATUS_FAILED;
+		}
 		mutex_unlock("global", &globals->notify_lock, __func__, __LINE__);
 
 		status = client_registration_create(name, nid, token, cid, slot,
@@ -2802,8 +3585,98 @@ notify_register_mach_port_no_dispatch(const char *name, mach_port_name_t *notify
 	return NOTIFY_STATUS_OK;
 }
 
+/*
+ * Sends the queued base registrations that still need sending.  A base
+ * that has gone away, or that a second registrant already sent, is
+ * dropped.  The global lock is held across the send, so nobody can see
+ * a base as sent before notifyd has it queued.
+ */
+static kern_return_t
+common_port_batch_flush_locked(notify_globals_t globals, common_port_batch_t *batch)
+{
+	os_unfair_lock_assert_owner(&globals->notify_lock);
+
+	kern_return_t kstatus = KERN_SUCCESS;
+	mach_msg_type_number_t count = 0, len = 0, name_len;
+	char *name = batch->names;
+	name_node_t *n;
+
+	for (mach_msg_type_number_t i = 0; i < batch->token_count; i++, name += name_len)
+	{
+		name_len = (mach_msg_type_number_t)strlen(name) + 1;
+
+		n = _nc_table_find(&globals->name_node_table, name);
+		if ((n == NULL) || !n->coalesce_base_unsent || (n->coalesce_base_token != (uint32_t)batch->tokens[i])) continue;
+		n->coalesce_base_unsent = false;
+
+		memmove(batch->names + len, name, name_len);
+		len += name_len;
+		batch->tokens[count++] = batch->tokens[i];
+	}
+
+	if (count > 0)
+	{
+		kstatus = _notify_server_register_common_port_many(globals->notify_server_port, batch->names, len, batch->tokens, count);
+	}
+
+	batch->token_count = 0;
+	batch->names_len = 0;
+	return kstatus;
+}
+
+static kern_return_t
+common_port_batch_flush(notify_globals_t globals, common_port_batch_t *batch)
+{
+	kern_return_t kstatus;
+
+	mutex_lock("global", &globals->notify_lock, __func__, __LINE__);
+	kstatus = common_port_batch_flush_locked(globals, batch);
+	mutex_unlock("global", &globals->notify_lock, __func__, __LINE__);
+
+	return kstatus;
+}
+
+static bool
+common_port_batch_has(common_port_batch_t *batch, uint32_t token)
+{
+	for (mach_msg_type_number_t i = 0; i < batch->token_count; i++)
+	{
+		if ((uint32_t)batch->tokens[i] == token) return true;
+	}
+
+	return false;
+}
+
+/* called with the global lock held; returns with name queued or sent */
+static kern_return_t
+common_port_batch_add(notify_globals_t globals, common_port_batch_t *batch, const char *name, int token)
+{
+	kern_return_t kstatus = KERN_SUCCESS;
+	size_t len = strlen(name) + 1;
+
+	if (len > sizeof(batch->names))
+	{
+		return _notify_server_register_common_port(globals->notify_server_port, (caddr_t)name, token);
+	}
+
+	if ((batch->token_count == NOTIFY_REGISTER_MANY_MAX_TOKENS) || (batch->names_len + len > sizeof(batch->names)))
+	{
+		kstatus = common_port_batch_flush_locked(globals, batch);
+		if (kstatus != KERN_SUCCESS) return kstatus;
+	}
+
+	memcpy(batch->names + batch->names_len, name, len);
+	batch->names_len += (mach_msg_type_number_t)len;
+	batch->tokens[batch->token_count++] = token;
+	return kstatus;
+}
+
+/*
+ * If batch is non-NULL, a new base registration is queued on it rather
+ * than sent to notifyd; the caller must flush the batch.
+ */
 static uint32_t
-notify_register_coalesced_registration(const char *name, int flags, int *out_token, notify_globals_t globals, mach_port_t extra_mp)
+notify_register_coalesced_registration(const char *name, int flags, int *out_token, notify_globals_t globals, mach_port_t extra_mp, common_port_batch_t *batch)
 {
 #ifdef DEBUG
 	if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "-> %s\n", __func__);
@@ -2823,6 +3696,7 @@ notify_register_coalesced_registration(const char *name, int flags, int *out_tok
 	uint32_t cid;
 	kern_return_t kstatus;
 	uint32_t tflags = NOTIFY_TYPE_COMMON_PORT | NOTIFY_FLAG_REGEN;
+	uint64_t hash = _nc_string_hash(name, strlen(name));
 
 	/* initialize if necessary */
 	if ((globals->notify_server_port == MACH_PORT_NULL) ||
@@ -2853,7 +3727,7 @@ notify_register_coalesced_registration(const char *name, int flags, int *out_tok
 	 */
 	mutex_lock("global", &globals->notify_lock, __func__, __LINE__);
 
-	n = _nc_table_find(&globals->name_node_table, name);
+	n = _nc_table_find_hashed(&globals->name_node_table, name, hash);
 	if (n == NULL)
 	{
 #ifdef DEBUG
@@ -2880,7 +3754,8 @@ notify_register_coalesced_registration(const char *name, int flags, int *out_tok
 		/* base of coalesced registrations gets a private token */
 		token = atomic_increment32(&globals->token_id);
 
-		kstatus = _notify_server_register_common_port(globals->notify_server_port, (caddr_t)name, token);
+		if (batch != NULL) kstatus = common_port_batch_add(globals, batch, name, token);
+		else kstatus = _notify_server_register_common_port(globals->notify_server_port, (caddr_t)name, token);
 		if (kstatus != KERN_SUCCESS)
 		{
 			mutex_unlock("global", &globals->notify_lock, __func__, __LINE__);
@@ -2909,10 +3784,38 @@ notify_register_coalesced_registration(const char *name, int flags, int *out_tok
 			return status;
 		}
 
+		/* a queued base stays unsent until the batch is flushed; a name too long for the batch was sent right away */
+		if ((batch != NULL) && common_port_batch_has(batch, token))
+		{
+			n = _nc_table_find_hashed(&globals->name_node_table, name, hash);
+			n->coalesce_base_unsent = true;
+		}
 	}
 
 	/* we will need a pointer to the name node below - look it up while we still have the global lock */
-	n = _nc_table_find(&globals->name_node_table, name);
+	n = _nc_table_find_hashed(&globals->name_node_table, name, hash);
+
+	/*
+	 * A base still queued on another thread's batch is unknown to notifyd,
+	 * so this registration would miss posts until that batch is flushed.
+	 * Send the base now; the batch drops it when it is flushed.
+	 */
+	if (!create_base && n->coalesce_base_unsent && ((batch == NULL) || !common_port_batch_has(batch, n->coalesce_base_token)))
+	{
+		kstatus = _notify_server_register_common_port(globals->notify_server_port, (caddr_t)name, n->coalesce_base_token);
+		if (kstatus != KERN_SUCCESS)
+		{
+			mutex_unlock("global", &globals->notify_lock, __func__, __LINE__);
+#ifdef DEBUG
+			if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "<- %s [%d]\n", __func__, __LINE__ + 2);
+#endif
+			REPORT_BAD_BEHAVIOR("Libnotify: %s failed with code %d (%d) on line %d", __func__,
+					    NOTIFY_STATUS_REG_MACH_PORT_2_FAILED, kstatus, __LINE__);
+			return NOTIFY_STATUS_FAILED;
+		}
+
+		n->coalesce_base_unsent = false;
+	}
 
 	if(!create_base){
 		registration_node_retain(n->coalesce_base);
@@ -2977,11 +3880,9 @@ static void notify_mach_port(int token, mach_port_t port, notify_globals_t globa
 	kstatus = mach_msg(&msg.header, MACH_SEND_MSG | MACH_SEND_TIMEOUT, msg.header.msgh_size, 0, MACH_PORT_NULL, 0, MACH_PORT_NULL);
 	if (kstatus == MACH_SEND_TIMED_OUT)
 	{
-		dispatch_once(&globals->make_background_send_queue_once, ^{
-			globals->background_send_queue = dispatch_queue_create("com.apple.notify.background.local.notification", NULL);
-		});
+		dispatch_queue_t q = background_send_queue(globals);
 
-		if (globals->background_send_queue != NULL) dispatch_async(globals->background_send_queue, ^{
+		if (q != NULL) dispatch_async(q, ^{
 			mach_msg_empty_send_t msg;
 
 			/* send empty message to the port with msgh_id = token; */
@@ -3466,13 +4367,28 @@ notify_check(int token, int *check)
 
 		*check = 0;
 
-		mutex_lock("check_lock", &globals->check_lock, __func__, __LINE__);
-		if (r->val != globals->shm_base[r->slot])
+		/*
+		 * Whoever moves r->val up to the current slot value reports the
+		 * change; threads that lose the race see it already consumed.
+		 */
+		uint32_t *slot_addr = shm_slot_addr(globals, r->slot);
+		if (slot_addr == NULL)
+		{
+			status = NOTIFY_STATUS_SHM_BASE_NULL;
+			goto release_and_return;
+		}
+
+		uint32_t val = os_atomic_load(&r->val, relaxed);
+		for (;;)
 		{
-			*check = 1;
-			r->val = globals->shm_base[r->slot];
+			uint32_t cur = os_atomic_load(slot_addr, relaxed);
+			if (val == cur) break;
+			if (os_atomic_cmpxchgv(&r->val, val, cur, &val, relaxed))
+			{
+				*check = 1;
+				break;
+			}
 		}
-		mutex_unlock("check_lock", &globals->check_lock, __func__, __LINE__);
 
 
 		status = NOTIFY_STATUS_OK;
@@ -3583,7 +4499,14 @@ notify_peek(int token, uint32_t *val)
 			goto release_and_return;
 		}
 
-		*val = globals->shm_base[r->slot];
+		uint32_t *slot_addr = shm_slot_addr(globals, r->slot);
+		if (slot_addr == NULL)
+		{
+			status = NOTIFY_STATUS_SHM_BASE_NULL;
+			goto release_and_return;
+		}
+
+		*val = *slot_addr;
 		status = NOTIFY_STATUS_OK;
 	}
 
@@ -3813,6 +4736,28 @@ notify_get_state(int token, uint64_t *state)
 		return status;
 	}
 
+	/*
+	 * Memory registrations can read the state notifyd publishes next to
+	 * their slot, unless this process has a notify_set_state for the name
+	 * that an IPC get hasn't seen yet.
+	 */
+	if (notify_is_type(r->flags, NOTIFY_TYPE_MEMORY) && (globals->shm_base != NULL) && (r->slot != SLOT_NONE))
+	{
+		name_node_t *name_node = r->name_node;
+		nid = os_atomic_load(&name_node->name_id, relaxed);
+
+		if ((nid != NID_UNSET) && (nid != NID_CALLED_ONCE) &&
+			(os_atomic_load(&name_node->state_sets, relaxed) == os_atomic_load(&name_node->state_synced, relaxed)) &&
+			shm_state_read(globals, r->slot, nid, state))
+		{
+			registration_node_release(r);
+#ifdef DEBUG
+			if (_libnotify_debug & DEBUG_API) _notify_client_log(ASL_LEVEL_NOTICE, "<- %s [%d]\n", __func__, __LINE__ + 2);
+#endif
+			return NOTIFY_STATUS_OK;
+		}
+	}
+
 	if (globals->notify_server_port == MACH_PORT_NULL)
 	{
 		status = _notify_lib_init(globals, EVENT_INIT);
@@ -3837,6 +4782,9 @@ notify_get_state(int token, uint64_t *state)
 		int xtoken = token;
 		if (r->flags & NOTIFY_FLAG_COALESCED) xtoken = name_node->coalesce_base_token;
 
+		/* the reply is ordered after every set this process sent before asking */
+		uint32_t sets = os_atomic_load(&name_node->state_sets, relaxed);
+
 		// This is a race, but it is safe. The worst case is that nid is looked-up and set twice.
 		mutex_lock(name_node->name, &name_node->lock, __func__, __LINE__);
 		nid = name_node->name_id;
@@ -3851,6 +4799,8 @@ notify_get_state(int token, uint64_t *state)
 		{
 			kstatus = _notify_server_get_state_2(globals->notify_server_port, nid, state, (int32_t *)&status);
 		}
+
+		if (kstatus == KERN_SUCCESS) os_atomic_store(&name_node->state_synced, sets, relaxed);
 	}
 
 	registration_node_release(r);
@@ -3965,6 +4915,9 @@ notify_set_state(int token, uint64_t state)
 		nid = name_node->name_id;
 		mutex_unlock(name_node->name, &name_node->lock, __func__, __LINE__);
 
+		/* set_state_2 is asynchronous; keep notify_get_state off shared memory until an IPC get has seen it */
+		os_atomic_inc(&name_node->state_sets, relaxed);
+
 		if ((nid == NID_UNSET) || (nid == NID_CALLED_ONCE))
 		{
 			kstatus = _notify_server_set_state_3(globals->notify_server_port, xtoken, state, (uint64_t *)&nid, (int32_t *)&status, should_claim_root_access());
@@ -4027,7 +4980,7 @@ notify_cancel(int token)
 
 	mutex_lock("global", &globals->notify_lock, __func__, __LINE__);
 
-	r = _nc_table_find_n(&globals->registration_table, token);
+	r = registration_index_find_locked(globals, token);
 	if (r == NULL)
 	{
 		mutex_unlock("global", &globals->notify_lock, __func__, __LINE__);
@@ -4343,8 +5296,8 @@ notify_simple_post(const char *name)
 }
 
 
-uint32_t
-notify_dump_status(const char *filepath)
+static uint32_t
+_notify_dump(const char *filepath, uint32_t level)
 {
 	notify_globals_t globals;
 	uint32_t status;
@@ -4389,7 +5342,7 @@ notify_dump_status(const char *filepath)
 	}
 
 
-	kstatus = _notify_server_dump(globals->notify_server_port, (mach_port_t)fileport);
+	kstatus = _notify_server_dump_2(globals->notify_server_port, (mach_port_t)fileport, level);
 	close(file_descriptor);
 	if(kstatus != KERN_SUCCESS)
 	{
@@ -4401,4 +5354,28 @@ notify_dump_status(const char *filepath)
 	return NOTIFY_STATUS_OK;
 }
 
+uint32_t
+notify_dump_status(const char *filepath)
+{
+	return _notify_dump(filepath, NOTIFY_DUMP_STATUS);
+}
+
+uint32_t
+notify_dump_top_posters(const char *filepath)
+{
+	return _notify_dump(filepath, NOTIFY_DUMP_TOP_POSTERS);
+}
+
+uint32_t
+notify_dump_histograms(const char *filepath)
+{
+	return _notify_dump(filepath, NOTIFY_DUMP_HISTOGRAMS);
+}
+
+uint32_t
+notify_dump_binary(const char *filepath)
+{
+	return _notify_dump(filepath, NOTIFY_DUMP_BINARY);
+}
+
 
@@ -26,7 +26,10 @@
 #include <os/lock.h>
 #include <dispatch/dispatch.h>
 #include <mach/mach.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
 #include <TargetConditionals.h>
 
 #include "libnotify.h"
@@ -84,14 +87,68 @@
 #define NOTIFY_STATUS_TOKEN_FIRE_FAILED 58
 #define NOTIFY_STATUS_INVALID_PORT_INTERNAL 59
 #define NOTIFY_STATUS_NO_NID 60
+#define NOTIFY_STATUS_SERVER_POST_MANY_FAILED 61
 
 #define IS_INTERNAL_ERROR(X) (X >= 11)
 
 #define USER_PROTECTED_UID_PREFIX "user.uid."
 #define USER_PROTECTED_UID_PREFIX_LEN 9
 
+/*
+ * Returns true if name lies in the user-protected "user.uid." namespace,
+ * in which case *allowed tells whether user <uid> may access it: a user
+ * owns "user.uid.<uid>" and every name below it.
+ *
+ * <uid> is matched as it used to be printed with "%d": canonical decimal,
+ * negative for uids above INT_MAX, no leading zeros.
+ */
+static inline bool
+_notify_user_uid_name(const char *name, uid_t uid, bool *allowed)
+{
+	const char *p;
+	int64_t value = 0;
+	bool negative = false;
+
+	if (strncmp(name, USER_PROTECTED_UID_PREFIX, USER_PROTECTED_UID_PREFIX_LEN)) return false;
+
+	*allowed = false;
+	p = name + USER_PROTECTED_UID_PREFIX_LEN;
+
+	if (*p == '-')
+	{
+		negative = true;
+		p++;
+	}
+
+	/* "0" is the only number allowed to start with 0, and "-0" is not one */
+	if ((*p < '0') || (*p > '9')) return true;
+	if ((p[0] == '0') && (negative || ((p[1] >= '0') && (p[1] <= '9')))) return true;
+
+	for (; (*p >= '0') && (*p <= '9'); p++)
+	{
+		value = value * 10 + (*p - '0');
+		if (value > (int64_t)INT32_MAX + 1) return true;
+	}
+
+	if ((*p != '\0') && (*p != '.')) return true;
+	if (negative) value = -value;
+	if ((value > INT32_MAX) || (value < INT32_MIN)) return true;
+
+	*allowed = ((int32_t)value == (int32_t)uid);
+	return true;
+}
+
 #define CANARY_COUNT 13
 
+#define NOTIFY_TOKEN_PAGE_BITS 8
+#define NOTIFY_TOKEN_PAGE_SIZE (1u << NOTIFY_TOKEN_PAGE_BITS)
+
+/* one level of the client's token -> registration index */
+typedef struct notify_token_page_s
+{
+	void *entry[NOTIFY_TOKEN_PAGE_SIZE];
+} notify_token_page_t;
+
 struct notify_globals_s
 {
 	uint64_t canary[CANARY_COUNT];
@@ -99,8 +156,6 @@ struct notify_globals_s
 	/* global lock */
 	os_unfair_lock notify_lock;
 
-	/* notify_check() lock */
-	os_unfair_lock check_lock;
 	pid_t notify_server_pid;
 
 	atomic_uint_fast32_t client_opts;
@@ -118,7 +173,8 @@ struct notify_globals_s
 	dispatch_source_t server_proc_source;
 
 	dispatch_once_t internal_once;
-	table_n_t registration_table;
+	notify_token_page_t registration_index;
+	void *registration_free_list;
 	table_t name_node_table;
 	atomic_uint_fast32_t token_id;
 
@@ -142,6 +198,11 @@ struct notify_globals_s
 
 	/* shared memory base address */
 	uint32_t *shm_base;
+
+	/* segments the table has grown into, mapped on first use; [0] is shm_base */
+	uint32_t shm_segment_slots;
+	uint32_t *shm_segment[NOTIFY_SHM_MAX_SEGMENTS];
+	notify_shm_state_t *shm_state[NOTIFY_SHM_MAX_SEGMENTS];
 };
 
 typedef struct notify_globals_s *notify_globals_t;
@@ -31,6 +31,12 @@
 
 #define NOTIFY_OPT_DISPATCH 0x00000001
 #define NOTIFY_OPT_REGEN    0x00000002
+/*
+ * Repeated notify_post calls for a name this process has registered
+ * collapse into one post sent from a background queue.  Posts reach
+ * notifyd after notify_post returns.
+ */
+#define NOTIFY_OPT_COALESCE_POSTS 0x00000004
 #define NOTIFY_OPT_ENABLE   0x04000000
 #define NOTIFY_OPT_DISABLE  0x08000000
 
@@ -71,4 +77,21 @@ __OSX_AVAILABLE_STARTING(__MAC_10_7,__IPHONE_4_3);
 
 OS_EXPORT uint32_t notify_dump_status(const char *filepath);
 
+// Writes the names and pids that posted most in the last second, minute
+// and hour to filepath.  Counts are estimates, high by at most the error
+// shown next to them.  Same requirements as notify_dump_status.
+OS_EXPORT uint32_t notify_dump_top_posters(const char *filepath);
+
+// Writes notifyd's per-routine latency and per-post fan-out histograms to
+// filepath, one line per histogram: kind, name, count, sum, max, then
+// floor:count for each non-empty bucket.  Same requirements as
+// notify_dump_status.
+OS_EXPORT uint32_t notify_dump_histograms(const char *filepath);
+
+// Starts a binary dump of notifyd's names, clients, processes, ports and
+// statistics to filepath.  notifyd keeps writing after this returns; the
+// dump is complete once it ends with an empty NOTIFY_DUMP_REC_END record.
+// "notifyutil --decode" prints it.  Same requirements as notify_dump_status.
+OS_EXPORT uint32_t notify_dump_binary(const char *filepath);
+
 #endif /* __NOTIFY_PRIVATE_H__ */
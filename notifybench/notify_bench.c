@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <math.h>
@@ -6,8 +7,12 @@
 #include <mach/mach.h>
 #include <mach/mach_time.h>
 #include <assert.h>
+#include <signal.h>
+#include <sys/sysctl.h>
+#include <sys/wait.h>
 
 #include "notify_private.h"
+#include "libnotify.h"
 
 #ifdef NO_OP_TESTS
 extern uint32_t notify_no_op_str_sync(const char *name, size_t len);
@@ -35,10 +40,13 @@ static long double loop_cost;
 static mach_timebase_info_data_t tbi;
 static uint64_t dmy[MAX_SPL], reg_plain[MAX_SPL], cancel_plain[MAX_SPL], reg_port[MAX_SPL], cancel_port[MAX_SPL];
 static uint64_t post_plain1[MAX_SPL], post_plain2[MAX_SPL], post_plain3[MAX_SPL];
+static uint64_t post_many_cold[MAX_SPL], post_many[MAX_SPL];
 static uint64_t set_state1[MAX_SPL], set_state2[MAX_SPL], get_state[MAX_SPL];
 static uint64_t reg_check[MAX_SPL], cancel_check[MAX_SPL];
 static uint64_t check1[MAX_SPL], check2[MAX_SPL], check3[MAX_SPL], check4[MAX_SPL], check5[MAX_SPL];
 static uint64_t reg_disp1[MAX_SPL], reg_disp2[MAX_SPL], cancel_disp[MAX_SPL];
+static uint64_t reg_disp_each[MAX_SPL], reg_disp_many[MAX_SPL];
+static uint64_t get_state_ipc[MAX_SPL], get_state_shm[MAX_SPL];
 
 volatile static int dispatch_changer = 0;
 
@@ -112,6 +120,374 @@ notify_fence()
 	notify_cancel(fence_token);
 }
 
+/* -b: app launch, registering MAX_CNT names one at a time vs. in bulk */
+static int
+bench_register_many(dispatch_queue_t disp_q)
+{
+	uint32_t r;
+	int t[MAX_CNT];
+	char *n[MAX_CNT];
+	uint64_t s;
+	volatile uint32_t spin = 0;
+
+	cnt = MAX_CNT;
+
+	for (uint32_t i = 0; i < cnt; i++)
+	{
+		r = asprintf(&n[i], "dummy.test.launch.%d", i);
+		assert(r != (uint32_t)~0);
+	}
+
+	for (uint32_t j = 0 ; j < spl; j++)
+	{
+		/* Empty Loop */
+		s = mach_absolute_time();
+		for (uint32_t i = 0; i < cnt; i++)
+		{
+			spin++;
+		}
+		dmy[j] = mach_absolute_time() - s;
+
+		/* Register Dispatch, one name at a time */
+		s = mach_absolute_time();
+		for (uint32_t i = 0; i < cnt; i++)
+		{
+			r = notify_register_dispatch(n[i], &t[i], disp_q, ^(int x){
+				dispatch_changer = x;
+			});
+			assert(r == 0);
+		}
+		reg_disp_each[j] = mach_absolute_time() - s;
+
+		for (uint32_t i = 0; i < cnt; i++)
+		{
+			r = notify_cancel(t[i]);
+			assert(r == 0);
+		}
+
+		/* Register Dispatch Many */
+		s = mach_absolute_time();
+		r = notify_register_dispatch_many((const char **)n, cnt, t, disp_q, ^(int x){
+			dispatch_changer = x;
+		});
+		assert(r == 0);
+		reg_disp_many[j] = mach_absolute_time() - s;
+
+		for (uint32_t i = 0; i < cnt; i++)
+		{
+			r = notify_cancel(t[i]);
+			assert(r == 0);
+		}
+	}
+
+	for (uint32_t i = 0; i < cnt; i++)
+	{
+		free(n[i]);
+	}
+
+	print_result(dmy, NULL);
+	print_result(reg_disp_each, "notify_register_dispatch [each]:");
+	print_result(reg_disp_many, "notify_register_dispatch_many:");
+
+	return 0;
+}
+
+/* -g: notify_get_state answered by notifyd vs. read from shared memory */
+static int
+bench_get_state(void)
+{
+	uint32_t r;
+	int t_plain[MAX_CNT], t_check[MAX_CNT];
+	char *n[MAX_CNT];
+	uint64_t s, state;
+	volatile uint32_t spin = 0;
+
+	for (uint32_t i = 0; i < cnt; i++)
+	{
+		r = asprintf(&n[i], "dummy.test.state.%d", i);
+		assert(r != (uint32_t)~0);
+
+		/* plain registrations always ask notifyd, check registrations have a slot */
+		r = notify_register_plain(n[i], &t_plain[i]);
+		assert(r == 0);
+		r = notify_register_check(n[i], &t_check[i]);
+		assert(r == 0);
+
+		r = notify_set_state(t_check[i], i);
+		assert(r == 0);
+
+		/* the first get goes through notifyd, and sees the set */
+		r = notify_get_state(t_check[i], &state);
+		assert(r == 0);
+		assert(state == i);
+	}
+
+	for (uint32_t j = 0 ; j < spl; j++)
+	{
+		/* Empty Loop */
+		s = mach_absolute_time();
+		for (uint32_t i = 0; i < cnt; i++)
+		{
+			spin++;
+		}
+		dmy[j] = mach_absolute_time() - s;
+
+		/* Get State [IPC] */
+		s = mach_absolute_time();
+		for (uint32_t i = 0; i < cnt; i++)
+		{
+			r = notify_get_state(t_plain[i], &state);
+			assert(r == 0);
+		}
+		get_state_ipc[j] = mach_absolute_time() - s;
+
+		/* Get State [shared memory] */
+		s = mach_absolute_time();
+		for (uint32_t i = 0; i < cnt; i++)
+		{
+			r = notify_get_state(t_check[i], &state);
+			assert(r == 0);
+		}
+		get_state_shm[j] = mach_absolute_time() - s;
+	}
+
+	for (uint32_t i = 0; i < cnt; i++)
+	{
+		notify_cancel(t_plain[i]);
+		notify_cancel(t_check[i]);
+		free(n[i]);
+	}
+
+	print_result(dmy, NULL);
+	print_result(get_state_ipc, "notify_get_state [IPC]:");
+	print_result(get_state_shm, "notify_get_state [shared memory]:");
+
+	return 0;
+}
+
+#define LOAD_SUBSCRIBERS 64
+#define LOAD_POSTS 2000
+
+/* a subscriber process for -l: many port registrations, drained forever */
+static void __attribute__((noreturn))
+load_client(int ready_fd)
+{
+	mach_port_t pset, p;
+	kern_return_t kr;
+	uint32_t r;
+	int t;
+	struct {
+		mach_msg_header_t header;
+		uint8_t body[128];
+	} msg;
+
+	kr = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_PORT_SET, &pset);
+	assert(kr == 0);
+
+	for (uint32_t i = 0; i < LOAD_SUBSCRIBERS; i++)
+	{
+		r = notify_register_mach_port("dummy.test.load", &p, 0, &t);
+		assert(r == 0);
+		kr = mach_port_move_member(mach_task_self(), p, pset);
+		assert(kr == 0);
+	}
+
+	(void)write(ready_fd, "", 1);
+	close(ready_fd);
+
+	for (;;)
+	{
+		(void)mach_msg(&msg.header, MACH_RCV_MSG, 0, sizeof(msg), pset, 0, MACH_PORT_NULL);
+	}
+}
+
+/* -l: post throughput as subscribing client processes are added */
+static int
+bench_load(uint32_t max_clients)
+{
+	pid_t pids[MAX_CNT];
+	uint32_t posters, running = 0;
+	size_t len = sizeof(posters);
+	int fds[2], rc;
+	char c;
+
+	if (max_clients > MAX_CNT) max_clients = MAX_CNT;
+	if (sysctlbyname("hw.activecpu", &posters, &len, NULL, 0) != 0) posters = 1;
+
+	printf("%u posting threads, %u registrations per client\n", posters, LOAD_SUBSCRIBERS);
+	printf("%-8s %-12s %-14s %s\n", "Clients", "Subscribers", "Posts/s", "Deliveries/s");
+
+	for (uint32_t clients = 1; clients <= max_clients; clients *= 2)
+	{
+		for (; running < clients; running++)
+		{
+			rc = pipe(fds);
+			assert(rc == 0);
+			pids[running] = fork();
+			assert(pids[running] >= 0);
+			if (pids[running] == 0)
+			{
+				close(fds[0]);
+				load_client(fds[1]);
+			}
+
+			close(fds[1]);
+			rc = (int)read(fds[0], &c, 1);
+			assert(rc == 1);
+			close(fds[0]);
+		}
+
+		notify_fence();
+
+		uint64_t s = mach_absolute_time();
+		dispatch_apply(posters, DISPATCH_APPLY_AUTO, ^(size_t i) {
+			for (uint32_t j = 0; j < LOAD_POSTS / posters; j++) notify_post("dummy.test.load");
+		});
+		notify_fence();
+		uint64_t ns = (mach_absolute_time() - s) * tbi.numer / tbi.denom;
+
+		long double posts = (long double)(LOAD_POSTS / posters * posters);
+		long double rate = posts * NSEC_PER_SEC / (long double)ns;
+		printf("%-8u %-12u %-14.0Lf %.0Lf\n", clients, clients * LOAD_SUBSCRIBERS, rate, rate * clients * LOAD_SUBSCRIBERS);
+	}
+
+	for (uint32_t i = 0; i < running; i++)
+	{
+		kill(pids[i], SIGKILL);
+		waitpid(pids[i], NULL, 0);
+	}
+
+	printf("compare runs against notifyd started with different -shards values\n");
+
+	return 0;
+}
+
+#define POST_LOOP_NAME "dummy.test.post_loop"
+
+/* messages this task has sent */
+static uint64_t
+messages_sent(void)
+{
+	task_events_info_data_t info = {};
+	mach_msg_type_number_t count = TASK_EVENTS_INFO_COUNT;
+	kern_return_t kr;
+
+	kr = task_info(mach_task_self(), TASK_EVENTS_INFO, (task_info_t)&info, &count);
+	assert(kr == 0);
+	return (uint64_t)info.messages_sent;
+}
+
+/* -p: a tight loop of posts to one name, sent one by one and then with NOTIFY_OPT_COALESCE_POSTS */
+static int
+bench_post_loop(uint32_t posts)
+{
+	uint64_t s, ns, m;
+	uint32_t r;
+	int tok;
+
+	r = notify_register_check(POST_LOOP_NAME, &tok);
+	assert(r == 0);
+
+	/* the first two posts of a name go by name, to fetch its name ID */
+	notify_post(POST_LOOP_NAME);
+	notify_post(POST_LOOP_NAME);
+
+	printf("%-12s %-14s %-10s %s\n", "Mode", "Posts/s", "Messages", "Per post");
+
+	for (int coalesce = 0; coalesce < 2; coalesce++)
+	{
+		if (coalesce) notify_set_options(NOTIFY_OPT_COALESCE_POSTS);
+		notify_fence();
+
+		m = messages_sent();
+		s = mach_absolute_time();
+		for (uint32_t i = 0; i < posts; i++) notify_post(POST_LOOP_NAME);
+		ns = (mach_absolute_time() - s) * tbi.numer / tbi.denom;
+
+		/* let a coalesced post still on the background queue go out */
+		usleep(10000);
+		m = messages_sent() - m;
+
+		printf("%-12s %-14.0Lf %-10llu %.4Lf\n", coalesce ? "coalesced" : "one by one",
+				(long double)posts * NSEC_PER_SEC / (long double)ns, m, (long double)m / (long double)posts);
+	}
+
+	notify_cancel(tok);
+	return 0;
+}
+
+#define RESTART_NAMES 1000
+
+/*
+ * -r: kill notifyd while holding this many registrations, and time how
+ * long until they all work again.  Must be run as root.
+ */
+static int
+bench_restart(uint32_t regs)
+{
+	int v_token, *tokens;
+	uint32_t r, names, lost = 0;
+	uint64_t state, s, ns;
+	pid_t server_pid, new_pid;
+	char name[64];
+
+	r = notify_register_check(NOTIFY_IPC_VERSION_NAME, &v_token);
+	assert(r == 0);
+	r = notify_get_state(v_token, &state);
+	assert(r == 0);
+	server_pid = (pid_t)(state >> 32);
+
+	tokens = calloc(regs, sizeof(int));
+	assert(tokens != NULL);
+	names = (regs < RESTART_NAMES) ? regs : RESTART_NAMES;
+
+	s = mach_absolute_time();
+	for (uint32_t i = 0; i < regs; i++)
+	{
+		snprintf(name, sizeof(name), "dummy.test.restart.%u", i % RESTART_NAMES);
+		r = notify_register_check(name, &tokens[i]);
+		assert(r == 0);
+	}
+	ns = (mach_absolute_time() - s) * tbi.numer / tbi.denom;
+	printf("%u registrations on %u names in %.3Lf ms\n", regs, names, (long double)ns / NSEC_PER_MSEC);
+
+	for (uint32_t i = 0; i < names; i++)
+	{
+		r = notify_set_state(tokens[i], i + 1);
+		assert(r == 0);
+	}
+
+	if (kill(server_pid, SIGKILL) != 0)
+	{
+		perror("kill notifyd");
+		return 1;
+	}
+
+	/* the first call to reach the new notifyd regenerates every registration */
+	s = mach_absolute_time();
+	do
+	{
+		r = notify_get_state(v_token, &state);
+		new_pid = (pid_t)(state >> 32);
+		if ((r != 0) || (new_pid == server_pid)) usleep(100);
+	} while ((r != 0) || (new_pid == server_pid));
+	ns = (mach_absolute_time() - s) * tbi.numer / tbi.denom;
+	printf("notifyd %d replaced by %d, registrations back after %.3Lf ms\n", server_pid, new_pid, (long double)ns / NSEC_PER_MSEC);
+
+	for (uint32_t i = 0; i < names; i++)
+	{
+		r = notify_get_state(tokens[i], &state);
+		if ((r != 0) || (state != (i + 1))) lost++;
+	}
+	printf("%u of %u names lost their state\n", lost, names);
+
+	for (uint32_t i = 0; i < regs; i++) notify_cancel(tokens[i]);
+	notify_cancel(v_token);
+	free(tokens);
+
+	return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -139,15 +515,32 @@ main(int argc, char *argv[])
 
 	dispatch_queue_t disp_q = dispatch_queue_create("Notify.Test", NULL);
 
+	bool bulk = false;
+	bool state = false;
+	uint32_t load = 0;
+	uint32_t restart = 0;
+	uint32_t post_loop = 0;
+
 	for (int i = 1; i < argc; i++)
 	{
 		if (!strcmp(argv[i], "-c")) cnt = atoi(argv[++i]);
 		else if (!strcmp(argv[i], "-s")) spl = atoi(argv[++i]) + 1;
+		else if (!strcmp(argv[i], "-b")) bulk = true;
+		else if (!strcmp(argv[i], "-g")) state = true;
+		else if (!strcmp(argv[i], "-l")) load = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-r")) restart = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-p")) post_loop = atoi(argv[++i]);
 	}
 
 	if (cnt > MAX_CNT) cnt = MAX_CNT;
 	if (spl > MAX_SPL) spl = MAX_SPL + 1;
 
+	if (bulk) return bench_register_many(disp_q);
+	if (state) return bench_get_state();
+	if (load) return bench_load(load);
+	if (restart) return bench_restart(restart);
+	if (post_loop) return bench_post_loop(post_loop);
+
 	for (uint32_t j = 0 ; j < spl; j++)
 	{
 		for (uint32_t i = 0; i < cnt; i++)
@@ -205,6 +598,12 @@ main(int argc, char *argv[])
 		
 
 
+		/* Post Many (cold names, sent as strings) */
+		s = mach_absolute_time();
+		r = notify_post_many((const char **)n, cnt);
+		assert(r == 0);
+		post_many_cold[j] = mach_absolute_time() - s;
+
 		/* Register Plain */
 		s = mach_absolute_time();
 		for (uint32_t i = 0; i < cnt; i++)
@@ -240,6 +639,12 @@ main(int argc, char *argv[])
 			assert(r == 0);
 		}
 		post_plain3[j] = mach_absolute_time() - s;
+
+		/* Post Many (name IDs known, same names as Post 3) */
+		s = mach_absolute_time();
+		r = notify_post_many((const char **)n, cnt);
+		assert(r == 0);
+		post_many[j] = mach_absolute_time() - s;
 		
 		/* Cancel Plain */
 		s = mach_absolute_time();
@@ -427,6 +832,8 @@ main(int argc, char *argv[])
 	print_result(post_plain1,  "notify_post [plain 1]:");
 	print_result(post_plain2,  "notify_post [plain 2]:");
 	print_result(post_plain3,  "notify_post [plain 3]:");
+	print_result(post_many_cold,  "notify_post_many [cold]:");
+	print_result(post_many,  "notify_post_many [plain]:");
 	print_result(cancel_plain, "notify_cancel [plain]:");
 	print_result(reg_port,  "notify_register_mach_port:");
 	print_result(set_state1,  "notify_set_state [1]:");
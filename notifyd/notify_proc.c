@@ -309,9 +309,16 @@ port_proc_cancel_client(client_t *c)
 	n = c->name_info;
 	assert(n != NULL);
 
-	if (notify_is_type(c->state_and_type, NOTIFY_TYPE_MEMORY))
+	if (notify_is_type(c->state_and_type, NOTIFY_TYPE_MEMORY) && (n->slot != SLOT_NONE))
 	{
-		global.shared_memory_refcount[n->slot]--;
+		/* the name lets go of its slot with its last memory registration; the slot goes with its last name */
+		n->slot_refcount--;
+		if (n->slot_refcount == 0)
+		{
+			global.shared_memory_refcount[n->slot]--;
+			if (global.shared_memory_refcount[n->slot] == 0) shm_slot_release(n->slot);
+			n->slot = SLOT_NONE;
+		}
 	}
 	else if (notify_is_type(c->state_and_type, NOTIFY_TYPE_PORT) || notify_is_type(c->state_and_type, NOTIFY_TYPE_COMMON_PORT))
 	{
@@ -497,9 +504,10 @@ kern_return_t __notify_server_post_3
 		return KERN_SUCCESS; // No one is registered for the name
 	}
 
-	n->postcount++;
+	_notify_lib_name_posted(&global.notify_state, n);
 
 	server_preflight(audit, -1, &uid, &gid, &pid, NULL);
+	heavy_hitter_record(n->name, n->name_hash, pid);
 	
 	if ((uid != 0) && claim_root_access && has_root_entitlement(audit))
 	{
@@ -541,6 +549,7 @@ kern_return_t __notify_server_post_2
 	*name_id = 0;
 
 	server_preflight(audit, -1, &uid, &gid, &pid, NULL);
+	heavy_hitter_record(name, _nc_string_hash(name, strlen(name)), pid);
 
 	if ((uid != 0) && claim_root_access && has_root_entitlement(audit))
 	{
@@ -570,7 +579,7 @@ kern_return_t __notify_server_post_2
 	}
 	else
 	{
-		n->postcount++;
+		_notify_lib_name_posted(&global.notify_state, n);
 		*name_id = n->name_id;
 	}
 
@@ -600,6 +609,91 @@ kern_return_t __notify_server_post_4
 	return kstatus;
 }
 
+kern_return_t __notify_server_post_many
+(
+	mach_port_t server,
+	notify_nid_list_t name_ids,
+	mach_msg_type_number_t name_idsCnt,
+	caddr_t names,
+	mach_msg_type_number_t namesCnt,
+	boolean_t claim_root_access,
+	audit_token_t audit
+)
+{
+	uid_t uid = (uid_t)-1;
+	gid_t gid = (gid_t)-1;
+	pid_t pid = (pid_t)-1;
+	uint32_t status;
+	name_info_t *n;
+	char *name, *end;
+
+	if ((namesCnt > 0) && (string_validate(names, namesCnt) != NOTIFY_STATUS_OK))
+	{
+		return KERN_SUCCESS;
+	}
+
+	call_statistics.post_many++;
+
+	/* one preflight and entitlement check covers the whole batch */
+	server_preflight(audit, -1, &uid, &gid, &pid, NULL);
+
+	if ((uid != 0) && claim_root_access && has_root_entitlement(audit))
+	{
+		uid = 0;
+	}
+
+	/* a process subscribed to several of the names gets one message */
+	_notify_lib_port_batch_begin(&global.notify_state);
+
+	/* IDs go before strings; notify_post_many never sends an ID that followed a string in the same batch */
+	for (mach_msg_type_number_t i = 0; i < name_idsCnt; i++)
+	{
+		n = _nc_table_find_64(&global.notify_state.name_id_table, name_ids[i]);
+		if (n == NULL) continue;
+
+		_notify_lib_name_posted(&global.notify_state, n);
+		heavy_hitter_record(n->name, n->name_hash, pid);
+
+		status = _notify_lib_check_controlled_access(&global.notify_state, n->name, uid, gid, NOTIFY_ACCESS_WRITE);
+		if (status != NOTIFY_STATUS_OK) continue;
+
+		call_statistics.post++;
+		call_statistics.post_by_id++;
+
+		log_message(ASL_LEVEL_DEBUG, "__notify_server_post_many %s %d by nameid: %llu \n", n->name, pid, name_ids[i]);
+
+		status = daemon_post_nid(name_ids[i], uid, gid);
+		assert(status == NOTIFY_STATUS_OK);
+	}
+
+	end = names + namesCnt;
+	for (name = names; name < end; name += strlen(name) + 1)
+	{
+		if (name[0] == '\0') continue;
+
+		heavy_hitter_record(name, _nc_string_hash(name, strlen(name)), pid);
+
+		status = _notify_lib_check_controlled_access(&global.notify_state, name, uid, gid, NOTIFY_ACCESS_WRITE);
+		if (status != NOTIFY_STATUS_OK) continue;
+
+		call_statistics.post++;
+		call_statistics.post_by_name++;
+
+		log_message(ASL_LEVEL_DEBUG, "__notify_server_post_many %s %d\n", name, pid);
+
+		status = daemon_post(name, uid, gid);
+		assert(status != NOTIFY_STATUS_NULL_INPUT);
+
+		n = _nc_table_find(&global.notify_state.name_table, name);
+		if (n == NULL) call_statistics.post_no_op++;
+		else _notify_lib_name_posted(&global.notify_state, n);
+	}
+
+	_notify_lib_port_batch_end(&global.notify_state);
+
+	return KERN_SUCCESS;
+}
+
 kern_return_t __notify_server_register_plain_2
 (
 	mach_port_t server,
@@ -650,7 +744,8 @@ kern_return_t __notify_server_register_check_2
 )
 {
 	name_info_t *n;
-	uint32_t i, j, x, new_slot;
+	uint32_t x, new_slot;
+	bool shared;
 	uint64_t cid = 0;
 	client_t *c;
 	uid_t uid = (uid_t)-1;
@@ -674,69 +769,56 @@ kern_return_t __notify_server_register_check_2
 		return __notify_server_register_plain_2(server, name, token, audit);
 	}
 
-	x = (uint32_t)-1;
+	x = SLOT_NONE;
+	new_slot = 0;
+	shared = false;
 
+	/* a name keeps its slot while any memory registration is using it */
 	n = _nc_table_find(&global.notify_state.name_table, name);
-	if (n != NULL) x = n->slot;
+	if ((n != NULL) && (n->slot != SLOT_NONE)) x = n->slot;
 
-	new_slot = 0;
-	if (x == (uint32_t)-1) 
+	if (x == SLOT_NONE)
 	{
-		/* find a slot */
-		new_slot = 1;
-
 		/*
-		 * Check slots beginning at the current slot_id + 1, since it's likely that the
-		 * next slot will be available.  Keep looking until we have examined all the
-		 * slots (skipping slot 0, which is reserved for notifyd). Stop if we find
-		 * an unused (refcount == 0) slot.
+		 * Take a free slot from the bitmap.  If the table is full, the
+		 * allocator hands back the slot that has gone longest without a
+		 * post, and this name shares it.
 		 */
-		for (i = 1, j = global.slot_id + 1; i < global.nslots; i++, j++)
+		x = shm_slot_alloc(&shared);
+		if (x == SLOT_NONE)
 		{
-			if (j >= global.nslots) j = 1;
-			if (global.shared_memory_refcount[j] == 0)
-			{
-				x = j;
-				break;
-			}
+			*size = -1;
+			*slot = -1;
+			return __notify_server_register_plain_2(server, name, token, audit);
 		}
 
-		if (x == (uint32_t)-1)
-		{
-			/*
-			 * We did not find an unused slot.  At this point, the shared
-			 * memory table is full, so we start re-using slots, beginning at 
-			 * global.slot_id + 1.
-			 */
-			global.slot_id++;
-
-			/* wrap around to slot 1 (slot 0 is reserved for notifyd) */
-			if (global.slot_id >= global.nslots) global.slot_id = 1;
-			log_message(ASL_LEVEL_DEBUG, "reused shared memory slot %u\n", global.slot_id);
-			x = global.slot_id;
-		}
-		else
-		{
-			/* found a free slot */
-			global.slot_id = x;
-		}
+		if (!shared) new_slot = 1;
 	}
 
-	if (new_slot == 1) global.shared_memory_base[x] = 1;
-	global.shared_memory_refcount[x]++;
+	if (new_slot == 1) *shm_slot_value(x) = 1;
 
 	log_message(ASL_LEVEL_DEBUG, "__notify_server_register_check %s %d %d\n", name, pid, token);
 
-	*size = global.nslots * sizeof(uint32_t);
+	/* clients map one segment of this size per slot range */
+	*size = global.shm_segment_slots * sizeof(uint32_t);
 	*slot = x;
 	*status = _notify_lib_register_plain(&global.notify_state, name, pid, token, x, uid, gid, name_id);
 	if (*status != NOTIFY_STATUS_OK)
 	{
+		/* no name took the slot it was given */
+		if ((new_slot == 1) && (global.shared_memory_refcount[x] == 0)) shm_slot_release(x);
 		return KERN_SUCCESS;
 	}
 
 	c = _nc_table_find_64(&global.notify_state.client_table, cid);
 
+	/* shared_memory_refcount counts the names holding a slot, slot_refcount the registrations holding a name's */
+	if (c->name_info->slot_refcount == 0) global.shared_memory_refcount[x]++;
+	c->name_info->slot_refcount++;
+
+	/* a new or shared slot now carries this name's state */
+	shm_state_publish(c->name_info);
+
 	if (!strncmp(name, SERVICE_PREFIX, SERVICE_PREFIX_LEN)) service_open(name, c, audit);
 
 	register_proc(c, pid);
@@ -1203,6 +1285,11 @@ kern_return_t __notify_server_set_state_3
 		assert(c->name_info != NULL);
 		*status = _notify_lib_set_state(&global.notify_state, c->name_info->name_id, state, uid, gid);
 		assert(*status == NOTIFY_STATUS_OK || *status == NOTIFY_STATUS_NOT_AUTHORIZED);
+		if (*status == NOTIFY_STATUS_OK)
+		{
+			shm_state_publish(c->name_info);
+			journal_record_state(c->name_info);
+		}
 
 		*name_id = c->name_info->name_id; 
 	}
@@ -1239,6 +1326,9 @@ kern_return_t __notify_server_set_state_2
 
 	if(status == NOTIFY_STATUS_OK){
 		log_message(ASL_LEVEL_DEBUG, "__notify_server_set_state_2 %d %llu %llu [uid %d%s gid %d]\n", pid, name_id, state, uid, root_entitlement ? " (entitlement)" : "", gid);
+		name_info_t *n = _nc_table_find_64(&global.notify_state.name_id_table, name_id);
+		shm_state_publish(n);
+		journal_record_state(n);
 	}
 
 	assert(status == NOTIFY_STATUS_OK || status == NOTIFY_STATUS_NOT_AUTHORIZED ||
@@ -1331,7 +1421,13 @@ kern_return_t __notify_server_regenerate
 	c = _nc_table_find_64(&global.notify_state.client_table, cid);
 	if (c != NULL)
 	{
-		/* duplicate client - this means that a registration interleaved with regeneration; no need to regen */
+		/*
+		 * duplicate client - this means that a registration interleaved with regeneration; no need to regen.
+		 * The client takes the slot and name ID it is handed, so hand it the ones it has.
+		 */
+		n = c->name_info;
+		*new_nid = n->name_id;
+		*new_slot = (reg_type == NOTIFY_TYPE_MEMORY) ? (int)n->slot : (int)SLOT_NONE;
 		*status = NOTIFY_STATUS_DUP_CLIENT;
 		return KERN_SUCCESS;
 	}
@@ -1340,8 +1436,8 @@ kern_return_t __notify_server_regenerate
 	{
 		case NOTIFY_TYPE_MEMORY:
 		{
-			/* prev_slot must be between 0 and global.nslots */
-			if ((uint32_t)prev_slot >= global.nslots)
+			/* prev_slot may be in any segment the previous notifyd had grown to */
+			if ((uint32_t)prev_slot >= (global.shm_segment_slots * NOTIFY_SHM_MAX_SEGMENTS))
 			{
 				*status = NOTIFY_STATUS_INVALID_REQUEST;
 				return KERN_SUCCESS;
@@ -1350,9 +1446,9 @@ kern_return_t __notify_server_regenerate
 			(void)__notify_server_register_check_2(server, name, token, &size, (int *)new_slot, new_nid, status, audit);
 			if (*status == NOTIFY_STATUS_OK)
 			{
-				if (((uint32_t)*new_slot != SLOT_NONE) && (global.last_shm_base != NULL))
+				if (((uint32_t)*new_slot != SLOT_NONE) && (global.last_shm_base != NULL) && ((uint32_t)prev_slot < global.last_shm_nslots))
 				{
-					global.shared_memory_base[*new_slot] = global.shared_memory_base[*new_slot] + global.last_shm_base[prev_slot] - 1;
+					*shm_slot_value(*new_slot) = *shm_slot_value(*new_slot) + global.last_shm_base[prev_slot] - 1;
 					global.last_shm_base[prev_slot] = 0;
 				}
 			}
@@ -1398,12 +1494,116 @@ kern_return_t __notify_server_regenerate
 		*status = NOTIFY_STATUS_OK;
 		n = c->name_info;
 		*new_nid = n->name_id;
-		if (prev_time > n->state_time) n->state = prev_state;
+		if (prev_time > n->state_time)
+		{
+			n->state = prev_state;
+			n->state_time = prev_time;
+			shm_state_publish(n);
+			journal_record_state(n);
+		}
 	}
 
 	return KERN_SUCCESS;
 }
 
+/* checks every entry of a _notify_server_regenerate_many buffer; returns the number of entries */
+static uint32_t
+regen_buffer_validate(caddr_t buf, mach_msg_type_number_t len, int *status)
+{
+	const notify_regen_entry_t *e;
+	caddr_t name;
+	size_t offset = 0, size;
+	uint32_t count = 0;
+
+	*status = NOTIFY_STATUS_INVALID_REQUEST;
+	if (len > NOTIFY_REGEN_MANY_MAX_BYTES) return 0;
+
+	while (offset < len)
+	{
+		if ((len - offset) < sizeof(notify_regen_entry_t)) return 0;
+
+		e = (const notify_regen_entry_t *)(buf + offset);
+		name = (caddr_t)(e + 1);
+
+		size = NOTIFY_REGEN_ENTRY_SIZE(e->name_len, e->path_len);
+		if (size > (len - offset)) return 0;
+		if ((e->name_len == 0) || (e->name_len > NOTIFY_REGEN_NAME_MAX)) return 0;
+		if (string_validate(name, e->name_len) != NOTIFY_STATUS_OK) return 0;
+		if ((e->path_len > 0) && (string_validate(name + e->name_len, e->path_len) != NOTIFY_STATUS_OK)) return 0;
+
+		offset += size;
+		count++;
+	}
+
+	*status = NOTIFY_STATUS_OK;
+	return count;
+}
+
+/*
+ * Regenerates a buffer of registrations, each as __notify_server_regenerate
+ * would, so a process coming back after notifyd restarted sends one message
+ * rather than one per registration.  Nothing is regenerated unless the
+ * whole buffer is well formed.
+ */
+kern_return_t __notify_server_regenerate_many
+(
+	mach_port_t server,
+	caddr_t registrations,
+	mach_msg_type_number_t registrationsCnt,
+	caddr_t *results,
+	mach_msg_type_number_t *resultsCnt,
+	int *status,
+	audit_token_t audit
+)
+{
+	const notify_regen_entry_t *e;
+	notify_regen_result_t *result;
+	vm_address_t addr = 0;
+	size_t offset;
+	uint32_t count;
+	caddr_t name, path;
+
+	*results = NULL;
+	*resultsCnt = 0;
+
+	call_statistics.regenerate_many++;
+
+	count = regen_buffer_validate(registrations, registrationsCnt, status);
+
+	if ((*status == NOTIFY_STATUS_OK) && (count > 0))
+	{
+		if (vm_allocate(mach_task_self(), &addr, count * sizeof(notify_regen_result_t), VM_FLAGS_ANYWHERE) != KERN_SUCCESS)
+		{
+			*status = NOTIFY_STATUS_FAILED;
+			count = 0;
+		}
+	}
+
+	result = (notify_regen_result_t *)addr;
+	for (offset = 0; count > 0; count--, result++)
+	{
+		e = (const notify_regen_entry_t *)(registrations + offset);
+		name = (caddr_t)(e + 1);
+		path = (e->path_len > 0) ? (name + e->name_len) : NULL;
+		offset += NOTIFY_REGEN_ENTRY_SIZE(e->name_len, e->path_len);
+
+		(void)__notify_server_regenerate(server, name, e->token, e->reg_type, MACH_PORT_NULL, e->sig, e->prev_slot, e->prev_state, e->prev_time,
+				path, e->path_len, (int)e->path_flags, &result->slot, &result->nid, &result->status, audit);
+	}
+
+	if (addr != 0)
+	{
+		*results = (caddr_t)addr;
+		*resultsCnt = (mach_msg_type_number_t)((caddr_t)result - (caddr_t)addr);
+	}
+
+	vm_deallocate(mach_task_self(), (vm_address_t)registrations, registrationsCnt);
+
+	log_message(ASL_LEVEL_DEBUG, "__notify_server_regenerate_many %u bytes -> %u results status %d\n", registrationsCnt, *resultsCnt / (uint32_t)sizeof(notify_regen_result_t), *status);
+
+	return KERN_SUCCESS;
+}
+
 kern_return_t __notify_server_checkin
 (
 	mach_port_t server,
@@ -1427,12 +1627,8 @@ kern_return_t __notify_server_checkin
 }
 
 
-kern_return_t __notify_server_dump
-(
-	mach_port_t server,
-	fileport_t fileport,
-	audit_token_t audit
-)
+static void
+server_dump(fileport_t fileport, uint32_t level, audit_token_t audit)
 {
 	int fd;
 	int flags;
@@ -1441,7 +1637,7 @@ kern_return_t __notify_server_dump
 	if (audit_token_to_euid(audit) != 0)
 	{
 		mach_port_deallocate(mach_task_self(), fileport);
-		return KERN_SUCCESS;
+		return;
 	}
 
 	// Things starting with "forbidden-" will be automatically denied for any
@@ -1449,39 +1645,67 @@ kern_return_t __notify_server_dump
 	// process is in a sandbox and thus can't use this api
 	if (sandbox_check_by_audit_token(audit, "forbidden-remote-device-admin", SANDBOX_FILTER_NONE)) {
 		mach_port_deallocate(mach_task_self(), fileport);
-		return KERN_SUCCESS;
+		return;
 	}
 
 	if (!has_entitlement(audit, NOTIFY_STATE_ENTITLEMENT)) {
 		mach_port_deallocate(mach_task_self(), fileport);
-		return KERN_SUCCESS;
+		return;
 	}
 
 	fd = fileport_makefd(fileport);
 	mach_port_deallocate(mach_task_self(), fileport);
 	if (fd < 0)
 	{
-		return KERN_SUCCESS;
+		return;
 	}
 
 	flags = fcntl(fd, F_GETFL, 0);
 	if (flags < 0)
 	{
 		close(fd);
-		return KERN_SUCCESS;
+		return;
 	}
 
 	flags |= O_NONBLOCK;
 	if (fcntl(fd, F_SETFL, flags) < 0)
 	{
 		close(fd);
-		return KERN_SUCCESS;
+		return;
 	}
 
-	dump_status(STATUS_REQUEST_SHORT, fd);
+	dump_status(level, fd);
 
 	close(fd);
+}
 
+kern_return_t __notify_server_dump
+(
+	mach_port_t server,
+	fileport_t fileport,
+	audit_token_t audit
+)
+{
+	server_dump(fileport, STATUS_REQUEST_SHORT, audit);
+	return KERN_SUCCESS;
+}
+
+kern_return_t __notify_server_dump_2
+(
+	mach_port_t server,
+	fileport_t fileport,
+	uint32_t level,
+	audit_token_t audit
+)
+{
+	// The long text status walks every client, it is only for SIGUSR2
+	if ((level != STATUS_REQUEST_SHORT) && (level != STATUS_REQUEST_TOP) && (level != STATUS_REQUEST_HISTOGRAMS) && (level != STATUS_REQUEST_BINARY))
+	{
+		mach_port_deallocate(mach_task_self(), fileport);
+		return KERN_SUCCESS;
+	}
+
+	server_dump(fileport, level, audit);
 	return KERN_SUCCESS;
 }
 
@@ -1667,6 +1891,62 @@ kern_return_t __notify_server_register_common_port
 	return KERN_SUCCESS;
 }
 
+kern_return_t __notify_server_register_common_port_many
+(
+	mach_port_t server,
+	caddr_t names,
+	mach_msg_type_number_t namesCnt,
+	notify_token_list_t tokens,
+	mach_msg_type_number_t tokensCnt,
+	audit_token_t audit
+)
+{
+	mach_msg_type_number_t i = 0;
+	char *name, *end;
+
+	if (string_validate(names, namesCnt) != NOTIFY_STATUS_OK)
+	{
+		return KERN_SUCCESS;
+	}
+
+	call_statistics.reg_common_many++;
+
+	/* names and tokens pair up in order; a message where they do not is dropped whole */
+	end = names + namesCnt;
+	for (name = names; name < end; name += strlen(name) + 1) i++;
+	if (i != tokensCnt)
+	{
+		log_message(ASL_LEVEL_NOTICE, "__notify_server_register_common_port_many %d: %u names for %u tokens\n", audit_token_to_pid(audit), i, tokensCnt);
+		return KERN_INVALID_ARGUMENT;
+	}
+
+	for (name = names, i = 0; i < tokensCnt; name += strlen(name) + 1, i++)
+	{
+		(void)__notify_server_register_common_port(server, name, tokens[i], audit);
+	}
+
+	return KERN_SUCCESS;
+}
+
+kern_return_t __notify_server_ack
+(
+	mach_port_t server,
+	notify_token_list_t tokens,
+	mach_msg_type_number_t tokensCnt,
+	audit_token_t audit
+)
+{
+	pid_t pid = audit_token_to_pid(audit);
+
+	call_statistics.ack++;
+
+	log_message(ASL_LEVEL_DEBUG, "__notify_server_ack %d %u tokens\n", pid, tokensCnt);
+
+	_notify_lib_ack(&global.notify_state, pid, tokens, tokensCnt);
+
+	return KERN_SUCCESS;
+}
+
 kern_return_t __notify_server_register_mach_port_3
 (
 	mach_port_t server,
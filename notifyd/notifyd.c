@@ -35,6 +35,7 @@
 #include <sys/syslimits.h>
 #include <sys/param.h>
 #include <sys/resource.h>
+#include <sys/sysctl.h>
 #include <xpc/xpc.h>
 #include <xpc/private.h>
 #include <asl.h>
@@ -42,6 +43,9 @@
 #include <inttypes.h>
 #include <TargetConditionals.h>
 #include <bsm/libbsm.h>
+#include <mach/mach_time.h>
+#include <libproc.h>
+#include <os/atomic_private.h>
 #include <servers/bootstrap.h>
 #include <os/trace_private.h>
 
@@ -79,18 +83,12 @@ static char *status_file = NULL;
 
 struct global_s global;
 struct call_statistics_s call_statistics;
+struct histograms_s histograms;
 
 static void
 notify_reset_stats(void)
 {
-	_nc_table_foreach(&global.notify_state.name_table, ^bool (void *_n){
-		name_info_t *n = _n;
-
-		n->last_hour_postcount = n->postcount;
-		n->postcount = 0;
-		return true;
-	});
-
+	_notify_lib_stats_reset(&global.notify_state);
 	global.last_reset_time = time(NULL);
 }
 
@@ -219,6 +217,8 @@ fprint_quick_name_info(FILE *f, name_info_t *n)
 	// <client info>
 	// <client info>
 	// ...
+	_notify_lib_name_stats(&global.notify_state, n);
+
 	fprintf(f, "name:%s\n", n->name);
 	fprintf(f, "info:%llu,%u,%u,%03x,%u,%u,%u,", n->name_id, n->uid, n->gid, n->access, n->refcount, n->postcount,
 		n->last_hour_postcount);
@@ -256,6 +256,8 @@ fprint_name_info(FILE *f, const char *name, name_info_t *n, pid_t *max_pid)
 		return;
 	}
 
+	_notify_lib_name_stats(&global.notify_state, n);
+
 	fprintf(f, "name: %s\n", n->name);
 	fprintf(f, "id: %llu\n", n->name_id);
 	fprintf(f, "uid: %u\n", n->uid);
@@ -269,7 +271,7 @@ fprint_name_info(FILE *f, const char *name, name_info_t *n, pid_t *max_pid)
 	{
 		fprintf(f, "slot: %u", n->slot);
 		if (global.shared_memory_refcount[n->slot] != SLOT_NONE)
-			fprintf(f, " = %u (%u)", global.shared_memory_base[n->slot], global.shared_memory_refcount[n->slot]);
+			fprintf(f, " = %u (%u)", *shm_slot_value(n->slot), global.shared_memory_refcount[n->slot]);
 	}
 	fprintf(f, "\n");
 	fprintf(f, "val: %u\n", n->val);
@@ -304,13 +306,475 @@ fprint_name_info(FILE *f, const char *name, name_info_t *n, pid_t *max_pid)
 }
 
 static void
-fprint_quick_status(FILE *f)
+fprint_pool_status(FILE *f)
+{
+	notify_state_t *ns = &global.notify_state;
+	uint32_t slabs = 0, cached = 0;
+
+	for (uint32_t i = 0; i < NOTIFY_NAME_POOL_CLASSES; i++)
+	{
+		slabs += ns->name_pool[i].slab_count;
+		cached += ns->name_pool[i].free_count;
+	}
+
+	fprintf(f, "name pool    slabs %9u   cached %7u\n", slabs, cached);
+	fprintf(f, "client pool  slabs %9u   cached %7u\n", ns->client_pool.slab_count, ns->client_pool.free_count);
+}
+
+static void
+fprint_slot_status(FILE *f)
+{
+	slot_allocator_t *sa = &global.slots;
+	mach_timebase_info_data_t tbi;
+	uint64_t avg = 0;
+
+	mach_timebase_info(&tbi);
+	if (sa->alloc_count > 0) avg = sa->alloc_time / sa->alloc_count;
+
+	fprintf(f, "slot alloc   count %9llu   avg ns %7llu   max ns %7llu   shared %llu\n", sa->alloc_count, avg * tbi.numer / tbi.denom, sa->alloc_max_time * tbi.numer / tbi.denom, sa->reuse_count);
+}
+
+static void
+fprint_journal_status(FILE *f)
+{
+	uint32_t held = 0;
+
+	if (global.journal_grace_src != NULL) held = global.journal_token_end - global.journal_token_first;
+
+	fprintf(f, "journal      used %10zu   size %10zu   held names %u\n", global.journal_used, global.journal_size, held);
+}
+
+static void
+fprint_coalesce_status(FILE *f)
+{
+	for (uint32_t i = 0; i < global.coalesce_count; i++)
+	{
+		notify_coalesce_t *w = global.coalesce[i];
+		name_info_t *n = _nc_table_find_64(&global.notify_state.name_id_table, w->nid);
+
+		fprintf(f, "coalesce     %s   window ms %llu   coalesced %llu\n", (n == NULL) ? "-" : n->name, w->window / NSEC_PER_MSEC, w->coalesced);
+	}
+}
+
+static const uint64_t heavy_hitter_length[HEAVY_HITTER_WINDOWS] =
+{
+	NSEC_PER_SEC,
+	60 * NSEC_PER_SEC,
+	3600 * NSEC_PER_SEC,
+};
+
+/* one merged key of a heavy hitter report */
+typedef struct
 {
+	uint64_t key;
+	uint64_t count;
+	uint64_t error;
+	const char *label;
+} heavy_hitter_row_t;
+
+/* Space-Saving update by count posts of key at once */
+static void
+heavy_hitter_add(heavy_hitter_summary_t *s, uint64_t key, const char *label, uint32_t count)
+{
+	heavy_hitter_entry_t *e;
 	uint32_t i;
 
+	for (i = 0; i < s->used; i++)
+	{
+		if (s->entry[i].key == key)
+		{
+			s->entry[i].count += count;
+			return;
+		}
+	}
+
+	if (s->used < HEAVY_HITTER_ENTRIES)
+	{
+		e = &s->entry[s->used++];
+		e->count = 0;
+		e->error = 0;
+	}
+	else
+	{
+		/* evict the smallest counter, the newcomer may have been counted there */
+		e = &s->entry[0];
+		for (i = 1; i < HEAVY_HITTER_ENTRIES; i++)
+		{
+			if (s->entry[i].count < e->count) e = &s->entry[i];
+		}
+
+		e->error = e->count;
+	}
+
+	e->key = key;
+	e->count += count;
+	strlcpy(e->label, label, sizeof(e->label));
+}
+
+/* start a new window if the current one has run its length */
+static void
+heavy_hitter_roll(heavy_hitter_window_t *w, uint64_t now)
+{
+	uint64_t elapsed = now - w->start;
+
+	if (elapsed < w->length) return;
+
+	if (elapsed < (2 * w->length))
+	{
+		w->name[1] = w->name[0];
+		w->pid[1] = w->pid[0];
+	}
+	else
+	{
+		memset(&w->name[1], 0, sizeof(heavy_hitter_summary_t));
+		memset(&w->pid[1], 0, sizeof(heavy_hitter_summary_t));
+	}
+
+	memset(&w->name[0], 0, sizeof(heavy_hitter_summary_t));
+	memset(&w->pid[0], 0, sizeof(heavy_hitter_summary_t));
+	w->start = now - (elapsed % w->length);
+}
+
+static void
+heavy_hitter_tick_add(heavy_hitter_tick_table_t *t, uint64_t key, const char *label)
+{
+	uint32_t mask = HEAVY_HITTER_TICK_SLOTS - 1;
+	uint32_t i = (uint32_t)(key ^ (key >> 32)) & mask;
+
+	while (t->slot[i].count != 0)
+	{
+		if (t->slot[i].key == key)
+		{
+			t->slot[i].count++;
+			return;
+		}
+
+		i = (i + 1) & mask;
+	}
+
+	/* keep probes short; keys past the load limit only count toward the tick total */
+	if (t->used >= (HEAVY_HITTER_TICK_SLOTS * 3 / 4)) return;
+
+	t->used++;
+	t->slot[i].key = key;
+	t->slot[i].count = 1;
+	if (label == NULL) t->slot[i].label[0] = '\0';
+	else strlcpy(t->slot[i].label, label, sizeof(t->slot[i].label));
+}
+
+static void
+heavy_hitter_fold_table(heavy_hitter_tick_table_t *t, heavy_hitter_summary_t *s)
+{
+	if (t->used == 0) return;
+
+	for (uint32_t i = 0; i < HEAVY_HITTER_TICK_SLOTS; i++)
+	{
+		if (t->slot[i].count != 0) heavy_hitter_add(s, t->slot[i].key, t->slot[i].label, t->slot[i].count);
+	}
+}
+
+/* feed the posts since the last tick to every window */
+static void
+heavy_hitter_fold(void)
+{
+	heavy_hitter_tick_t *t = &global.heavy_hitter_tick;
+	uint64_t now;
+
+	if (t->total == 0) return;
+
+	now = clock_gettime_nsec_np(CLOCK_MONOTONIC_RAW);
+
+	for (uint32_t i = 0; i < HEAVY_HITTER_WINDOWS; i++)
+	{
+		heavy_hitter_window_t *w = &global.heavy_hitters[i];
+
+		if (w->length == 0) w->length = heavy_hitter_length[i];
+		heavy_hitter_roll(w, now);
+
+		w->name[0].total += t->total;
+		w->pid[0].total += t->total;
+		heavy_hitter_fold_table(&t->name, &w->name[0]);
+		heavy_hitter_fold_table(&t->pid, &w->pid[0]);
+	}
+
+	memset(t, 0, sizeof(heavy_hitter_tick_t));
+}
+
+static void
+heavy_hitter_tick_end(void *ctx __unused)
+{
+	heavy_hitter_fold();
+}
+
+void
+heavy_hitter_record(const char *name, uint64_t hash, pid_t pid)
+{
+	heavy_hitter_tick_t *t = &global.heavy_hitter_tick;
+
+	/* the clock is only read once a tick, by the timer */
+	if (t->total++ == 0)
+	{
+		dispatch_source_set_timer(global.heavy_hitter_src, dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_SEC), DISPATCH_TIME_FOREVER, NSEC_PER_SEC / 10);
+	}
+
+	heavy_hitter_tick_add(&t->name, hash, name);
+	heavy_hitter_tick_add(&t->pid, (uint64_t)pid, NULL);
+}
+
+static int
+heavy_hitter_row_compare(const void *a, const void *b)
+{
+	const heavy_hitter_row_t *ra = a;
+	const heavy_hitter_row_t *rb = b;
+
+	if (ra->count > rb->count) return -1;
+	if (ra->count < rb->count) return 1;
+	return 0;
+}
+
+/*
+ * Merge the current summary with the part of the previous one that
+ * still falls in the sliding window.  Returns the estimated total.
+ */
+static uint64_t
+heavy_hitter_merge(heavy_hitter_summary_t *s, uint64_t remain, uint64_t length, heavy_hitter_row_t *rows, uint32_t *count)
+{
+	uint32_t n = 0, i, j;
+	uint64_t floor = 0;
+
+	/* a key missing from a full summary may have been counted up to its smallest counter */
+	if (s[0].used == HEAVY_HITTER_ENTRIES)
+	{
+		floor = s[0].entry[0].count;
+		for (i = 1; i < HEAVY_HITTER_ENTRIES; i++)
+		{
+			if (s[0].entry[i].count < floor) floor = s[0].entry[i].count;
+		}
+	}
+
+	for (i = 0; i < s[0].used; i++)
+	{
+		rows[n].key = s[0].entry[i].key;
+		rows[n].count = s[0].entry[i].count;
+		rows[n].error = s[0].entry[i].error;
+		rows[n].label = s[0].entry[i].label;
+		n++;
+	}
+
+	for (i = 0; i < s[1].used; i++)
+	{
+		heavy_hitter_entry_t *e = &s[1].entry[i];
+
+		for (j = 0; (j < n) && (rows[j].key != e->key); j++);
+		if (j == n)
+		{
+			rows[n].key = e->key;
+			rows[n].count = floor;
+			rows[n].error = floor;
+			rows[n].label = e->label;
+			n++;
+		}
+
+		rows[j].count += e->count * remain / length;
+		rows[j].error += e->error * remain / length;
+	}
+
+	qsort(rows, n, sizeof(heavy_hitter_row_t), heavy_hitter_row_compare);
+	*count = n;
+
+	return s[0].total + (s[1].total * remain / length);
+}
+
+static void
+fprint_heavy_hitters(FILE *f)
+{
+	heavy_hitter_row_t rows[2 * HEAVY_HITTER_ENTRIES];
+	uint64_t now = clock_gettime_nsec_np(CLOCK_MONOTONIC_RAW);
+	uint64_t total, remain;
+	uint32_t count, i;
+	char pname[2 * MAXCOMLEN];
+
+	fprintf(f, "--- TOP POSTERS ---\n");
+
+	/* include the tick in progress */
+	heavy_hitter_fold();
+
+	for (uint32_t w = 0; w < HEAVY_HITTER_WINDOWS; w++)
+	{
+		heavy_hitter_window_t *hw = &global.heavy_hitters[w];
+
+		if (hw->length == 0) continue;
+		heavy_hitter_roll(hw, now);
+		remain = hw->length - (now - hw->start);
+
+		total = heavy_hitter_merge(hw->name, remain, hw->length, rows, &count);
+		fprintf(f, "last %llus   posts %llu\n", hw->length / NSEC_PER_SEC, total);
+
+		for (i = 0; (i < count) && (i < HEAVY_HITTER_REPORT); i++)
+		{
+			fprintf(f, "    name %10llu  err %8llu  %s\n", rows[i].count, rows[i].error, rows[i].label);
+		}
+
+		heavy_hitter_merge(hw->pid, remain, hw->length, rows, &count);
+		for (i = 0; (i < count) && (i < HEAVY_HITTER_REPORT); i++)
+		{
+			if (proc_name((int)rows[i].key, pname, sizeof(pname)) <= 0) strlcpy(pname, "-", sizeof(pname));
+			fprintf(f, "    pid  %10llu  err %8llu  %d (%s)\n", rows[i].count, rows[i].error, (int)rows[i].key, pname);
+		}
+	}
+
+	fprintf(f, "\n");
+}
+
+static const struct
+{
+	const char *name;
+	int id;
+} routine_names[] = { subsystem_to_name_map_notify_ipc };
+
+static const char *
+routine_name(uint32_t routine)
+{
+	for (size_t i = 0; i < sizeof(routine_names) / sizeof(routine_names[0]); i++)
+	{
+		if (routine_names[i].id == (int)(_notify_ipc_subsystem.start + routine)) return routine_names[i].name;
+	}
+
+	return NULL;
+}
+
+static uint32_t
+histogram_bucket(uint64_t v)
+{
+	uint32_t msb, b;
+
+	if (v < (1 << HISTOGRAM_SUB_BUCKET_BITS)) return (uint32_t)v;
+
+	msb = 63 - __builtin_clzll(v);
+	b = (msb - HISTOGRAM_SUB_BUCKET_BITS + 1) << HISTOGRAM_SUB_BUCKET_BITS;
+	b += (v >> (msb - HISTOGRAM_SUB_BUCKET_BITS)) & ((1 << HISTOGRAM_SUB_BUCKET_BITS) - 1);
+
+	if (b >= HISTOGRAM_BUCKETS) b = HISTOGRAM_BUCKETS - 1;
+	return b;
+}
+
+/* smallest value counted in a bucket */
+static uint64_t
+histogram_bucket_floor(uint32_t b)
+{
+	uint64_t sub;
+
+	if (b < (1 << HISTOGRAM_SUB_BUCKET_BITS)) return b;
+
+	sub = (1 << HISTOGRAM_SUB_BUCKET_BITS) + (b & ((1 << HISTOGRAM_SUB_BUCKET_BITS) - 1));
+	return sub << ((b >> HISTOGRAM_SUB_BUCKET_BITS) - 1);
+}
+
+static void
+histogram_record(histogram_t *h, uint64_t v)
+{
+	h->count++;
+	h->sum += v;
+	if (v > h->max) h->max = v;
+	h->bucket[histogram_bucket(v)]++;
+}
+
+/* upper bound of the bucket holding the given per mille rank, at most max */
+static uint64_t
+histogram_percentile(histogram_t *h, uint32_t permille)
+{
+	uint64_t rank, seen = 0, v;
+
+	if (h->count == 0) return 0;
+
+	rank = ((h->count * permille) + 999) / 1000;
+
+	for (uint32_t b = 0; b < (HISTOGRAM_BUCKETS - 1); b++)
+	{
+		seen += h->bucket[b];
+		if (seen >= rank)
+		{
+			v = histogram_bucket_floor(b + 1) - 1;
+			return (v < h->max) ? v : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+static void
+fprint_histogram(FILE *f, const char *name, histogram_t *h)
+{
+	fprintf(f, "%-40s %10llu %8llu %8llu %8llu %8llu %10llu\n", name, h->count, histogram_percentile(h, 500), histogram_percentile(h, 900), histogram_percentile(h, 990), histogram_percentile(h, 999), h->max);
+}
+
+static void
+fprint_histograms(FILE *f)
+{
+	const char *name;
+
+	fprintf(f, "--- LATENCY (ns) ---\n");
+	fprintf(f, "%-40s %10s %8s %8s %8s %8s %10s\n", "routine", "count", "p50", "p90", "p99", "p99.9", "max");
+
+	for (uint32_t i = 0; i < LATENCY_ROUTINES; i++)
+	{
+		if (histograms.latency[i].count == 0) continue;
+
+		name = routine_name(i);
+		if (name == NULL) continue;
+
+		fprint_histogram(f, name, &histograms.latency[i]);
+	}
+
+	fprintf(f, "\n");
+	fprintf(f, "--- FAN-OUT (subscribers per post) ---\n");
+	fprint_histogram(f, "post", &histograms.fanout);
+	fprintf(f, "\n");
+}
+
+static void
+fprint_histogram_raw(FILE *f, const char *kind, const char *name, histogram_t *h)
+{
+	fprintf(f, "%s %s %llu %llu %llu", kind, name, h->count, h->sum, h->max);
+
+	for (uint32_t b = 0; b < HISTOGRAM_BUCKETS; b++)
+	{
+		if (h->bucket[b] != 0) fprintf(f, " %llu:%llu", histogram_bucket_floor(b), h->bucket[b]);
+	}
+
+	fprintf(f, "\n");
+}
+
+/*
+ * One line per histogram: kind, name, count, sum, max, then floor:count
+ * for every bucket that is not empty.  Latencies are in nanoseconds.
+ */
+static void
+fprint_histograms_raw(FILE *f)
+{
+	const char *name;
+
+	fprintf(f, "# notifyd histograms 1\n");
+	fprintf(f, "# kind name count sum max floor:count ...\n");
+
+	for (uint32_t i = 0; i < LATENCY_ROUTINES; i++)
+	{
+		name = routine_name(i);
+		if (name == NULL) continue;
+
+		fprint_histogram_raw(f, "latency", name, &histograms.latency[i]);
+	}
+
+	fprint_histogram_raw(f, "fanout", "post", &histograms.fanout);
+}
+
+static void
+fprint_quick_status(FILE *f)
+{
 	fprintf(f, "--- GLOBALS ---\n");
-	fprintf(f, "%u slots (current id %u)\n", global.nslots, global.slot_id);
+	fprintf(f, "%u slots in %u segments (%u in use)\n", global.nslots, global.shm_segment_count, global.slots.in_use);
 	fprintf(f, "%u log_cutoff (default %u)\n", global.log_cutoff, global.log_default);
+	fprintf(f, "%u fan-out shards\n", global.notify_state.fanout_shards);
 	fprintf(f, "\n");
 
 	fprintf(f, "--- STATISTICS ---\n");
@@ -319,6 +783,8 @@ fprint_quick_status(FILE *f)
 	fprintf(f, "    name     %llu\n", call_statistics.post_by_name);
 	fprintf(f, "    fetch    %llu\n", call_statistics.post_by_name_and_fetch_id);
 	fprintf(f, "    no_op    %llu\n", call_statistics.post_no_op);
+	fprintf(f, "    batches  %llu\n", call_statistics.post_many);
+	fprintf(f, "    coalesced %llu\n", call_statistics.post_coalesced);
 	fprintf(f, "\n");
 	fprintf(f, "register     %llu\n", call_statistics.reg);
 	fprintf(f, "    plain    %llu\n", call_statistics.reg_plain);
@@ -328,12 +794,15 @@ fprint_quick_status(FILE *f)
 	fprintf(f, "    port     %llu\n", call_statistics.reg_port);
 	fprintf(f, "    event    %llu\n", call_statistics.reg_xpc_event);
 	fprintf(f, "    common   %llu\n", call_statistics.reg_common);
+	fprintf(f, "    batches  %llu\n", call_statistics.reg_common_many);
 	fprintf(f, "\n");
 	fprintf(f, "check        %llu\n", call_statistics.check);
 	fprintf(f, "cancel       %llu\n", call_statistics.cancel);
 	fprintf(f, "cleanup      %llu\n", call_statistics.cleanup);
 	fprintf(f, "regenerate   %llu\n", call_statistics.regenerate);
+	fprintf(f, "    batches  %llu\n", call_statistics.regenerate_many);
 	fprintf(f, "checkin      %llu\n", call_statistics.checkin);
+	fprintf(f, "ack          %llu\n", call_statistics.ack);
 	fprintf(f, "\n");
 	fprintf(f, "suspend      %llu\n", call_statistics.suspend);
 	fprintf(f, "resume       %llu\n", call_statistics.resume);
@@ -367,12 +836,19 @@ fprint_quick_status(FILE *f)
 	fprintf(f, "name         alloc %9u   free %9u   extant %9u\n", global.notify_state.stat_name_alloc , global.notify_state.stat_name_free, global.notify_state.stat_name_alloc - global.notify_state.stat_name_free);
 	fprintf(f, "subscription alloc %9u   free %9u   extant %9u\n", global.notify_state.stat_client_alloc , global.notify_state.stat_client_free, global.notify_state.stat_client_alloc - global.notify_state.stat_client_free);
 	fprintf(f, "portproc     alloc %9u   free %9u   extant %9u\n", global.notify_state.stat_portproc_alloc , global.notify_state.stat_portproc_free, global.notify_state.stat_portproc_alloc - global.notify_state.stat_portproc_free);
+	fprint_pool_status(f);
+	fprint_slot_status(f);
+	fprint_journal_status(f);
+	fprint_coalesce_status(f);
 	fprintf(f, "\n");
 
 	fprintf(f, "port count   %u\n", global.notify_state.port_table.count);
 	fprintf(f, "proc count   %u\n", global.notify_state.proc_table.count);
 	fprintf(f, "\n");
 
+	fprint_heavy_hitters(f);
+	fprint_histograms(f);
+
 	fprintf(f, "--- NAME TABLE ---\n");
 	fprintf(f, "Name Info: id, uid, gid, access, refcount, postcount, last hour postcount, slot, val, state\n");
 	fprintf(f, "Client Info: client_id, pid,token, lastval, suspend_count, 0, 0, type, type-info\n\n\n");
@@ -387,10 +863,10 @@ fprint_quick_status(FILE *f)
 	fprintf(f, "\n");
 
 	fprintf(f, "--- CONTROLLED NAME ---\n");
-	for (i = 0; i < global.notify_state.controlled_name_count; i++)
-	{
-		fprintf(f, "%s %u %u %03x\n", global.notify_state.controlled_name[i]->name, global.notify_state.controlled_name[i]->uid, global.notify_state.controlled_name[i]->gid, global.notify_state.controlled_name[i]->access);
-	}
+	_notify_lib_foreach_controlled_name(&global.notify_state, ^bool(name_info_t *n) {
+		fprintf(f, "%s %u %u %03x\n", n->name, n->uid, n->gid, n->access);
+		return true;
+	});
 	fprintf(f, "--- CONTROLLED NAME COUNT %u ---\n", global.notify_state.controlled_name_count);
 	fprintf(f, "\n");
 
@@ -458,13 +934,13 @@ static void
 fprint_status(FILE *f)
 {
 	__block pid_t pid, max_pid;
-	uint32_t i;
 
 	max_pid = 0;
 
 	fprintf(f, "--- GLOBALS ---\n");
-	fprintf(f, "%u slots (current id %u)\n", global.nslots, global.slot_id);
+	fprintf(f, "%u slots in %u segments (%u in use)\n", global.nslots, global.shm_segment_count, global.slots.in_use);
 	fprintf(f, "%u log_cutoff (default %u)\n", global.log_cutoff, global.log_default);
+	fprintf(f, "%u fan-out shards\n", global.notify_state.fanout_shards);
 	fprintf(f, "\n");
 
 	fprintf(f, "--- STATISTICS ---\n");
@@ -473,6 +949,8 @@ fprint_status(FILE *f)
 	fprintf(f, "    name     %llu\n", call_statistics.post_by_name);
 	fprintf(f, "    fetch    %llu\n", call_statistics.post_by_name_and_fetch_id);
 	fprintf(f, "    no_op    %llu\n", call_statistics.post_no_op);
+	fprintf(f, "    batches  %llu\n", call_statistics.post_many);
+	fprintf(f, "    coalesced %llu\n", call_statistics.post_coalesced);
 	fprintf(f, "\n");
 	fprintf(f, "register     %llu\n", call_statistics.reg);
 	fprintf(f, "    plain    %llu\n", call_statistics.reg_plain);
@@ -482,12 +960,15 @@ fprint_status(FILE *f)
 	fprintf(f, "    port     %llu\n", call_statistics.reg_port);
 	fprintf(f, "    event    %llu\n", call_statistics.reg_xpc_event);
 	fprintf(f, "    common   %llu\n", call_statistics.reg_common);
+	fprintf(f, "    batches  %llu\n", call_statistics.reg_common_many);
 	fprintf(f, "\n");
 	fprintf(f, "check        %llu\n", call_statistics.check);
 	fprintf(f, "cancel       %llu\n", call_statistics.cancel);
 	fprintf(f, "cleanup      %llu\n", call_statistics.cleanup);
 	fprintf(f, "regenerate   %llu\n", call_statistics.regenerate);
+	fprintf(f, "    batches  %llu\n", call_statistics.regenerate_many);
 	fprintf(f, "checkin      %llu\n", call_statistics.checkin);
+	fprintf(f, "ack          %llu\n", call_statistics.ack);
 	fprintf(f, "\n");
 	fprintf(f, "suspend      %llu\n", call_statistics.suspend);
 	fprintf(f, "resume       %llu\n", call_statistics.resume);
@@ -522,12 +1003,19 @@ fprint_status(FILE *f)
 	fprintf(f, "name         alloc %9u   free %9u   extant %9u\n", global.notify_state.stat_name_alloc , global.notify_state.stat_name_free, global.notify_state.stat_name_alloc - global.notify_state.stat_name_free);
 	fprintf(f, "subscription alloc %9u   free %9u   extant %9u\n", global.notify_state.stat_client_alloc , global.notify_state.stat_client_free, global.notify_state.stat_client_alloc - global.notify_state.stat_client_free);
 	fprintf(f, "portproc     alloc %9u   free %9u   extant %9u\n", global.notify_state.stat_portproc_alloc , global.notify_state.stat_portproc_free, global.notify_state.stat_portproc_alloc - global.notify_state.stat_portproc_free);
+	fprint_pool_status(f);
+	fprint_slot_status(f);
+	fprint_journal_status(f);
+	fprint_coalesce_status(f);
 	fprintf(f, "\n");
 
 	fprintf(f, "port count   %u\n", global.notify_state.port_table.count);
 	fprintf(f, "proc count   %u\n", global.notify_state.proc_table.count);
 	fprintf(f, "\n");
 
+	fprint_heavy_hitters(f);
+	fprint_histograms(f);
+
 	fprintf(f, "--- NAME TABLE ---\n");
 
 	_nc_table_foreach(&global.notify_state.name_table, ^bool(void *_n) {
@@ -552,10 +1040,10 @@ fprint_status(FILE *f)
 	fprintf(f, "\n");
 
 	fprintf(f, "--- CONTROLLED NAME ---\n");
-	for (i = 0; i < global.notify_state.controlled_name_count; i++)
-	{
-		fprintf(f, "%s %u %u %03x\n", global.notify_state.controlled_name[i]->name, global.notify_state.controlled_name[i]->uid, global.notify_state.controlled_name[i]->gid, global.notify_state.controlled_name[i]->access);
-	}
+	_notify_lib_foreach_controlled_name(&global.notify_state, ^bool(name_info_t *n) {
+		fprintf(f, "%s %u %u %03x\n", n->name, n->uid, n->gid, n->access);
+		return true;
+	});
 	fprintf(f, "--- CONTROLLED NAME COUNT %u ---\n", global.notify_state.controlled_name_count);
 	fprintf(f, "\n");
 
@@ -687,20 +1175,400 @@ fprint_status(FILE *f)
 	fprintf(f, "\n");
 }
 
-void
-dump_status(uint32_t level, int fd)
-{
-	FILE *f;
+#define BINARY_DUMP_CHUNK 512
+#define BINARY_DUMP_BUFFER_SIZE (64 * 1024)
 
-	if(fd < 0)
-	{
-		if (status_file == NULL)
-		{
-			asprintf(&status_file, "/var/run/notifyd_%u.status", getpid());
-			if (status_file == NULL) return;
-		}
+#define STAT_FIELD(field, label) { label, offsetof(struct call_statistics_s, field) }
 
-		unlink(status_file);
+/* call_statistics fields and their labels in the text status */
+static const struct
+{
+	const char *label;
+	size_t offset;
+} stat_fields[] =
+{
+	STAT_FIELD(post, "post"),
+	STAT_FIELD(post_by_id, "    id"),
+	STAT_FIELD(post_by_name, "    name"),
+	STAT_FIELD(post_by_name_and_fetch_id, "    fetch"),
+	STAT_FIELD(post_no_op, "    no_op"),
+	STAT_FIELD(post_many, "    batches"),
+	STAT_FIELD(post_coalesced, "    coalesced"),
+	STAT_FIELD(reg, "register"),
+	STAT_FIELD(reg_plain, "    plain"),
+	STAT_FIELD(reg_check, "    check"),
+	STAT_FIELD(reg_signal, "    signal"),
+	STAT_FIELD(reg_file, "    file"),
+	STAT_FIELD(reg_port, "    port"),
+	STAT_FIELD(reg_xpc_event, "    event"),
+	STAT_FIELD(reg_common, "    common"),
+	STAT_FIELD(reg_common_many, "    batches"),
+	STAT_FIELD(check, "check"),
+	STAT_FIELD(cancel, "cancel"),
+	STAT_FIELD(cleanup, "cleanup"),
+	STAT_FIELD(regenerate, "regenerate"),
+	STAT_FIELD(regenerate_many, "    batches"),
+	STAT_FIELD(checkin, "checkin"),
+	STAT_FIELD(ack, "ack"),
+	STAT_FIELD(suspend, "suspend"),
+	STAT_FIELD(resume, "resume"),
+	STAT_FIELD(suspend_pid, "suspend_pid"),
+	STAT_FIELD(resume_pid, "resume_pid"),
+	STAT_FIELD(get_state, "get_state"),
+	STAT_FIELD(get_state_by_id, "    id"),
+	STAT_FIELD(get_state_by_client, "    client"),
+	STAT_FIELD(get_state_by_client_and_fetch_id, "    fetch"),
+	STAT_FIELD(set_state, "set_state"),
+	STAT_FIELD(set_state_by_id, "    id"),
+	STAT_FIELD(set_state_by_client, "    client"),
+	STAT_FIELD(set_state_by_client_and_fetch_id, "    fetch"),
+	STAT_FIELD(set_owner, "set_owner"),
+	STAT_FIELD(set_access, "set_access"),
+	STAT_FIELD(monitor_file, "monitor"),
+	STAT_FIELD(service_path, "svc_path"),
+};
+
+enum
+{
+	BINARY_DUMP_NAMES,
+	BINARY_DUMP_PROCS,
+	BINARY_DUMP_PORTS,
+	BINARY_DUMP_DONE,
+};
+
+/*
+ * A binary dump in progress.  Each phase takes the keys of one table up
+ * front and writes BINARY_DUMP_CHUNK entries per turn of the workloop,
+ * looking each key up again so entries freed in between are skipped.
+ */
+typedef struct
+{
+	int fd;
+	bool failed;
+	uint32_t phase;
+	uint64_t *keys;
+	uint32_t key_count;
+	uint32_t next;
+	size_t used;
+	char buf[BINARY_DUMP_BUFFER_SIZE];
+} binary_dump_t;
+
+static binary_dump_t *binary_dump;
+
+static void
+binary_dump_write(binary_dump_t *d, const void *p, size_t len)
+{
+	const char *b = p;
+	ssize_t n;
+
+	while ((len > 0) && !d->failed)
+	{
+		n = write(d->fd, b, len);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			d->failed = true;
+			return;
+		}
+
+		b += n;
+		len -= (size_t)n;
+	}
+}
+
+static void
+binary_dump_flush(binary_dump_t *d)
+{
+	binary_dump_write(d, d->buf, d->used);
+	d->used = 0;
+}
+
+static void
+binary_dump_record(binary_dump_t *d, uint32_t type, const void *p, size_t len, const char *str)
+{
+	static const char zero[8];
+	notify_dump_record_t r;
+	size_t slen = (str == NULL) ? 0 : strlen(str) + 1;
+	size_t pad = (8 - ((len + slen) & 7)) & 7;
+
+	r.type = type;
+	r.length = (uint32_t)(len + slen + pad);
+
+	if ((d->used + sizeof(r) + r.length) > sizeof(d->buf)) binary_dump_flush(d);
+
+	if ((sizeof(r) + r.length) > sizeof(d->buf))
+	{
+		binary_dump_write(d, &r, sizeof(r));
+		binary_dump_write(d, p, len);
+		binary_dump_write(d, str, slen);
+		binary_dump_write(d, zero, pad);
+		return;
+	}
+
+	memcpy(d->buf + d->used, &r, sizeof(r));
+	d->used += sizeof(r);
+	if (len > 0) memcpy(d->buf + d->used, p, len);
+	d->used += len;
+	if (slen > 0) memcpy(d->buf + d->used, str, slen);
+	d->used += slen;
+	memset(d->buf + d->used, 0, pad);
+	d->used += pad;
+}
+
+static void
+binary_dump_name(binary_dump_t *d, name_info_t *n)
+{
+	notify_dump_name_t rn = {};
+	notify_dump_client_t rc = {};
+	client_t *c;
+
+	_notify_lib_name_stats(&global.notify_state, n);
+
+	rn.name_id = n->name_id;
+	rn.state = n->state;
+	rn.uid = n->uid;
+	rn.gid = n->gid;
+	rn.access = n->access;
+	rn.refcount = n->refcount;
+	rn.postcount = n->postcount;
+	rn.last_hour_postcount = n->last_hour_postcount;
+	rn.slot = n->slot;
+	rn.slot_refcount = SLOT_NONE;
+	if ((n->slot != SLOT_NONE) && (global.shared_memory_refcount[n->slot] != SLOT_NONE))
+	{
+		rn.slot_value = *shm_slot_value(n->slot);
+		rn.slot_refcount = global.shared_memory_refcount[n->slot];
+	}
+	rn.val = n->val;
+
+	binary_dump_record(d, NOTIFY_DUMP_REC_NAME, &rn, sizeof(rn), n->name);
+
+	LIST_FOREACH(c, &n->subscriptions, client_subscription_entry)
+	{
+		rc.type = notify_get_type(c->state_and_type);
+		switch (rc.type)
+		{
+			case NOTIFY_TYPE_PORT: rc.deliver = c->deliver.port; break;
+			case NOTIFY_TYPE_FILE: rc.deliver = (uint64_t)c->deliver.fd; break;
+			case NOTIFY_TYPE_SIGNAL: rc.deliver = (uint64_t)c->deliver.sig; break;
+			case NOTIFY_TYPE_XPC_EVENT: rc.deliver = c->deliver.event_token; break;
+			default: rc.deliver = 0; break;
+		}
+
+		rc.pid = c->cid.pid;
+		rc.token = c->cid.token;
+		rc.lastval = c->lastval;
+		rc.suspend_count = c->suspend_count;
+
+		binary_dump_record(d, NOTIFY_DUMP_REC_CLIENT, &rc, sizeof(rc), NULL);
+	}
+}
+
+/* take the keys of the table the next phase walks */
+static void
+binary_dump_phase(binary_dump_t *d, uint32_t phase)
+{
+	__block uint32_t i = 0;
+	uint32_t count;
+
+	free(d->keys);
+	d->keys = NULL;
+	d->key_count = 0;
+	d->next = 0;
+	d->phase = phase;
+
+	switch (phase)
+	{
+		case BINARY_DUMP_NAMES: count = global.notify_state.name_table.count; break;
+		case BINARY_DUMP_PROCS: count = global.notify_state.proc_table.count; break;
+		case BINARY_DUMP_PORTS: count = global.notify_state.port_table.count; break;
+		default: return;
+	}
+
+	if (count == 0) return;
+
+	d->keys = malloc(count * sizeof(uint64_t));
+	if (d->keys == NULL)
+	{
+		d->failed = true;
+		return;
+	}
+
+	switch (phase)
+	{
+		case BINARY_DUMP_NAMES:
+			_nc_table_foreach(&global.notify_state.name_table, ^bool (void *n) {
+				d->keys[i++] = ((name_info_t *)n)->name_id;
+				return (i < count);
+			});
+			break;
+
+		case BINARY_DUMP_PROCS:
+			_nc_table_foreach_n(&global.notify_state.proc_table, ^bool (void *p) {
+				d->keys[i++] = ((proc_data_t *)p)->pid;
+				return (i < count);
+			});
+			break;
+
+		case BINARY_DUMP_PORTS:
+			_nc_table_foreach_n(&global.notify_state.port_table, ^bool (void *p) {
+				d->keys[i++] = ((port_data_t *)p)->port;
+				return (i < count);
+			});
+			break;
+	}
+
+	d->key_count = i;
+}
+
+static void
+binary_dump_chunk(void *context)
+{
+	binary_dump_t *d = context;
+	uint32_t end = d->next + BINARY_DUMP_CHUNK;
+
+	if (end > d->key_count) end = d->key_count;
+
+	for (; (d->next < end) && !d->failed; d->next++)
+	{
+		uint64_t key = d->keys[d->next];
+
+		if (d->phase == BINARY_DUMP_NAMES)
+		{
+			name_info_t *n = _nc_table_find_64(&global.notify_state.name_id_table, key);
+			if (n != NULL) binary_dump_name(d, n);
+		}
+		else if (d->phase == BINARY_DUMP_PROCS)
+		{
+			proc_data_t *p = _nc_table_find_n(&global.notify_state.proc_table, (uint32_t)key);
+			notify_dump_proc_t rp = {};
+
+			if (p == NULL) continue;
+
+			rp.pid = p->pid;
+			rp.flags = p->flags;
+			if (p->common_port_data != NULL) rp.common_port = p->common_port_data->port;
+
+			binary_dump_record(d, NOTIFY_DUMP_REC_PROC, &rp, sizeof(rp), NULL);
+		}
+		else if (d->phase == BINARY_DUMP_PORTS)
+		{
+			port_data_t *p = _nc_table_find_n(&global.notify_state.port_table, (uint32_t)key);
+			notify_dump_port_t rp;
+
+			if (p == NULL) continue;
+
+			rp.port = p->port;
+			rp.flags = p->flags;
+
+			binary_dump_record(d, NOTIFY_DUMP_REC_PORT, &rp, sizeof(rp), NULL);
+		}
+	}
+
+	while ((d->next == d->key_count) && (d->phase != BINARY_DUMP_DONE) && !d->failed)
+	{
+		binary_dump_phase(d, d->phase + 1);
+	}
+
+	if ((d->phase == BINARY_DUMP_DONE) || d->failed)
+	{
+		binary_dump_record(d, NOTIFY_DUMP_REC_END, NULL, 0, NULL);
+		binary_dump_flush(d);
+
+		log_message(ASL_LEVEL_DEBUG, "binary dump %s\n", d->failed ? "failed" : "done");
+
+		close(d->fd);
+		free(d->keys);
+		free(d);
+		binary_dump = NULL;
+		return;
+	}
+
+	binary_dump_flush(d);
+
+	/* let requests that arrived meanwhile run before the next chunk */
+	dispatch_async_f(global.workloop, d, binary_dump_chunk);
+}
+
+/*
+ * Start a binary dump to fd, which the dump owns from here on.
+ * Only one dump runs at a time; a request while one is running is dropped.
+ */
+static void
+binary_dump_start(int fd)
+{
+	notify_dump_header_t h = {};
+	notify_dump_globals_t g = {};
+	notify_dump_stat_t st;
+	binary_dump_t *d;
+
+	if (fd < 0) return;
+
+	if (binary_dump != NULL)
+	{
+		close(fd);
+		return;
+	}
+
+	d = calloc(1, sizeof(binary_dump_t));
+	if (d == NULL)
+	{
+		close(fd);
+		return;
+	}
+
+	d->fd = fd;
+	binary_dump = d;
+
+	h.magic = NOTIFY_DUMP_MAGIC;
+	h.version = NOTIFY_DUMP_VERSION;
+	h.time = time(NULL);
+	h.pid = getpid();
+	binary_dump_write(d, &h, sizeof(h));
+
+	g.last_reset_time = global.last_reset_time;
+	g.nslots = global.nslots;
+	g.shm_segment_count = global.shm_segment_count;
+	g.slots_in_use = global.slots.in_use;
+	g.log_cutoff = global.log_cutoff;
+	g.log_default = global.log_default;
+	g.fanout_shards = global.notify_state.fanout_shards;
+	g.name_count = global.notify_state.name_table.count;
+	g.client_count = global.notify_state.client_table.count;
+	g.proc_count = global.notify_state.proc_table.count;
+	g.port_count = global.notify_state.port_table.count;
+	binary_dump_record(d, NOTIFY_DUMP_REC_GLOBALS, &g, sizeof(g), NULL);
+
+	for (size_t i = 0; i < sizeof(stat_fields) / sizeof(stat_fields[0]); i++)
+	{
+		st.value = *(uint64_t *)((char *)&call_statistics + stat_fields[i].offset);
+		binary_dump_record(d, NOTIFY_DUMP_REC_STAT, &st, sizeof(st), stat_fields[i].label);
+	}
+
+	binary_dump_phase(d, BINARY_DUMP_NAMES);
+	binary_dump_chunk(d);
+}
+
+void
+dump_status(uint32_t level, int fd)
+{
+	FILE *f;
+
+	if (level == STATUS_REQUEST_BINARY)
+	{
+		if (fd >= 0) binary_dump_start(dup(fd));
+		return;
+	}
+
+	if(fd < 0)
+	{
+		if (status_file == NULL)
+		{
+			asprintf(&status_file, "/var/run/notifyd_%u.status", getpid());
+			if (status_file == NULL) return;
+		}
+
+		unlink(status_file);
 		f = fopen(status_file, "w");
 	}
 	else
@@ -712,6 +1580,8 @@ dump_status(uint32_t level, int fd)
 
 	if (level == STATUS_REQUEST_SHORT) fprint_quick_status(f);
 	else if (level == STATUS_REQUEST_LONG) fprint_status(f);
+	else if (level == STATUS_REQUEST_TOP) fprint_heavy_hitters(f);
+	else if (level == STATUS_REQUEST_HISTOGRAMS) fprint_histograms_raw(f);
 
 	fclose(f);
 }
@@ -757,25 +1627,446 @@ has_entitlement(audit_token_t audit, const char *entitlement)
 	xpc_object_t edata;
 	bool result = false;
 
-	pid_t pid = audit_token_to_pid(audit);
+	pid_t pid = audit_token_to_pid(audit);
+
+	log_message(ASL_LEVEL_NOTICE, "-> has_root_entitlement (PID %d)\n", pid);
+
+	edata = xpc_copy_entitlement_for_token(entitlement, &audit);
+
+	if(edata != NULL){
+		result = xpc_bool_get_value(edata);
+		xpc_release(edata);
+	}
+
+	log_message(ASL_LEVEL_NOTICE, "<- has_root_entitlement (PID %d) = %s\n", pid, result ? "OK" : "FAIL");
+	return result;
+}
+
+inline bool
+has_root_entitlement(audit_token_t audit)
+{
+	return has_entitlement(audit, ROOT_ENTITLEMENT_KEY);
+}
+
+#define SLOT_WORD_BITS 64
+
+static void
+slot_bitmap_set(slot_allocator_t *sa, uint32_t slot)
+{
+	for (uint32_t l = 0; l < sa->levels; l++)
+	{
+		uint64_t *word = &sa->free_bits[l][slot / SLOT_WORD_BITS];
+		uint64_t was = *word;
+
+		*word = was | (1ULL << (slot % SLOT_WORD_BITS));
+		if (was != 0) return;
+		slot /= SLOT_WORD_BITS;
+	}
+}
+
+static void
+slot_bitmap_clear(slot_allocator_t *sa, uint32_t slot)
+{
+	for (uint32_t l = 0; l < sa->levels; l++)
+	{
+		uint64_t *word = &sa->free_bits[l][slot / SLOT_WORD_BITS];
+
+		*word &= ~(1ULL << (slot % SLOT_WORD_BITS));
+		if (*word != 0) return;
+		slot /= SLOT_WORD_BITS;
+	}
+}
+
+static uint32_t
+slot_bitmap_find(slot_allocator_t *sa)
+{
+	uint32_t slot = 0;
+
+	for (uint32_t l = sa->levels; l > 0; l--)
+	{
+		uint64_t word = sa->free_bits[l - 1][slot];
+		if (word == 0) return SLOT_NONE;
+		slot = slot * SLOT_WORD_BITS + (uint32_t)__builtin_ctzll(word);
+	}
+
+	return slot;
+}
+
+static void
+slot_lru_unlink(slot_allocator_t *sa, uint32_t slot)
+{
+	uint32_t prev = sa->lru_prev[slot], next = sa->lru_next[slot];
+
+	if (prev == SLOT_NONE) sa->lru_head = next;
+	else sa->lru_next[prev] = next;
+
+	if (next == SLOT_NONE) sa->lru_tail = prev;
+	else sa->lru_prev[next] = prev;
+}
+
+static void
+slot_lru_push(slot_allocator_t *sa, uint32_t slot)
+{
+	sa->lru_prev[slot] = SLOT_NONE;
+	sa->lru_next[slot] = sa->lru_head;
+
+	if (sa->lru_head == SLOT_NONE) sa->lru_tail = slot;
+	else sa->lru_prev[sa->lru_head] = slot;
+
+	sa->lru_head = slot;
+}
+
+/*
+ * Called on every post to a slot, keeps the LRU list in last-post order.
+ * A name may still hold a slot that has since been released; those are
+ * not on the list.
+ */
+static inline void
+shm_slot_touch(uint32_t slot)
+{
+	slot_allocator_t *sa = &global.slots;
+
+	if ((slot == 0) || (global.shared_memory_refcount[slot] == 0)) return;
+	if (sa->lru_head == slot) return;
+	slot_lru_unlink(sa, slot);
+	slot_lru_push(sa, slot);
+}
+
+static int
+slot_allocator_resize(slot_allocator_t *sa, uint32_t old_nslots, uint32_t nslots)
+{
+	uint32_t words[SLOT_BITMAP_MAX_LEVELS];
+	uint32_t levels = 0, n = nslots, total = 0;
+	uint32_t *lru;
+	uint64_t *bits;
+
+	do
+	{
+		if (levels == SLOT_BITMAP_MAX_LEVELS) return -1;
+		n = (n + SLOT_WORD_BITS - 1) / SLOT_WORD_BITS;
+		words[levels++] = n;
+		total += n;
+	} while (n > 1);
+
+	bits = calloc(total, sizeof(uint64_t));
+	if (bits == NULL) return -1;
+
+	lru = realloc(sa->lru_prev, nslots * sizeof(uint32_t));
+	if (lru == NULL) goto fail;
+	sa->lru_prev = lru;
+
+	lru = realloc(sa->lru_next, nslots * sizeof(uint32_t));
+	if (lru == NULL) goto fail;
+	sa->lru_next = lru;
+
+	/* existing slots keep their bits, new slots start out free */
+	if (old_nslots > 0) memcpy(bits, sa->free_bits[0], ((old_nslots + SLOT_WORD_BITS - 1) / SLOT_WORD_BITS) * sizeof(uint64_t));
+	free(sa->free_bits[0]);
+
+	sa->levels = levels;
+	sa->free_bits[0] = bits;
+	for (uint32_t l = 1; l < levels; l++)
+	{
+		sa->free_bits[l] = sa->free_bits[l - 1] + words[l - 1];
+	}
+
+	/* slot 0 is reserved for notifyd */
+	for (uint32_t i = MAX(old_nslots, 1); i < nslots; i++)
+	{
+		sa->free_bits[0][i / SLOT_WORD_BITS] |= 1ULL << (i % SLOT_WORD_BITS);
+	}
+
+	for (uint32_t l = 1; l < levels; l++)
+	{
+		for (uint32_t w = 0; w < words[l - 1]; w++)
+		{
+			if (sa->free_bits[l - 1][w] != 0) sa->free_bits[l][w / SLOT_WORD_BITS] |= 1ULL << (w % SLOT_WORD_BITS);
+		}
+	}
+
+	return 0;
+
+fail:
+	free(bits);
+	return -1;
+}
+
+static int
+shm_slot_init(uint32_t nslots)
+{
+	slot_allocator_t *sa = &global.slots;
+
+	memset(sa, 0, sizeof(slot_allocator_t));
+	sa->lru_head = SLOT_NONE;
+	sa->lru_tail = SLOT_NONE;
+
+	return slot_allocator_resize(sa, 0, nslots);
+}
+
+/* maps the state records for a segment; without them clients just use IPC */
+static notify_shm_state_t *
+shm_state_open(uint32_t segment)
+{
+	char name[NOTIFY_SHM_SEGMENT_ID_LEN];
+	size_t size = global.shm_segment_slots * sizeof(notify_shm_state_t);
+	notify_shm_state_t *state;
+	int32_t shmfd;
+
+	_notify_shm_state_id(global.shm_name, segment, name, sizeof(name));
+	shmfd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (shmfd == -1)
+	{
+		log_message(ASL_LEVEL_NOTICE, "shm_open %s failed: %s\n", name, strerror(errno));
+		return NULL;
+	}
+
+	ftruncate(shmfd, size);
+	state = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+	close(shmfd);
+
+	if (state == MAP_FAILED)
+	{
+		log_message(ASL_LEVEL_NOTICE, "mmap %s failed: %s\n", name, strerror(errno));
+		return NULL;
+	}
+
+	memset(state, 0, size);
+	return state;
+}
+
+static void
+shm_state_write(uint32_t slot, uint64_t nid, uint64_t state)
+{
+	notify_shm_state_t *rec, *base;
+	uint32_t seq;
+
+	base = global.shm_state[slot / global.shm_segment_slots];
+	if (base == NULL) return;
+
+	rec = &base[slot % global.shm_segment_slots];
+	seq = rec->seq;
+
+	os_atomic_store(&rec->seq, seq + 1, relaxed);
+	os_atomic_thread_fence(release);
+	os_atomic_store(&rec->nid, nid, relaxed);
+	os_atomic_store(&rec->state, state, relaxed);
+	os_atomic_store(&rec->seq, seq + 2, release);
+}
+
+/* called whenever a name's state or slot changes */
+void
+shm_state_publish(name_info_t *n)
+{
+	uint64_t nid = 0;
+
+	if ((n == NULL) || (n->slot == SLOT_NONE) || (global.nslots == 0)) return;
+
+	/* restricted names stay out of shared memory, clients ask notifyd instead */
+	if (_notify_lib_world_readable(&global.notify_state, n->name)) nid = n->name_id;
+
+	shm_state_write(n->slot, nid, n->state);
+}
+
+/*
+ * Adds a segment to the shared memory table.  Clients map it the first
+ * time they are handed a slot that lives in it.
+ */
+static int
+shm_grow(void)
+{
+	char name[NOTIFY_SHM_SEGMENT_ID_LEN];
+	uint32_t segment = global.shm_segment_count;
+	uint32_t nslots = global.nslots + global.shm_segment_slots;
+	size_t size = global.shm_segment_slots * sizeof(uint32_t);
+	uint32_t *base, *refcount;
+	int32_t shmfd;
+
+	if (segment >= NOTIFY_SHM_MAX_SEGMENTS) return -1;
+
+	_notify_shm_segment_id(global.shm_name, segment, name, sizeof(name));
+	shmfd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (shmfd == -1)
+	{
+		log_message(ASL_LEVEL_NOTICE, "shm_open %s failed: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	/* a segment left behind by a previous notifyd keeps its object and size */
+	ftruncate(shmfd, size);
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+	close(shmfd);
+
+	if (base == MAP_FAILED)
+	{
+		log_message(ASL_LEVEL_NOTICE, "mmap %s failed: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	refcount = realloc(global.shared_memory_refcount, nslots * sizeof(uint32_t));
+	if (refcount == NULL)
+	{
+		munmap(base, size);
+		return -1;
+	}
+
+	global.shared_memory_refcount = refcount;
+	memset(refcount + global.nslots, 0, size);
+
+	if (slot_allocator_resize(&global.slots, global.nslots, nslots) != 0)
+	{
+		munmap(base, size);
+		return -1;
+	}
+
+	memset(base, 0, size);
+	global.shm_segment[segment] = base;
+	global.shm_state[segment] = shm_state_open(segment);
+	global.shm_segment_count++;
+	global.nslots = nslots;
+
+	log_message(ASL_LEVEL_NOTICE, "shared memory grew to %u segments (%u slots)\n", global.shm_segment_count, global.nslots);
+	return 0;
+}
+
+/*
+ * Returns a slot for a new memory registration, adding a segment if every
+ * slot is taken.  *shared is set if the table cannot grow any further and
+ * the slot is already in use by another name.
+ */
+uint32_t
+shm_slot_alloc(bool *shared)
+{
+	slot_allocator_t *sa = &global.slots;
+	uint64_t start = mach_absolute_time();
+	uint32_t slot;
+
+	*shared = false;
+
+	slot = slot_bitmap_find(sa);
+	if ((slot == SLOT_NONE) && (shm_grow() == 0)) slot = slot_bitmap_find(sa);
+
+	if (slot != SLOT_NONE)
+	{
+		slot_bitmap_clear(sa, slot);
+		slot_lru_push(sa, slot);
+		sa->in_use++;
+	}
+	else if (sa->lru_tail != SLOT_NONE)
+	{
+		/* no segments left: share the slot that has gone longest without a post */
+		slot = sa->lru_tail;
+		shm_slot_touch(slot);
+		sa->reuse_count++;
+		*shared = true;
+		log_message(ASL_LEVEL_DEBUG, "reused shared memory slot %u\n", slot);
+	}
+
+	uint64_t delta = mach_absolute_time() - start;
+	sa->alloc_count++;
+	sa->alloc_time += delta;
+	if (delta > sa->alloc_max_time) sa->alloc_max_time = delta;
+
+	return slot;
+}
+
+/* called when the last registration using a slot goes away */
+void
+shm_slot_release(uint32_t slot)
+{
+	slot_allocator_t *sa = &global.slots;
+
+	if ((slot == 0) || (slot >= global.nslots)) return;
+
+	slot_lru_unlink(sa, slot);
+	slot_bitmap_set(sa, slot);
+	sa->in_use--;
+
+	shm_state_write(slot, 0, 0);
+}
+
+static void
+coalesce_window_end(void *context)
+{
+	notify_coalesce_t *w = context;
+
+	if (!w->pending)
+	{
+		/* a quiet window closes, the next post is delivered right away */
+		w->open = false;
+		dispatch_source_set_timer(w->timer, DISPATCH_TIME_FOREVER, 0, 0);
+		return;
+	}
+
+	w->pending = false;
+	_notify_lib_deliver_nid(&global.notify_state, w->nid);
+}
+
+static uint32_t
+coalesce_post(name_info_t *n, uint32_t u, uint32_t g)
+{
+	notify_coalesce_t *w = n->coalesce;
+	uint32_t status;
+
+	if (w->open)
+	{
+		status = _notify_lib_post_nid_quiet(&global.notify_state, n->name_id, u, g);
+		if (status == NOTIFY_STATUS_OK)
+		{
+			w->pending = true;
+			w->coalesced++;
+			call_statistics.post_coalesced++;
+		}
+
+		return status;
+	}
+
+	status = _notify_lib_post_nid(&global.notify_state, n->name_id, u, g);
+	if (status == NOTIFY_STATUS_OK)
+	{
+		w->open = true;
+		dispatch_source_set_timer(w->timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)w->window), w->window, w->window / 10);
+	}
+
+	return status;
+}
+
+/*
+ * Handle a "coalesce" line from notify.conf.
+ * The name gets a client of its own so it stays in the name table.
+ */
+static void
+coalesce_config(const char *name, uint32_t ms)
+{
+	notify_coalesce_t **list, *w;
+	name_info_t *n;
+	uint64_t nid;
+
+	if (ms == 0) return;
 
-	log_message(ASL_LEVEL_NOTICE, "-> has_root_entitlement (PID %d)\n", pid);
+	_notify_lib_register_plain(&global.notify_state, name, -1, global.next_no_client_token++, -1, 0, 0, &nid);
 
-	edata = xpc_copy_entitlement_for_token(entitlement, &audit);
+	n = _nc_table_find_64(&global.notify_state.name_id_table, nid);
+	if ((n == NULL) || (n->coalesce != NULL)) return;
 
-	if(edata != NULL){
-		result = xpc_bool_get_value(edata);
-		xpc_release(edata);
-	}
+	list = realloc(global.coalesce, (global.coalesce_count + 1) * sizeof(notify_coalesce_t *));
+	if (list == NULL) return;
+	global.coalesce = list;
 
-	log_message(ASL_LEVEL_NOTICE, "<- has_root_entitlement (PID %d) = %s\n", pid, result ? "OK" : "FAIL");
-	return result;
-}
+	w = calloc(1, sizeof(notify_coalesce_t));
+	if (w == NULL) return;
 
-inline bool
-has_root_entitlement(audit_token_t audit)
-{
-	return has_entitlement(audit, ROOT_ENTITLEMENT_KEY);
+	w->nid = nid;
+	w->window = (uint64_t)ms * NSEC_PER_MSEC;
+	w->timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, global.workloop);
+	dispatch_set_context(w->timer, w);
+	dispatch_source_set_event_handler_f(w->timer, coalesce_window_end);
+	dispatch_source_set_timer(w->timer, DISPATCH_TIME_FOREVER, 0, 0);
+	dispatch_activate(w->timer);
+
+	global.coalesce[global.coalesce_count++] = w;
+	n->coalesce = w;
+
+	log_message(ASL_LEVEL_DEBUG, "coalescing posts of %s within %u ms\n", name, ms);
 }
 
 uint32_t
@@ -787,9 +2078,16 @@ daemon_post(const char *name, uint32_t u, uint32_t g)
 	if (name == NULL) return NOTIFY_STATUS_NULL_INPUT;
 
 	n = _nc_table_find(&global.notify_state.name_table, name);
+	histogram_record(&histograms.fanout, (n == NULL) ? 0 : n->subscriber_count);
 	if (n == NULL) return NOTIFY_STATUS_OK;
 
-	if (n->slot != (uint32_t)-1) global.shared_memory_base[n->slot]++;
+	if (n->slot != (uint32_t)-1)
+	{
+		(*shm_slot_value(n->slot))++;
+		shm_slot_touch(n->slot);
+	}
+
+	if (n->coalesce != NULL) return coalesce_post(n, u, g);
 
 	status = _notify_lib_post(&global.notify_state, name, u, g);
 	return status;
@@ -802,9 +2100,16 @@ daemon_post_nid(uint64_t nid, uint32_t u, uint32_t g)
 	uint32_t status;
 
 	n = _nc_table_find_64(&global.notify_state.name_id_table, nid);
+	histogram_record(&histograms.fanout, (n == NULL) ? 0 : n->subscriber_count);
 	if (n == NULL) return NOTIFY_STATUS_OK;
 
-	if (n->slot != (uint32_t)-1) global.shared_memory_base[n->slot]++;
+	if (n->slot != (uint32_t)-1)
+	{
+		(*shm_slot_value(n->slot))++;
+		shm_slot_touch(n->slot);
+	}
+
+	if (n->coalesce != NULL) return coalesce_post(n, u, g);
 
 	status = _notify_lib_post_nid(&global.notify_state, nid, u, g);
 	return status;
@@ -820,7 +2125,8 @@ daemon_post_client(uint64_t cid)
 
 	if (notify_is_type(c->state_and_type, NOTIFY_TYPE_MEMORY) && (c->name_info != NULL) && (c->name_info->slot != (uint32_t)-1))
 	{
-		global.shared_memory_base[c->name_info->slot]++;
+		(*shm_slot_value(c->name_info->slot))++;
+		shm_slot_touch(c->name_info->slot);
 	}
 
 	_notify_lib_post_client(&global.notify_state, c);
@@ -837,6 +2143,463 @@ daemon_set_state(const char *name, uint64_t val)
 	if (n == NULL) return;
 
 	n->state = val;
+	shm_state_publish(n);
+	journal_record_state(n);
+}
+
+#pragma mark -
+#pragma mark state journal
+
+/* FNV-1a over a record and its name; never 0, so a record cut off before its check was set is not valid */
+static uint32_t
+journal_check(const journal_record_t *r, const char *name)
+{
+	const uint8_t *p;
+	uint32_t h = 2166136261u;
+
+	p = (const uint8_t *)&r->length;
+	for (size_t i = 0; i < sizeof(r->length); i++) h = (h ^ p[i]) * 16777619u;
+	p = (const uint8_t *)&r->state;
+	for (size_t i = 0; i < sizeof(r->state) + sizeof(r->state_time); i++) h = (h ^ p[i]) * 16777619u;
+	for (p = (const uint8_t *)name; *p != '\0'; p++) h = (h ^ *p) * 16777619u;
+
+	return (h == 0) ? 1 : h;
+}
+
+static size_t
+journal_record_size(size_t namelen)
+{
+	return sizeof(journal_record_t) + ((namelen + 1 + 7) & ~(size_t)7);
+}
+
+/* p must be zeroed; the check is stored last */
+static void
+journal_write_record(uint8_t *p, name_info_t *n, size_t namelen)
+{
+	journal_record_t *r = (journal_record_t *)p;
+
+	memcpy(r + 1, n->name, namelen + 1);
+	r->length = (uint32_t)(journal_record_size(namelen) - sizeof(journal_record_t));
+	r->state = n->state;
+	r->state_time = n->state_time;
+	os_atomic_store(&r->check, journal_check(r, n->name), release);
+}
+
+static uint64_t
+journal_boot_time(void)
+{
+	struct timeval tv = {};
+	size_t len = sizeof(tv);
+
+	if (sysctlbyname("kern.boottime", &tv, &len, NULL, 0) != 0) return 0;
+	return ((uint64_t)tv.tv_sec * USEC_PER_SEC) + (uint64_t)tv.tv_usec;
+}
+
+static void
+journal_close(void)
+{
+	if (global.journal != NULL) munmap(global.journal, global.journal_size);
+	global.journal = NULL;
+	global.journal_size = 0;
+	global.journal_used = 0;
+}
+
+/* the ipc version name carries notifyd's pid, which init_config sets afresh */
+static bool
+journal_skip(name_info_t *n)
+{
+	return (!strcmp(n->name, NOTIFY_IPC_VERSION_NAME));
+}
+
+/* creates JOURNAL_PATH.new with its header written; returns NULL on failure */
+static uint8_t *
+journal_create(size_t size)
+{
+	journal_header_t *header;
+	uint8_t *base;
+	int fd;
+
+	/*
+	 * The journal holds the state of restricted names too, so only root
+	 * may read it.  A leftover file is removed rather than truncated so
+	 * that neither its mode nor a link planted in its place carries over.
+	 */
+	unlink(JOURNAL_PATH ".new");
+	fd = open(JOURNAL_PATH ".new", O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+	if (fd < 0)
+	{
+		log_message(ASL_LEVEL_NOTICE, "can't create %s.new: %s\n", JOURNAL_PATH, strerror(errno));
+		return NULL;
+	}
+
+	base = MAP_FAILED;
+	if (ftruncate(fd, (off_t)size) == 0) base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (base == MAP_FAILED)
+	{
+		log_message(ASL_LEVEL_NOTICE, "can't map %s.new: %s\n", JOURNAL_PATH, strerror(errno));
+		unlink(JOURNAL_PATH ".new");
+		return NULL;
+	}
+
+	header = (journal_header_t *)base;
+	header->magic = JOURNAL_MAGIC;
+	header->version = JOURNAL_VERSION;
+	header->boot_time = journal_boot_time();
+
+	return base;
+}
+
+/* renames JOURNAL_PATH.new over the journal and makes base the journal */
+static void
+journal_install(uint8_t *base, size_t size, size_t used)
+{
+	if (rename(JOURNAL_PATH ".new", JOURNAL_PATH) != 0)
+	{
+		log_message(ASL_LEVEL_NOTICE, "can't rename %s.new: %s\n", JOURNAL_PATH, strerror(errno));
+		munmap(base, size);
+		unlink(JOURNAL_PATH ".new");
+		return;
+	}
+
+	journal_close();
+
+	global.journal = base;
+	global.journal_size = size;
+	global.journal_used = used;
+	global.journal_base_used = used;
+}
+
+/*
+ * Writes a new journal with one record for each name whose state has been
+ * set, at least twice as large as that, and renames it over the old one.
+ * A crash part way through leaves the old journal in place.  This walks
+ * every name at once, so it only runs at startup, before the listener;
+ * a full journal is compacted in chunks instead.
+ */
+static void
+journal_rewrite(void)
+{
+	__block size_t need = sizeof(journal_header_t);
+	__block size_t used = sizeof(journal_header_t);
+	size_t size;
+	uint8_t *base;
+
+	_nc_table_foreach(&global.notify_state.name_table, ^bool(void *_n) {
+		name_info_t *n = _n;
+		if ((n->state_time != 0) && !journal_skip(n)) need += journal_record_size(strlen(n->name));
+		return true;
+	});
+
+	size = JOURNAL_MIN_SIZE;
+	while (size < (need * 2)) size *= 2;
+
+	base = journal_create(size);
+	if (base == NULL) return;
+
+	_nc_table_foreach(&global.notify_state.name_table, ^bool(void *_n) {
+		name_info_t *n = _n;
+		size_t namelen;
+
+		if ((n->state_time == 0) || journal_skip(n)) return true;
+
+		namelen = strlen(n->name);
+		journal_write_record(base + used, n, namelen);
+		used += journal_record_size(namelen);
+		return true;
+	});
+
+	journal_install(base, size, used);
+}
+
+/*
+ * A journal compaction in progress.  It takes the ids of the names up
+ * front and writes JOURNAL_COMPACT_CHUNK of them per turn of the
+ * workloop, looking each id up again so names freed in between are
+ * skipped.  State changes meanwhile are recorded in both journals; the
+ * compacted one holds them in order with its own records, since each
+ * record carries the name's state at the time it is written.
+ */
+typedef struct
+{
+	uint8_t *base;
+	size_t size;
+	size_t used;
+	uint64_t *keys;
+	uint32_t key_count;
+	uint32_t next;
+	/* a state change did not fit; the next chunk starts over */
+	bool overflow;
+} journal_compact_t;
+
+static journal_compact_t *journal_compact;
+
+static void journal_compact_start(size_t size);
+
+static void
+journal_compact_append(journal_compact_t *jc, name_info_t *n)
+{
+	size_t namelen = strlen(n->name);
+
+	if ((jc->used + journal_record_size(namelen)) > jc->size)
+	{
+		jc->overflow = true;
+		return;
+	}
+
+	journal_write_record(jc->base + jc->used, n, namelen);
+	jc->used += journal_record_size(namelen);
+}
+
+static void
+journal_compact_end(journal_compact_t *jc, bool done)
+{
+	if (done)
+	{
+		journal_install(jc->base, jc->size, jc->used);
+	}
+	else
+	{
+		munmap(jc->base, jc->size);
+		unlink(JOURNAL_PATH ".new");
+	}
+
+	free(jc->keys);
+	free(jc);
+	journal_compact = NULL;
+}
+
+/* the compacted journal filled up; start over with one twice the size */
+static void
+journal_compact_overflow(journal_compact_t *jc)
+{
+	size_t size = jc->size * 2;
+
+	journal_compact_end(jc, false);
+	journal_compact_start(size);
+}
+
+static void
+journal_compact_chunk(void *context)
+{
+	journal_compact_t *jc = context;
+	uint32_t end = jc->next + JOURNAL_COMPACT_CHUNK;
+
+	if (end > jc->key_count) end = jc->key_count;
+
+	for (; (jc->next < end) && !jc->overflow; jc->next++)
+	{
+		name_info_t *n = _nc_table_find_64(&global.notify_state.name_id_table, jc->keys[jc->next]);
+
+		if ((n == NULL) || (n->state_time == 0) || journal_skip(n)) continue;
+
+		journal_compact_append(jc, n);
+	}
+
+	if (jc->overflow)
+	{
+		journal_compact_overflow(jc);
+		return;
+	}
+
+	if (jc->next == jc->key_count)
+	{
+		journal_compact_end(jc, true);
+		return;
+	}
+
+	/* let requests that arrived meanwhile run before the next chunk */
+	dispatch_async_f(global.workloop, jc, journal_compact_chunk);
+}
+
+static void
+journal_compact_start(size_t size)
+{
+	__block uint32_t i = 0;
+	journal_compact_t *jc;
+	uint32_t count;
+
+	jc = calloc(1, sizeof(journal_compact_t));
+	if (jc == NULL) return;
+
+	count = global.notify_state.name_table.count;
+	if (count > 0)
+	{
+		jc->keys = malloc(count * sizeof(uint64_t));
+		if (jc->keys == NULL)
+		{
+			free(jc);
+			return;
+		}
+
+		_nc_table_foreach(&global.notify_state.name_table, ^bool (void *n) {
+			jc->keys[i++] = ((name_info_t *)n)->name_id;
+			return (i < count);
+		});
+	}
+
+	jc->key_count = i;
+
+	jc->base = journal_create(size);
+	if (jc->base == NULL)
+	{
+		free(jc->keys);
+		free(jc);
+		return;
+	}
+
+	jc->size = size;
+	jc->used = sizeof(journal_header_t);
+	journal_compact = jc;
+
+	dispatch_async_f(global.workloop, jc, journal_compact_chunk);
+}
+
+/* called whenever a name's state changes */
+void
+journal_record_state(name_info_t *n)
+{
+	size_t namelen, size;
+
+	if ((n == NULL) || (global.journal == NULL) || journal_skip(n)) return;
+
+	namelen = strlen(n->name);
+
+	/* a full journal just misses records the compaction under way will have */
+	if ((global.journal_used + journal_record_size(namelen)) <= global.journal_size)
+	{
+		journal_write_record(global.journal + global.journal_used, n, namelen);
+		global.journal_used += journal_record_size(namelen);
+	}
+
+	if (journal_compact != NULL)
+	{
+		if (!journal_compact->overflow) journal_compact_append(journal_compact, n);
+		return;
+	}
+
+	if (global.journal_used <= ((global.journal_size / 4) * 3)) return;
+
+	/* a journal that starts more than half full after compaction would fill again soon */
+	size = global.journal_size;
+	if (global.journal_base_used > (size / 2)) size *= 2;
+
+	/* the compaction picks up n's new state */
+	journal_compact_start(size);
+}
+
+/* clients that kept restored names alive are no longer needed */
+static void
+journal_grace_end(void *ctx __unused)
+{
+	for (uint32_t token = global.journal_token_first; token < global.journal_token_end; token++)
+	{
+		_notify_lib_cancel(&global.notify_state, -1, token);
+	}
+
+	dispatch_source_cancel(global.journal_grace_src);
+	dispatch_release(global.journal_grace_src);
+	global.journal_grace_src = NULL;
+}
+
+/* replays records until one is not valid; returns the number of names restored */
+static uint32_t
+journal_replay(const uint8_t *base, size_t size)
+{
+	const journal_header_t *header = (const journal_header_t *)base;
+	size_t offset = sizeof(journal_header_t);
+	uint32_t restored = 0;
+	name_info_t *n;
+	uint64_t nid;
+
+	if ((header->magic != JOURNAL_MAGIC) || (header->version != JOURNAL_VERSION)) return 0;
+	if (header->boot_time != journal_boot_time()) return 0;
+
+	while ((offset + sizeof(journal_record_t)) <= size)
+	{
+		const journal_record_t *r = (const journal_record_t *)(base + offset);
+		const char *name = (const char *)(r + 1);
+
+		if ((r->length == 0) || (r->length > (size - offset - sizeof(journal_record_t)))) break;
+		if (strnlen(name, r->length) == r->length) break;
+		if (r->check != journal_check(r, name)) break;
+
+		offset += sizeof(journal_record_t) + r->length;
+
+		/* journals written before the ipc version name was skipped have it */
+		if (!strcmp(name, NOTIFY_IPC_VERSION_NAME)) continue;
+
+		n = _nc_table_find(&global.notify_state.name_table, name);
+		if (n == NULL)
+		{
+			/* a name at its default state needs nothing restored */
+			if (r->state == 0) continue;
+
+			/* the name gets a client of its own so it stays in the name table */
+			if (_notify_lib_register_plain(&global.notify_state, name, -1, global.next_no_client_token++, -1, 0, 0, &nid) != NOTIFY_STATUS_OK) continue;
+
+			n = _nc_table_find_64(&global.notify_state.name_id_table, nid);
+			if (n == NULL) continue;
+
+			restored++;
+		}
+
+		n->state = r->state;
+		n->state_time = r->state_time;
+	}
+
+	return restored;
+}
+
+/*
+ * Restores the state of names from the journal left by a previous notifyd,
+ * so name state does not depend on the processes that set it coming back
+ * to regenerate.  This runs before init_config, so the config file wins
+ * over the journal, and a regenerating client's saved state only wins if
+ * it is newer than the journal's.  Restored names are held for
+ * JOURNAL_GRACE_SECONDS, which gives their clients time to come back.
+ * The new journal is written by journal_rewrite once the config is in.
+ */
+static void
+journal_open(void)
+{
+	struct stat sb;
+	uint8_t *base = MAP_FAILED;
+	size_t size = 0;
+	uint32_t restored = 0;
+	int fd;
+
+	global.journal_token_first = global.next_no_client_token;
+
+	fd = open(JOURNAL_PATH, O_RDONLY);
+	if (fd >= 0)
+	{
+		if ((fstat(fd, &sb) == 0) && ((size_t)sb.st_size > sizeof(journal_header_t)))
+		{
+			size = (size_t)sb.st_size;
+			base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+
+		close(fd);
+	}
+
+	if (base != MAP_FAILED)
+	{
+		restored = journal_replay(base, size);
+		munmap(base, size);
+	}
+
+	global.journal_token_end = global.next_no_client_token;
+
+	log_message(ASL_LEVEL_DEBUG, "restored the state of %u names from %s\n", restored, JOURNAL_PATH);
+
+	if (restored == 0) return;
+
+	global.journal_grace_src = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, global.workloop);
+	dispatch_source_set_timer(global.journal_grace_src, dispatch_time(DISPATCH_TIME_NOW, (int64_t)JOURNAL_GRACE_SECONDS * NSEC_PER_SEC), DISPATCH_TIME_FOREVER, NSEC_PER_SEC);
+	dispatch_source_set_event_handler_f(global.journal_grace_src, journal_grace_end);
+	dispatch_activate(global.journal_grace_src);
 }
 
 static void
@@ -1091,6 +2854,15 @@ init_config(void)
 			if ((uid != 0) || (gid != 0)) _notify_lib_set_owner(&global.notify_state, args[1], uid, gid);
 			if (access != NOTIFY_ACCESS_DEFAULT) _notify_lib_set_access(&global.notify_state, args[1], access);
 
+			string_list_free(args);
+		} else if (!strcasecmp(args[0], "coalesce")) {
+			if (argslen != 3)
+			{
+				string_list_free(args);
+				continue;
+			}
+
+			coalesce_config(args[1], (uint32_t)atoi(args[2]));
 			string_list_free(args);
 		} else if (!strcasecmp(args[0], "quit")) {
 			string_list_free(args);
@@ -1112,8 +2884,16 @@ notifyd_mach_channel_handler(void *context, dispatch_mach_reason_t reason,
 		(mig_subsystem_t)&_notify_ipc_subsystem,
 	};
 	if (reason == DISPATCH_MACH_MESSAGE_RECEIVED) {
+		mach_msg_header_t *hdr = dispatch_mach_msg_get_msg(message, NULL);
+		uint32_t routine = (uint32_t)hdr->msgh_id - _notify_ipc_subsystem.start;
+		uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
 		if (!dispatch_mach_mig_demux(context, subsystems, 1, message)) {
-			mach_msg_destroy(dispatch_mach_msg_get_msg(message, NULL));
+			mach_msg_destroy(hdr);
+		}
+
+		if (routine < LATENCY_ROUTINES) {
+			histogram_record(&histograms.latency[routine], clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start);
 		}
 	}
 }
@@ -1157,6 +2937,40 @@ mach_notifs_handle(void *context, dispatch_mach_reason_t reason,
 	}
 }
 
+/*
+ * A previous notifyd may have grown the table.  Save the values in its
+ * extra segments too, so regenerating clients don't see spurious changes.
+ */
+static void
+save_shm_segments(const char *name, uint32_t size)
+{
+	char segment_name[NOTIFY_SHM_SEGMENT_ID_LEN];
+	uint32_t *base, *last;
+	int32_t shmfd;
+
+	for (uint32_t segment = 1; segment < NOTIFY_SHM_MAX_SEGMENTS; segment++)
+	{
+		_notify_shm_segment_id(name, segment, segment_name, sizeof(segment_name));
+		shmfd = shm_open(segment_name, O_RDONLY, 0);
+		if (shmfd == -1) return;
+
+		base = mmap(NULL, size, PROT_READ, MAP_SHARED, shmfd, 0);
+		close(shmfd);
+		if (base == MAP_FAILED) return;
+
+		last = realloc(global.last_shm_base, (size_t)(segment + 1) * size);
+		if (last != NULL)
+		{
+			global.last_shm_base = last;
+			memcpy(last + global.last_shm_nslots, base, size);
+			global.last_shm_nslots += size / sizeof(uint32_t);
+		}
+
+		munmap(base, size);
+		if (last == NULL) return;
+	}
+}
+
 static int32_t
 open_shared_memory(const char *name)
 {
@@ -1190,10 +3004,21 @@ open_shared_memory(const char *name)
 	global.shared_memory_base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
 	close(shmfd);
 
+	global.shm_name = name;
+	global.shm_segment_slots = global.nslots;
+	global.shm_segment_count = 1;
+	global.shm_segment[0] = global.shared_memory_base;
+	global.shm_state[0] = shm_state_open(0);
+
 	if (isnew == 0)
 	{
 		global.last_shm_base = malloc(size);
-		if (global.last_shm_base != NULL) memcpy(global.last_shm_base, global.shared_memory_base, size);
+		if (global.last_shm_base != NULL)
+		{
+			memcpy(global.last_shm_base, global.shared_memory_base, size);
+			global.last_shm_nslots = global.nslots;
+			save_shm_segments(name, size);
+		}
 	}
 
 	memset(global.shared_memory_base, 0, size);
@@ -1205,9 +3030,8 @@ open_shared_memory(const char *name)
 	/* slot 0 is notifyd's pid */
 	global.shared_memory_base[0] = getpid();
 	global.shared_memory_refcount[0] = 1;
-	global.slot_id = 0;
 
-	return 0;
+	return shm_slot_init(global.nslots);
 }
 
 int
@@ -1245,12 +3069,11 @@ main(int argc, const char *argv[])
 	memset(&call_statistics, 0, sizeof(struct call_statistics_s));
 
 	global.nslots = getpagesize() / sizeof(uint32_t);
-	_notify_lib_notify_state_init(&global.notify_state, NOTIFY_STATE_ENABLE_RESEND);
+	_notify_lib_notify_state_init(&global.notify_state, NOTIFY_STATE_ENABLE_RESEND | NOTIFY_STATE_BATCH_COMMON_PORT | NOTIFY_STATE_TRACK_IN_FLIGHT);
 	global.next_no_client_token = 1;
 
 	global.log_cutoff = ASL_LEVEL_ERR;
 	global.log_path = strdup(DEBUG_LOG_PATH);
-	global.slot_id = (uint32_t)-1;
 
 	for (i = 1; i < argc; i++)
 	{
@@ -1279,6 +3102,13 @@ main(int argc, const char *argv[])
 		{
 			global.nslots = atoi(argv[++i]) * (getpagesize() / sizeof(uint32_t));
 		}
+		else if (!strcmp(argv[i], "-shards"))
+		{
+			int shards = atoi(argv[++i]);
+			if (shards < 1) shards = 1;
+			if (shards > NOTIFY_FANOUT_MAX_SHARDS) shards = NOTIFY_FANOUT_MAX_SHARDS;
+			global.notify_state.fanout_shards = (uint32_t)shards;
+		}
 	}
 
 	global.log_default = global.log_cutoff;
@@ -1297,9 +3127,19 @@ main(int argc, const char *argv[])
 	dispatch_set_qos_class_fallback(global.workloop, QOS_CLASS_UTILITY);
 	dispatch_activate(global.workloop);
 
+	global.heavy_hitter_src = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, global.workloop);
+	dispatch_source_set_event_handler_f(global.heavy_hitter_src, heavy_hitter_tick_end);
+	dispatch_source_set_timer(global.heavy_hitter_src, DISPATCH_TIME_FOREVER, 0, 0);
+	dispatch_activate(global.heavy_hitter_src);
+
+	/* journaled state is applied first, so the config file's wins over it */
+	journal_open();
+
 	/* init from config file before starting the listener */
 	init_config();
 
+	journal_rewrite();
+
 	mach_port_options_t opts = {
 		.flags = MPO_STRICT | MPO_CONTEXT_AS_GUARD,
 	};
@@ -35,10 +35,154 @@
 
 #define STATUS_REQUEST_SHORT 0
 #define STATUS_REQUEST_LONG 1
+#define STATUS_REQUEST_TOP NOTIFY_DUMP_TOP_POSTERS
+#define STATUS_REQUEST_HISTOGRAMS NOTIFY_DUMP_HISTOGRAMS
+#define STATUS_REQUEST_BINARY NOTIFY_DUMP_BINARY
 
 #define NOTIFY_STATE_ENTITLEMENT "com.apple.private.libnotify.statecapture"
 
 
+#define SLOT_BITMAP_MAX_LEVELS 6
+
+/*
+ * Shared memory slot allocator.  Free slots are tracked in a hierarchical
+ * bitmap (a set bit is a free slot, and each level above has one bit per
+ * word below that still has a free slot), so finding a free slot costs one
+ * find-first-set per level.  Slots in use are kept on an LRU list ordered
+ * by last post; once every slot is taken, the least recently posted slot
+ * is shared rather than an arbitrary one.
+ */
+typedef struct
+{
+	uint32_t levels;
+	uint64_t *free_bits[SLOT_BITMAP_MAX_LEVELS];
+	uint32_t *lru_prev;
+	uint32_t *lru_next;
+	uint32_t lru_head;
+	uint32_t lru_tail;
+	uint32_t in_use;
+	uint64_t alloc_count;
+	uint64_t alloc_time;
+	uint64_t alloc_max_time;
+	uint64_t reuse_count;
+} slot_allocator_t;
+
+/*
+ * Coalescing window for a name, set with "coalesce" in notify.conf.
+ * The first post delivers right away and opens the window.  Later posts
+ * in the window only change the name's value and shared memory slot,
+ * and one delivery is made for all of them when the window ends.
+ */
+typedef struct notify_coalesce_s
+{
+	uint64_t nid;
+	uint64_t window;
+	uint64_t coalesced;
+	dispatch_source_t timer;
+	bool open;
+	bool pending;
+} notify_coalesce_t;
+
+#define HEAVY_HITTER_ENTRIES 32
+#define HEAVY_HITTER_REPORT 10
+#define HEAVY_HITTER_LABEL 64
+#define HEAVY_HITTER_WINDOWS 3
+#define HEAVY_HITTER_TICK_SLOTS 256
+
+/*
+ * Space-Saving summary of the posts in one window.  It keeps a fixed
+ * number of counters; a key that is not tracked takes over the smallest
+ * counter, inheriting its count as the error bound.  Any key posted more
+ * than total / HEAVY_HITTER_ENTRIES times is guaranteed to be present,
+ * and its count is high by at most error.
+ */
+typedef struct
+{
+	uint64_t key;
+	uint32_t count;
+	uint32_t error;
+	char label[HEAVY_HITTER_LABEL];
+} heavy_hitter_entry_t;
+
+typedef struct
+{
+	uint64_t total;
+	uint32_t used;
+	heavy_hitter_entry_t entry[HEAVY_HITTER_ENTRIES];
+} heavy_hitter_summary_t;
+
+/*
+ * Top posters by name and by pid over one window length.  The window
+ * in progress and the one before it are kept; reports weight the
+ * previous window by how much of it still overlaps the last length
+ * nanoseconds, which approximates a sliding window.
+ */
+typedef struct
+{
+	uint64_t length;
+	uint64_t start;
+	heavy_hitter_summary_t name[2];
+	heavy_hitter_summary_t pid[2];
+} heavy_hitter_window_t;
+
+typedef struct
+{
+	uint64_t key;
+	uint32_t count;
+	char label[HEAVY_HITTER_LABEL];
+} heavy_hitter_slot_t;
+
+typedef struct
+{
+	uint32_t used;
+	heavy_hitter_slot_t slot[HEAVY_HITTER_TICK_SLOTS];
+} heavy_hitter_tick_table_t;
+
+/*
+ * Posts since the last tick, counted exactly in small open-addressed
+ * tables.  This is the only thing a post touches; a timer armed by the
+ * first post of a tick folds it into every window a second later.  Keys
+ * past the tables' load limit only count toward total.
+ */
+typedef struct
+{
+	uint64_t total;
+	heavy_hitter_tick_table_t name;
+	heavy_hitter_tick_table_t pid;
+} heavy_hitter_tick_t;
+
+#define JOURNAL_PATH "/var/run/notifyd.journal"
+#define JOURNAL_MAGIC 0x6c6a6e6e
+#define JOURNAL_VERSION 1
+#define JOURNAL_MIN_SIZE (256 * 1024)
+#define JOURNAL_GRACE_SECONDS 120
+#define JOURNAL_COMPACT_CHUNK 256
+
+/*
+ * State journal.  Every change to a name's state appends a record to a
+ * file mapped MAP_SHARED, so the records are in the page cache the moment
+ * they are written and survive notifyd being killed.  A record is valid
+ * once its check is set; replay stops at the first record that is not.
+ * Once it is three quarters full it is compacted, a chunk of names per
+ * turn of the workloop, into a new file with one record per name.
+ */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	/* kern.boottime of the notifyd that wrote it; a journal from an earlier boot is ignored */
+	uint64_t boot_time;
+} journal_header_t;
+
+/* followed by the NUL terminated name, padded to 8 bytes */
+typedef struct
+{
+	uint32_t length;
+	uint32_t check;
+	uint64_t state;
+	uint64_t state_time;
+} journal_record_t;
+
 struct global_s
 {
 	notify_state_t notify_state;
@@ -54,19 +198,44 @@ struct global_s
 	dispatch_source_t stat_reset_src;
 	time_t last_reset_time;
 	uint32_t nslots;
-	uint32_t slot_id;
+	slot_allocator_t slots;
+	const char *shm_name;
+	uint32_t shm_segment_slots;
+	uint32_t shm_segment_count;
+	uint32_t *shm_segment[NOTIFY_SHM_MAX_SEGMENTS];
+	notify_shm_state_t *shm_state[NOTIFY_SHM_MAX_SEGMENTS];
 	uint32_t *shared_memory_base;
 	uint32_t *shared_memory_refcount;
 	uint32_t *last_shm_base;
+	uint32_t last_shm_nslots;
 	int log_cutoff;
 	uint32_t log_default;
 	uint32_t next_no_client_token;
+	notify_coalesce_t **coalesce;
+	uint32_t coalesce_count;
+	heavy_hitter_window_t heavy_hitters[HEAVY_HITTER_WINDOWS];
+	heavy_hitter_tick_t heavy_hitter_tick;
+	dispatch_source_t heavy_hitter_src;
+	uint8_t *journal;
+	size_t journal_size;
+	size_t journal_used;
+	size_t journal_base_used;
+	uint32_t journal_token_first;
+	uint32_t journal_token_end;
+	dispatch_source_t journal_grace_src;
 	uint16_t service_info_count;
 	char *log_path;
 };
 
 extern struct global_s global;
 
+/* value of a shared memory slot, in whichever segment holds it */
+static inline uint32_t *
+shm_slot_value(uint32_t slot)
+{
+	return &global.shm_segment[slot / global.shm_segment_slots][slot % global.shm_segment_slots];
+}
+
 struct call_statistics_s
 {
 	uint64_t post;
@@ -74,6 +243,8 @@ struct call_statistics_s
 	uint64_t post_by_id;
 	uint64_t post_by_name;
 	uint64_t post_by_name_and_fetch_id;
+	uint64_t post_many;
+	uint64_t post_coalesced;
 	uint64_t reg;
 	uint64_t reg_plain;
 	uint64_t reg_check;
@@ -82,6 +253,7 @@ struct call_statistics_s
 	uint64_t reg_port;
 	uint64_t reg_xpc_event;
 	uint64_t reg_common;
+	uint64_t reg_common_many;
 	uint64_t cancel;
 	uint64_t suspend;
 	uint64_t resume;
@@ -102,17 +274,52 @@ struct call_statistics_s
 	uint64_t service_path;
 	uint64_t cleanup;
 	uint64_t regenerate;
+	uint64_t regenerate_many;
 	uint64_t checkin;
+	uint64_t ack;
 };
 
 extern struct call_statistics_s call_statistics;
 
+#define HISTOGRAM_SUB_BUCKET_BITS 2
+#define HISTOGRAM_BUCKETS 128
+#define LATENCY_ROUTINES 64
+
+/*
+ * Log-bucketed histogram.  Values below 4 have a bucket each; above that
+ * every power of two is split into 4 buckets, so a bucket's bounds are
+ * within 25% of each other.  Values past the last bucket (about 8
+ * seconds, for nanoseconds) are counted in it.
+ */
+typedef struct
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bucket[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+struct histograms_s
+{
+	/* nanoseconds spent in each MIG handler, by msgh_id - subsystem start */
+	histogram_t latency[LATENCY_ROUTINES];
+	/* subscribers of the name, for each post */
+	histogram_t fanout;
+};
+
+extern struct histograms_s histograms;
+
 extern void log_message(int priority, const char *str, ...) __printflike(2, 3);
 extern uint32_t daemon_post(const char *name, uint32_t u, uint32_t g);
 extern uint32_t daemon_post_nid(uint64_t nid, uint32_t u, uint32_t g);
 extern void daemon_post_client(uint64_t cid);
 extern void daemon_set_state(const char *name, uint64_t val);
+extern uint32_t shm_slot_alloc(bool *shared);
+extern void shm_slot_release(uint32_t slot);
+extern void shm_state_publish(name_info_t *n);
 extern void dump_status(uint32_t level, int fd);
+extern void heavy_hitter_record(const char *name, uint64_t hash, pid_t pid);
+extern void journal_record_state(name_info_t *n);
 extern bool has_entitlement(audit_token_t audit, const char *entitlement);
 extern bool has_root_entitlement(audit_token_t audit);
 
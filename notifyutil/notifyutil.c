@@ -34,6 +34,10 @@
 #include <signal.h>
 #include <dispatch/dispatch.h>
 #include <os/variant_private.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "libnotify.h"
 
 #define forever for(;;)
 #define IndexNull ((uint32_t)-1)
@@ -117,6 +121,10 @@ usage(const char *name)
 	if(os_variant_has_internal_diagnostics(NULL))
 	{
 		fprintf(stderr, "    --dump         dumps metadata to a file in /var/run/\n");
+		fprintf(stderr, "    --top          prints the names and pids posting most often\n");
+		fprintf(stderr, "    --histograms   dumps latency and fan-out histograms to a file in /var/run/\n");
+		fprintf(stderr, "    --dump-binary  dumps state in binary to a file in /var/run/\n");
+		fprintf(stderr, "    --decode file  prints a binary dump\n");
 	}
 }
 
@@ -137,6 +145,420 @@ notifyutil_dump()
 
 }
 
+// Triggers a notifyd histogram dump
+static void
+notifyutil_histograms()
+{
+	int ret;
+
+	ret = notify_dump_histograms("/var/run/notifyd.histograms");
+
+	if(ret == NOTIFY_STATUS_OK)
+	{
+		fprintf(stdout, "Notifyd histogram dump success! New file created at /var/run/notifyd.histograms\n");
+	} else {
+		fprintf(stdout, "Notifyd histogram dump failed with %x\n", ret);
+	}
+}
+
+#define BINARY_DUMP_PATH "/var/run/notifyd.dump"
+
+static const char *
+dump_type_name(uint32_t t)
+{
+	switch (t)
+	{
+		case NOTIFY_TYPE_NONE:        return "none  ";
+		case NOTIFY_TYPE_MEMORY:      return "memory";
+		case NOTIFY_TYPE_PLAIN:       return "plain ";
+		case NOTIFY_TYPE_PORT:        return "port  ";
+		case NOTIFY_TYPE_FILE:        return "file  ";
+		case NOTIFY_TYPE_SIGNAL:      return "signal";
+		case NOTIFY_TYPE_XPC_EVENT:   return "event ";
+		case NOTIFY_TYPE_COMMON_PORT: return "common";
+		default: return "unknown";
+	}
+}
+
+/* a client record and the name it was under, for the per-process report */
+typedef struct
+{
+	const notify_dump_client_t *client;
+	const char *name;
+} dump_client_ref_t;
+
+static int
+dump_client_ref_compare(const void *a, const void *b)
+{
+	uint32_t pa = ((const dump_client_ref_t *)a)->client->pid;
+	uint32_t pb = ((const dump_client_ref_t *)b)->client->pid;
+
+	if (pa < pb) return -1;
+	if (pa > pb) return 1;
+	return 0;
+}
+
+/* next record, or NULL at the end of the buffer or on a truncated record */
+static const notify_dump_record_t *
+dump_next_record(const char *buf, size_t len, size_t *offset)
+{
+	const notify_dump_record_t *r;
+
+	if ((*offset + sizeof(notify_dump_record_t)) > len) return NULL;
+
+	r = (const notify_dump_record_t *)(buf + *offset);
+	if ((*offset + sizeof(notify_dump_record_t) + r->length) > len) return NULL;
+
+	*offset += sizeof(notify_dump_record_t) + r->length;
+	return r;
+}
+
+/* the string after a record's fixed part, or NULL if it is not NUL terminated within the record */
+static const char *
+dump_record_string(const notify_dump_record_t *r, size_t fixed)
+{
+	const char *str = (const char *)(r + 1) + fixed;
+
+	if (r->length <= fixed) return NULL;
+	if (memchr(str, '\0', r->length - fixed) == NULL) return NULL;
+	return str;
+}
+
+static void
+dump_print_client(const notify_dump_client_t *c)
+{
+	fprintf(stdout, "client_id: %llu\n", ((uint64_t)c->pid << 32) | c->token);
+	fprintf(stdout, "pid: %d\n", (int)c->pid);
+	fprintf(stdout, "token: %d\n", (int)c->token);
+	fprintf(stdout, "lastval: %u\n", c->lastval);
+	fprintf(stdout, "suspend_count: %u\n", c->suspend_count);
+	fprintf(stdout, "type: %s\n", dump_type_name(c->type));
+
+	switch (c->type)
+	{
+		case NOTIFY_TYPE_PORT: fprintf(stdout, "mach port: 0x%08llx\n", c->deliver); break;
+		case NOTIFY_TYPE_FILE: fprintf(stdout, "fd: %d\n", (int)c->deliver); break;
+		case NOTIFY_TYPE_SIGNAL: fprintf(stdout, "signal: %d\n", (int)c->deliver); break;
+		case NOTIFY_TYPE_XPC_EVENT: fprintf(stdout, "xpc event: %llu\n", c->deliver); break;
+		case NOTIFY_TYPE_COMMON_PORT: fprintf(stdout, "common port\n"); break;
+		default: break;
+	}
+}
+
+// Prints a binary dump in the layout of the full text status
+static int
+notifyutil_decode(const char *path)
+{
+	const notify_dump_header_t *h;
+	const notify_dump_record_t *r, *rc;
+	const char *name = NULL;
+	dump_client_ref_t *refs = NULL;
+	uint32_t ref_count = 0, ref_size = 0, name_count = 0;
+	size_t len, offset, next;
+	struct stat sb;
+	bool complete = false, in_procs = false, in_ports = false;
+	char *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	if ((fstat(fd, &sb) < 0) || (sb.st_size < (off_t)sizeof(notify_dump_header_t)))
+	{
+		fprintf(stderr, "%s is not a notifyd dump\n", path);
+		close(fd);
+		return 1;
+	}
+
+	len = (size_t)sb.st_size;
+	buf = malloc(len);
+	if ((buf == NULL) || (read(fd, buf, len) != (ssize_t)len))
+	{
+		fprintf(stderr, "can't read %s\n", path);
+		free(buf);
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	h = (const notify_dump_header_t *)buf;
+	if ((h->magic != NOTIFY_DUMP_MAGIC) || (h->version != NOTIFY_DUMP_VERSION))
+	{
+		fprintf(stderr, "%s is not a version %d notifyd dump\n", path, NOTIFY_DUMP_VERSION);
+		free(buf);
+		return 1;
+	}
+
+	{
+		char tbuf[128];
+		time_t t = (time_t)h->time;
+		strftime(tbuf, sizeof(tbuf), "%a, %d %b %Y %T %z", localtime(&t));
+		fprintf(stdout, "notifyd pid %u dumped at %s\n\n", h->pid, tbuf);
+	}
+
+	offset = sizeof(notify_dump_header_t);
+	while ((r = dump_next_record(buf, len, &offset)) != NULL)
+	{
+		const void *payload = r + 1;
+
+		switch (r->type)
+		{
+			case NOTIFY_DUMP_REC_GLOBALS:
+			{
+				const notify_dump_globals_t *g = payload;
+				char tbuf[128];
+				time_t t = (time_t)g->last_reset_time;
+
+				if (r->length < sizeof(*g)) break;
+
+				fprintf(stdout, "--- GLOBALS ---\n");
+				fprintf(stdout, "%u slots in %u segments (%u in use)\n", g->nslots, g->shm_segment_count, g->slots_in_use);
+				fprintf(stdout, "%u log_cutoff (default %u)\n", g->log_cutoff, g->log_default);
+				fprintf(stdout, "%u fan-out shards\n", g->fanout_shards);
+				strftime(tbuf, sizeof(tbuf), "%a, %d %b %Y %T %z", localtime(&t));
+				fprintf(stdout, "last reset time was %s\n", tbuf);
+				fprintf(stdout, "%u names   %u subscriptions   %u procs   %u ports\n", g->name_count, g->client_count, g->proc_count, g->port_count);
+				fprintf(stdout, "\n");
+				fprintf(stdout, "--- STATISTICS ---\n");
+				break;
+			}
+
+			case NOTIFY_DUMP_REC_STAT:
+			{
+				const notify_dump_stat_t *st = payload;
+				const char *key = dump_record_string(r, sizeof(*st));
+
+				if (key == NULL) break;
+				fprintf(stdout, "%-12s %llu\n", key, st->value);
+				break;
+			}
+
+			case NOTIFY_DUMP_REC_NAME:
+			{
+				const notify_dump_name_t *n = payload;
+				uint32_t reg[8] = {};
+
+				name = dump_record_string(r, sizeof(*n));
+				if (name == NULL) break;
+
+				if (name_count++ == 0) fprintf(stdout, "\n--- NAME TABLE ---\n");
+				else fprintf(stdout, "\n");
+
+				fprintf(stdout, "name: %s\n", name);
+				fprintf(stdout, "id: %llu\n", n->name_id);
+				fprintf(stdout, "uid: %u\n", n->uid);
+				fprintf(stdout, "gid: %u\n", n->gid);
+				fprintf(stdout, "access: %03x\n", n->access);
+				fprintf(stdout, "refcount: %u\n", n->refcount);
+				fprintf(stdout, "postcount: %u\n", n->postcount);
+				fprintf(stdout, "last hour postcount: %u\n", n->last_hour_postcount);
+				if (n->slot == SLOT_NONE) fprintf(stdout, "slot: -unassigned-");
+				else
+				{
+					fprintf(stdout, "slot: %u", n->slot);
+					if (n->slot_refcount != SLOT_NONE) fprintf(stdout, " = %u (%u)", n->slot_value, n->slot_refcount);
+				}
+				fprintf(stdout, "\n");
+				fprintf(stdout, "val: %u\n", n->val);
+				fprintf(stdout, "state: %llu\n", n->state);
+
+				/* the name's clients follow it */
+				next = offset;
+				while (((rc = dump_next_record(buf, len, &next)) != NULL) && (rc->type == NOTIFY_DUMP_REC_CLIENT))
+				{
+					const notify_dump_client_t *c = (const notify_dump_client_t *)(rc + 1);
+
+					if (rc->length < sizeof(*c)) continue;
+					reg[(c->type < 8) ? c->type : 0]++;
+				}
+
+				fprintf(stdout, "types: none %u   memory %u   plain %u   port %u   file %u   signal %u   event %u   common %u\n",
+						reg[NOTIFY_TYPE_NONE], reg[NOTIFY_TYPE_MEMORY], reg[NOTIFY_TYPE_PLAIN], reg[NOTIFY_TYPE_PORT],
+						reg[NOTIFY_TYPE_FILE], reg[NOTIFY_TYPE_SIGNAL], reg[NOTIFY_TYPE_XPC_EVENT], reg[NOTIFY_TYPE_COMMON_PORT]);
+				break;
+			}
+
+			case NOTIFY_DUMP_REC_CLIENT:
+			{
+				const notify_dump_client_t *c = payload;
+
+				if ((r->length < sizeof(*c)) || (name == NULL)) break;
+
+				fprintf(stdout, "\n");
+				dump_print_client(c);
+
+				if (ref_count == ref_size)
+				{
+					ref_size = (ref_size == 0) ? 1024 : (ref_size * 2);
+					refs = reallocf(refs, ref_size * sizeof(dump_client_ref_t));
+					if (refs == NULL)
+					{
+						fprintf(stderr, "Can't allocate memory!\n");
+						free(buf);
+						return 1;
+					}
+				}
+
+				refs[ref_count].client = c;
+				refs[ref_count].name = name;
+				ref_count++;
+				break;
+			}
+
+			case NOTIFY_DUMP_REC_PROC:
+			{
+				const notify_dump_proc_t *p = payload;
+				dump_client_ref_t key;
+				notify_dump_client_t kc;
+				uint32_t reg[8] = {}, lo, hi, i;
+
+				if (r->length < sizeof(*p)) break;
+
+				if (!in_procs)
+				{
+					/* the name table is done, sort its clients by pid */
+					fprintf(stdout, "\n--- NAME COUNT %u ---\n\n", name_count);
+					fprintf(stdout, "--- PROCESSES ---\n");
+					if (ref_count > 0) qsort(refs, ref_count, sizeof(dump_client_ref_t), dump_client_ref_compare);
+					name = NULL;
+					in_procs = true;
+				}
+
+				kc.pid = p->pid;
+				key.client = &kc;
+
+				/* first client of this pid */
+				lo = 0;
+				hi = ref_count;
+				while (lo < hi)
+				{
+					i = lo + (hi - lo) / 2;
+					if (dump_client_ref_compare(&refs[i], &key) < 0) lo = i + 1;
+					else hi = i;
+				}
+
+				for (i = lo; (i < ref_count) && (refs[i].client->pid == p->pid); i++)
+				{
+					reg[(refs[i].client->type < 8) ? refs[i].client->type : 0]++;
+				}
+
+				fprintf(stdout, "pid: %u   ", p->pid);
+				fprintf(stdout, "memory %u   plain %u   port %u   file %u   signal %u   event %u   common %u\n",
+						reg[NOTIFY_TYPE_MEMORY], reg[NOTIFY_TYPE_PLAIN], reg[NOTIFY_TYPE_PORT], reg[NOTIFY_TYPE_FILE],
+						reg[NOTIFY_TYPE_SIGNAL], reg[NOTIFY_TYPE_XPC_EVENT], reg[NOTIFY_TYPE_COMMON_PORT]);
+
+				for (i = lo; (i < ref_count) && (refs[i].client->pid == p->pid); i++)
+				{
+					fprintf(stdout, "  %s: %s\n", dump_type_name(refs[i].client->type), refs[i].name);
+				}
+
+				fprintf(stdout, "\n");
+				break;
+			}
+
+			case NOTIFY_DUMP_REC_PORT:
+			{
+				const notify_dump_port_t *pt = payload;
+
+				if (r->length < sizeof(*pt)) break;
+
+				if (!in_ports)
+				{
+					fprintf(stdout, "--- PORTS ---\n");
+					in_ports = true;
+				}
+
+				fprintf(stdout, "port: 0x%08x   flags 0x%x\n", pt->port, pt->flags);
+				break;
+			}
+
+			case NOTIFY_DUMP_REC_END:
+				complete = true;
+				break;
+
+			default:
+				break;
+		}
+
+		if (complete) break;
+	}
+
+	if (!complete) fprintf(stdout, "\n*** dump is incomplete ***\n");
+
+	free(refs);
+	free(buf);
+	return complete ? 0 : 1;
+}
+
+// Triggers a binary notifyd dump and waits for notifyd to finish writing it
+static void
+notifyutil_dump_binary()
+{
+	notify_dump_record_t end;
+	struct stat sb;
+	int ret, fd;
+
+	ret = notify_dump_binary(BINARY_DUMP_PATH);
+	if (ret != NOTIFY_STATUS_OK)
+	{
+		fprintf(stdout, "Notifyd binary dump failed with %x\n", ret);
+		return;
+	}
+
+	/* notifyd writes the dump between other requests, wait up to a minute for its end record */
+	for (uint32_t tries = 0; tries < 600; tries++)
+	{
+		fd = open(BINARY_DUMP_PATH, O_RDONLY);
+		if (fd >= 0)
+		{
+			if ((fstat(fd, &sb) == 0) && (sb.st_size >= (off_t)(sizeof(notify_dump_header_t) + sizeof(end))) &&
+				(pread(fd, &end, sizeof(end), sb.st_size - (off_t)sizeof(end)) == (ssize_t)sizeof(end)) &&
+				(end.type == NOTIFY_DUMP_REC_END) && (end.length == 0))
+			{
+				close(fd);
+				fprintf(stdout, "Notifyd binary dump success! New file created at %s\n", BINARY_DUMP_PATH);
+				return;
+			}
+
+			close(fd);
+		}
+
+		usleep(100000);
+	}
+
+	fprintf(stdout, "Notifyd binary dump did not finish, %s is incomplete\n", BINARY_DUMP_PATH);
+}
+
+// Prints the top posters report from notifyd
+static void
+notifyutil_top()
+{
+	char line[256];
+	FILE *f;
+	int ret;
+
+	ret = notify_dump_top_posters("/var/run/notifyd.top");
+	if (ret != NOTIFY_STATUS_OK)
+	{
+		fprintf(stdout, "Notifyd top posters failed with %x\n", ret);
+		return;
+	}
+
+	f = fopen("/var/run/notifyd.top", "r");
+	if (f == NULL)
+	{
+		fprintf(stdout, "Can't open /var/run/notifyd.top\n");
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) fputs(line, stdout);
+	fclose(f);
+}
+
 static void
 reg_add(uint32_t tid, uint32_t type, uint32_t signum, uint32_t count, const char *name)
 {
@@ -632,6 +1054,31 @@ main(int argc, const char *argv[])
 			exit(0);
 
 		}
+		else if (!strcmp(argv[i], "--top") && os_variant_has_internal_diagnostics(NULL))
+		{
+			notifyutil_top();
+			exit(0);
+		}
+		else if (!strcmp(argv[i], "--histograms") && os_variant_has_internal_diagnostics(NULL))
+		{
+			notifyutil_histograms();
+			exit(0);
+		}
+		else if (!strcmp(argv[i], "--dump-binary") && os_variant_has_internal_diagnostics(NULL))
+		{
+			notifyutil_dump_binary();
+			exit(0);
+		}
+		else if (!strcmp(argv[i], "--decode") && os_variant_has_internal_diagnostics(NULL))
+		{
+			if ((i + 1) >= argc)
+			{
+				fprintf(stderr, "--decode requires a file\n");
+				exit(1);
+			}
+
+			exit(notifyutil_decode(argv[i + 1]));
+		}
 		else
 		{
 			fprintf(stderr, "unrecognized option: %s\n", argv[i]);
@@ -29,13 +29,145 @@
 #include <sys/param.h>
 #include <os/assumes.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "table.h"
 #include "notify_internal.h"
 
-#define TABLE_TOMBSTONE ((void *)~0)
 #define TABLE_MINSHIFT  5
 #define TABLE_MINSIZE   (1 << TABLE_MINSHIFT)
 
+/*
+ * Control bytes: a full slot has its high bit set and carries the top
+ * 7 bits of the key hash, so that most mismatches are rejected without
+ * touching the key. Empty slots are 0 so that a calloc()ed table is empty.
+ */
+#define TABLE_TAG_EMPTY    ((uint8_t)0x00)
+#define TABLE_TAG_DELETED  ((uint8_t)0x01)
+#define TABLE_GROUP_WIDTH  16
+
+/*
+ * Number of old slots moved per table operation while a resize is in
+ * progress. A growth step only adds 1/8th to 1/4th of the size, so this
+ * must be large enough for the migration to finish before the new arrays
+ * fill up again; _reserve() completes it synchronously if it doesn't.
+ */
+#define TABLE_MIGRATE_BUDGET 32
+
+OS_ALWAYS_INLINE
+static inline uint8_t
+table_tag(uint32_t hash)
+{
+	return (uint8_t)(0x80 | (hash >> 25));
+}
+
+OS_ALWAYS_INLINE
+static inline bool
+table_tag_is_full(uint8_t tag)
+{
+	return (tag & 0x80) != 0;
+}
+
+/*
+ * Group scans return a 16-bit mask where bit n describes slot (i + n).
+ */
+#if defined(__SSE2__)
+
+OS_ALWAYS_INLINE
+static inline uint32_t
+table_group_match(const uint8_t *tags, uint8_t tag)
+{
+	__m128i group = _mm_loadu_si128((const __m128i *)tags);
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+}
+
+OS_ALWAYS_INLINE
+static inline uint32_t
+table_group_full(const uint8_t *tags)
+{
+	return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)tags));
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+OS_ALWAYS_INLINE
+static inline uint32_t
+table_group_mask(uint8x16_t lanes)
+{
+	static const uint8_t bits[16] = {
+		1, 2, 4, 8, 16, 32, 64, 128,
+		1, 2, 4, 8, 16, 32, 64, 128,
+	};
+	uint8x16_t m = vandq_u8(lanes, vld1q_u8(bits));
+
+	return (uint32_t)vaddv_u8(vget_low_u8(m)) |
+			((uint32_t)vaddv_u8(vget_high_u8(m)) << 8);
+}
+
+OS_ALWAYS_INLINE
+static inline uint32_t
+table_group_match(const uint8_t *tags, uint8_t tag)
+{
+	return table_group_mask(vceqq_u8(vld1q_u8(tags), vdupq_n_u8(tag)));
+}
+
+OS_ALWAYS_INLINE
+static inline uint32_t
+table_group_full(const uint8_t *tags)
+{
+	return table_group_mask(vtstq_u8(vld1q_u8(tags), vdupq_n_u8(0x80)));
+}
+
+#else
+
+OS_ALWAYS_INLINE
+static inline uint32_t
+table_group_match(const uint8_t *tags, uint8_t tag)
+{
+	uint32_t mask = 0;
+
+	for (uint32_t n = 0; n < TABLE_GROUP_WIDTH; n++) {
+		if (tags[n] == tag) mask |= 1u << n;
+	}
+	return mask;
+}
+
+OS_ALWAYS_INLINE
+static inline uint32_t
+table_group_full(const uint8_t *tags)
+{
+	uint32_t mask = 0;
+
+	for (uint32_t n = 0; n < TABLE_GROUP_WIDTH; n++) {
+		if (table_tag_is_full(tags[n])) mask |= 1u << n;
+	}
+	return mask;
+}
+
+#endif
+
+OS_ALWAYS_INLINE
+static inline uint32_t
+table_wrap(uint32_t i, uint32_t size)
+{
+	return i >= size ? i - size : i;
+}
+
+OS_ALWAYS_INLINE
+static inline void
+table_set_tag(uint8_t *tags, uint32_t size, uint32_t i, uint8_t tag)
+{
+	tags[i] = tag;
+	if (i < TABLE_GROUP_WIDTH - 1) {
+		/* keep the mirror of the first group in sync */
+		tags[size + i] = tag;
+	}
+}
+
 OS_ALWAYS_INLINE
 static inline uint32_t
 table_next(uint32_t i, uint32_t size)
@@ -57,22 +189,97 @@ string_equals(const char *a, const char *b)
 	return a == b || strcmp(a, b) == 0;
 }
 
-static uint32_t
-string_hash(const char *key)
+/*
+ * Word-at-a-time string hash (wyhash family).
+ *
+ * Names are long reverse-DNS strings, so consuming them 16 bytes per round
+ * instead of one byte per round matters. Callers that already know the
+ * length (or hash the same name repeatedly) should cache the result.
+ */
+#define HASH_SECRET0 0xa0761d6478bd642full
+#define HASH_SECRET1 0xe7037ed1a0b428dbull
+#define HASH_SECRET2 0x8ebc6af09c88c6e3ull
+
+OS_ALWAYS_INLINE
+static inline uint64_t
+hash_mix(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+	__uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+	/*
+	 * No 128-bit multiply on 32-bit targets: fold four 32x32->64 products
+	 * instead, as wyhash's 32-bit mode does.  Hashes never leave the
+	 * process, so they need not match the 64-bit result.
+	 */
+	uint64_t hh = (a >> 32) * (b >> 32);
+	uint64_t hl = (a >> 32) * (uint32_t)b;
+	uint64_t lh = (uint64_t)(uint32_t)a * (b >> 32);
+	uint64_t ll = (uint64_t)(uint32_t)a * (uint32_t)b;
+	return ((hl >> 32) | (hl << 32)) ^ hh ^ ((lh >> 32) | (lh << 32)) ^ ll;
+#endif
+}
+
+OS_ALWAYS_INLINE
+static inline uint64_t
+hash_read64(const uint8_t *p)
 {
-    uint32_t hash = 0;
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+OS_ALWAYS_INLINE
+static inline uint64_t
+hash_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+uint64_t
+_nc_string_hash(const char *key, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)key;
+	uint64_t seed = HASH_SECRET0 ^ hash_mix(len ^ HASH_SECRET1, HASH_SECRET2);
+	uint64_t a, b;
+	size_t rem = len;
 
-    for (; *key; key++) {
-        hash += (unsigned char)(*key);
-        hash += (hash << 10);
-        hash ^= (hash >> 6);
-    }
+	while (rem > 16) {
+		seed = hash_mix(hash_read64(p) ^ HASH_SECRET1, hash_read64(p + 8) ^ seed);
+		p += 16;
+		rem -= 16;
+	}
 
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
+	if (rem > 8) {
+		a = hash_read64(p);
+		b = hash_read64(p + rem - 8);
+	} else if (rem >= 4) {
+		a = hash_read32(p);
+		b = hash_read32(p + rem - 4);
+	} else if (rem > 0) {
+		a = ((uint64_t)p[0] << 16) | ((uint64_t)p[rem >> 1] << 8) | p[rem - 1];
+		b = 0;
+	} else {
+		a = b = 0;
+	}
+
+	return hash_mix(HASH_SECRET1 ^ len, hash_mix(a ^ HASH_SECRET1, b ^ seed));
+}
+
+OS_ALWAYS_INLINE
+static inline uint32_t
+string_hash_fold(uint64_t hash)
+{
+	return (uint32_t)hash;
+}
 
-    return hash;
+static inline uint32_t
+string_hash(const char *key)
+{
+	return string_hash_fold(_nc_string_hash(key, strlen(key)));
 }
 
 static inline bool
@@ -109,6 +316,24 @@ uint64_hash(uint64_t key)
 #define key_equals    string_equals
 #include "table.in.c"
 
+void *
+_nc_table_find_hashed(table_t *t, const char *key, uint64_t hash)
+{
+	return _nc_table_find_hash(t, key, string_hash_fold(hash));
+}
+
+void
+_nc_table_insert_hashed(table_t *t, char **key, uint64_t hash)
+{
+	_nc_table_insert_hash(t, key, string_hash_fold(hash));
+}
+
+void
+_nc_table_delete_hashed(table_t *t, const char *key, uint64_t hash)
+{
+	_nc_table_delete_hash(t, key, string_hash_fold(hash));
+}
+
 #define ns(n)         _nc_table##n##_n
 #define key_t         uint32_t
 #define ckey_t        uint32_t
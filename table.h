@@ -27,7 +27,24 @@
 #include <os/base.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
+/*
+ * Open addressing table with linear probing.
+ *
+ * `keys` points to the keys embedded in the stored objects, and is the base
+ * of a single allocation that also holds `hashes` (the cached full hash of
+ * each key) and `tags` (one control byte per slot, plus a mirrored copy of
+ * the first group so that a group load never wraps).
+ *
+ * Lookups scan the tags a group at a time and only dereference a key when
+ * both its tag and its cached hash match.
+ *
+ * Resizing is incremental: the previous bucket arrays are kept in `old_*`
+ * and a bounded number of their slots is migrated on every insert, find
+ * and delete, so no single operation pays for moving the whole table.
+ * `count` covers the entries of both arrays.
+ */
 #define _nc_table(key_t, _ns) \
 	struct _nc_table##_ns { \
 		uint32_t     count; \
@@ -36,6 +53,13 @@
 		uint16_t     grow_shift; \
 		uint16_t     key_offset; \
 		key_t      **keys; \
+		uint32_t    *hashes; \
+		uint8_t     *tags; \
+		uint32_t     old_size; \
+		uint32_t     migrate_index; \
+		key_t      **old_keys; \
+		uint32_t    *old_hashes; \
+		uint8_t     *old_tags; \
 	}
 
 typedef _nc_table(char *, ) table_t;
@@ -60,6 +84,15 @@ extern void _nc_table_delete(table_t *t, const char *key);
 extern void _nc_table_delete_n(table_n_t *t, uint32_t key);
 extern void _nc_table_delete_64(table_64_t *t, uint64_t key);
 
+/*
+ * String tables hash keys with _nc_string_hash(). Callers that keep the
+ * hash of a name around can use the _hashed variants to skip rehashing it.
+ */
+extern uint64_t _nc_string_hash(const char *key, size_t len);
+extern void _nc_table_insert_hashed(table_t *t, char **key, uint64_t hash);
+extern void *_nc_table_find_hashed(table_t *t, const char *key, uint64_t hash);
+extern void _nc_table_delete_hashed(table_t *t, const char *key, uint64_t hash);
+
 typedef bool (^payload_handler_t) (void *);
 
 extern void _nc_table_foreach(table_t *t, OS_NOESCAPE payload_handler_t handler);
@@ -22,15 +22,16 @@
  */
 
 static inline void *
-ns(_value)(struct ns() *t, uint32_t i)
+ns(_value)(struct ns() *t, key_t *key)
 {
-	return (void *)((uintptr_t)t->keys[i] - t->key_offset);
+	return (void *)((uintptr_t)key - t->key_offset);
 }
 
 static inline void
 ns(_clear)(struct ns() *t)
 {
 	free(t->keys);
+	free(t->old_keys);
 	ns(_init)(t, t->key_offset);
 }
 
@@ -43,11 +44,126 @@ ns(_init)(struct ns() *t, size_t offset)
 	};
 }
 
+/*
+ * Places `key` in the current arrays, the caller accounts for it in count.
+ */
+static void
+ns(_insert_slot)(struct ns() *t, key_t *key, uint32_t hash)
+{
+	uint32_t size = t->size, loop_limit = size / TABLE_GROUP_WIDTH + 1;
+	uint32_t i = hash % size;
+
+	for (;;) {
+		if (os_unlikely(loop_limit-- == 0)) {
+			NOTIFY_INTERNAL_CRASH(0, "Corrupt hash table");
+		}
+		uint32_t avail = ~table_group_full(t->tags + i) & 0xffff;
+		if (avail) {
+			i = table_wrap(i + (uint32_t)__builtin_ctz(avail), size);
+			break;
+		}
+		i = table_wrap(i + TABLE_GROUP_WIDTH, size);
+	}
+
+	if (t->tags[i] == TABLE_TAG_DELETED) {
+		t->tombstones--;
+	}
+	t->keys[i] = key;
+	t->hashes[i] = hash;
+	table_set_tag(t->tags, t->size, i, table_tag(hash));
+}
+
+/*
+ * Returns the slot holding `key`, or UINT32_MAX.
+ *
+ * Probing stops at the first empty slot, which insertion never skips over,
+ * so candidates past it in the same group can be ignored.
+ */
+static uint32_t
+ns(_probe)(key_t **keys, const uint32_t *hashes, const uint8_t *tags,
+		uint32_t size, ckey_t key, uint32_t hash)
+{
+	uint32_t loop_limit = size / TABLE_GROUP_WIDTH + 1;
+	uint8_t tag = table_tag(hash);
+	uint32_t i = hash % size;
+
+	for (;;) {
+		if (os_unlikely(loop_limit-- == 0)) {
+			NOTIFY_INTERNAL_CRASH(0, "Corrupt hash table");
+		}
+
+		uint32_t match = table_group_match(tags + i, tag);
+		uint32_t empty = table_group_match(tags + i, TABLE_TAG_EMPTY);
+
+		if (empty) {
+			match &= (empty & -empty) - 1;
+		}
+		while (match) {
+			uint32_t j = table_wrap(i + (uint32_t)__builtin_ctz(match), size);
+			if (hashes[j] == hash && key_equals(key, *keys[j])) {
+				return j;
+			}
+			match &= match - 1;
+		}
+		if (empty) {
+			return UINT32_MAX;
+		}
+		i = table_wrap(i + TABLE_GROUP_WIDTH, size);
+	}
+}
+
+/*
+ * Moves up to `budget` slots of the previous arrays into the current ones,
+ * and frees the previous arrays once they have been fully scanned.
+ */
+static void
+ns(_migrate)(struct ns() *t, uint32_t budget)
+{
+	while (budget-- > 0 && t->migrate_index < t->old_size) {
+		uint32_t i = t->migrate_index++;
+
+		if (table_tag_is_full(t->old_tags[i])) {
+			ns(_insert_slot)(t, t->old_keys[i], t->old_hashes[i]);
+			/* leave a tombstone so probe chains of unmoved keys stay intact */
+			table_set_tag(t->old_tags, t->old_size, i, TABLE_TAG_DELETED);
+		}
+	}
+
+	if (t->migrate_index >= t->old_size) {
+		free(t->old_keys);
+		t->old_keys = NULL;
+		t->old_hashes = NULL;
+		t->old_tags = NULL;
+		t->old_size = 0;
+		t->migrate_index = 0;
+	}
+}
+
+OS_ALWAYS_INLINE
+static inline void
+ns(_migrate_step)(struct ns() *t)
+{
+	if (os_unlikely(t->old_keys != NULL)) {
+		ns(_migrate)(t, TABLE_MIGRATE_BUDGET);
+	}
+}
+
 OS_NOINLINE
 static void
 ns(_rehash)(struct ns() *t, int direction)
 {
-	struct ns() old = *t;
+	size_t bytes;
+
+	/* only one resize can be in flight */
+	if (t->old_keys != NULL) {
+		ns(_migrate)(t, UINT32_MAX);
+	}
+
+	t->old_keys = t->keys;
+	t->old_hashes = t->hashes;
+	t->old_tags = t->tags;
+	t->old_size = t->size;
+	t->migrate_index = 0;
 
 	if (direction > 0) {
 		t->size += (1 << t->grow_shift);
@@ -61,56 +177,61 @@ ns(_rehash)(struct ns() *t, int direction)
 		t->size = roundup(t->size / 2, (1 << t->grow_shift));
 	}
 
-	t->count = 0;
 	t->tombstones = 0;
-	t->keys = calloc(t->size, sizeof(key_t *));
+	bytes = t->size * (sizeof(key_t *) + sizeof(uint32_t) + sizeof(uint8_t));
+	t->keys = calloc(1, bytes + TABLE_GROUP_WIDTH);
 	if (t->keys == NULL) {
 		NOTIFY_INTERNAL_CRASH(0, "Unable to grow table: registration leak?");
 	}
+	t->hashes = (uint32_t *)(t->keys + t->size);
+	t->tags = (uint8_t *)(t->hashes + t->size);
 
-	for (uint32_t i = 0; i < old.size; i++) {
-		if (old.keys[i] == NULL || old.keys[i] == TABLE_TOMBSTONE) {
-			continue;
-		}
-
-		ns(_insert)(t, old.keys[i]);
-	}
-	free(old.keys);
+	/* the cached hashes let us move entries without touching their keys */
+	ns(_migrate)(t, TABLE_MIGRATE_BUDGET);
 }
 
-void *
-ns(_find)(struct ns() *t, ckey_t key)
+static void *
+ns(_find_hash)(struct ns() *t, ckey_t key, uint32_t hash)
 {
+	uint32_t i;
+
 	if (t->count == 0) {
 		return NULL;
 	}
 
-	uint32_t size = t->size, loop_limit = t->size;
-	uint32_t i = key_hash(key) % size;
+	ns(_migrate_step)(t);
 
-	for (;;) {
-		if (os_unlikely(loop_limit-- == 0)) {
-			NOTIFY_INTERNAL_CRASH(0, "Corrupt hash table");
-		}
-		if (t->keys[i] != TABLE_TOMBSTONE) {
-			if (t->keys[i] == NULL) {
-				return NULL;
-			}
-			if (key_equals(key, *t->keys[i])) {
-				return ns(_value)(t, i);
-			}
+	i = ns(_probe)(t->keys, t->hashes, t->tags, t->size, key, hash);
+	if (i != UINT32_MAX) {
+		return ns(_value)(t, t->keys[i]);
+	}
+
+	if (t->old_keys != NULL) {
+		i = ns(_probe)(t->old_keys, t->old_hashes, t->old_tags, t->old_size, key, hash);
+		if (i != UINT32_MAX) {
+			return ns(_value)(t, t->old_keys[i]);
 		}
-		i = table_next(i, size);
 	}
+
+	return NULL;
 }
 
-void
-ns(_insert)(struct ns() *t, key_t *key)
+void *
+ns(_find)(struct ns() *t, ckey_t key)
+{
+	return ns(_find_hash)(t, key, key_hash(key));
+}
+
+static inline void
+ns(_reserve)(struct ns() *t)
 {
 	/*
-	 * Our algorithm relies on having enough NULLS to end loops.
+	 * Our algorithm relies on having enough empty slots to end loops.
 	 * Make sure their density is never below 25%.
 	 *
+	 * `count` includes the entries still waiting to be migrated,
+	 * so the current arrays always have room for all of them.
+	 *
 	 * When it drops too low, if the ratio of tombstones is low,
 	 * assume we're on a growth codepath.
 	 *
@@ -122,64 +243,63 @@ ns(_insert)(struct ns() *t, key_t *key)
 		} else {
 			ns(_rehash)(t, 0);
 		}
+	} else {
+		ns(_migrate_step)(t);
 	}
+}
 
-	uint32_t size = t->size, loop_limit = t->size;
-	uint32_t i = key_hash(*key) % size;
-
-	for (;;) {
-		if (os_unlikely(loop_limit-- == 0)) {
-			NOTIFY_INTERNAL_CRASH(0, "Corrupt hash table");
-		}
-		if (t->keys[i] == NULL) {
-			break;
-		}
-		if (t->keys[i] == TABLE_TOMBSTONE) {
-			t->tombstones--;
-			break;
-		}
-		i = table_next(i, size);
-	}
-
-	t->keys[i] = key;
+static void
+ns(_insert_hash)(struct ns() *t, key_t *key, uint32_t hash)
+{
+	ns(_reserve)(t);
+	ns(_insert_slot)(t, key, hash);
 	t->count++;
 }
 
 void
-ns(_delete)(struct ns() *t, ckey_t key)
+ns(_insert)(struct ns() *t, key_t *key)
 {
+	ns(_insert_hash)(t, key, key_hash(*key));
+}
+
+static void
+ns(_delete_hash)(struct ns() *t, ckey_t key, uint32_t hash)
+{
+	uint32_t size = t->size;
+	uint32_t i;
+
 	if (t->count == 0) {
 		return;
 	}
 
-	uint32_t size = t->size, loop_limit = t->size;
-	uint32_t i = key_hash(key) % size;
+	ns(_migrate_step)(t);
 
-	for (;;) {
-		if (os_unlikely(loop_limit-- == 0)) {
-			NOTIFY_INTERNAL_CRASH(0, "Corrupt hash table");
+	i = ns(_probe)(t->keys, t->hashes, t->tags, size, key, hash);
+	if (i == UINT32_MAX) {
+		if (t->old_keys == NULL) {
+			return;
 		}
-		if (t->keys[i] != TABLE_TOMBSTONE) {
-			if (t->keys[i] == NULL) {
-				return;
-			}
-			if (key_equals(key, *t->keys[i])) {
-				break;
-			}
+		i = ns(_probe)(t->old_keys, t->old_hashes, t->old_tags, t->old_size, key, hash);
+		if (i == UINT32_MAX) {
+			return;
 		}
-		i = table_next(i, size);
-	}
-
-	t->keys[i] = TABLE_TOMBSTONE;
-	t->tombstones++;
-	t->count--;
+		/* the previous arrays are only scanned, never probed for room */
+		t->old_keys[i] = NULL;
+		table_set_tag(t->old_tags, t->old_size, i, TABLE_TAG_DELETED);
+		t->count--;
+	} else {
+		t->keys[i] = NULL;
+		table_set_tag(t->tags, size, i, TABLE_TAG_DELETED);
+		t->tombstones++;
+		t->count--;
 
-	if (t->keys[table_next(i, size)] == NULL) {
-		do {
-			t->tombstones--;
-			t->keys[i] = NULL;
-			i = table_prev(i, size);
-		} while (t->keys[i] == TABLE_TOMBSTONE);
+		if (t->tags[table_next(i, size)] == TABLE_TAG_EMPTY) {
+			do {
+				t->tombstones--;
+				table_set_tag(t->tags, size, i, TABLE_TAG_EMPTY);
+				i = table_prev(i, size);
+			} while (t->tags[i] == TABLE_TAG_DELETED);
+		}
 	}
 
 	if (t->count == 0) {
@@ -191,12 +311,23 @@ ns(_delete)(struct ns() *t, ckey_t key)
 	}
 }
 
+void
+ns(_delete)(struct ns() *t, ckey_t key)
+{
+	ns(_delete_hash)(t, key, key_hash(key));
+}
+
 void
 ns(_foreach)(struct ns() *t, bool (^handler)(void *))
 {
+	/* finish any resize so that lookups made by the handler don't move entries */
+	if (t->old_keys != NULL) {
+		ns(_migrate)(t, UINT32_MAX);
+	}
+
 	for (uint32_t i = 0; i < t->size; i++) {
-		if (t->keys[i] != NULL && t->keys[i] != TABLE_TOMBSTONE) {
-			if (!handler(ns(_value)(t, i))) break;
+		if (table_tag_is_full(t->tags[i])) {
+			if (!handler(ns(_value)(t, t->keys[i]))) break;
 		}
 	}
 }
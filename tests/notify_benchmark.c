@@ -10,6 +10,8 @@
 #include <dispatch/dispatch.h>
 #include "notify_private.h"
 #include <stdlib.h>
+#include <mach/mach_time.h>
+#include <sys/sysctl.h>
 
 
 static const uint32_t CNT = 10;
@@ -358,3 +360,114 @@ T_DECL(notify_benchmark_dispatch,
 
 	T_PASS("Notify Benchmark Succeeded!");
 }
+
+T_DECL(notify_benchmark_register_cancel,
+       "notify benchmark register/cancel churn",
+       T_META_EASYPERF(true),
+       T_META_EASYPERF_ARGS("-p notifyd"),
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	uint32_t r;
+	unsigned i, j;
+
+	int t[CNT];
+	char *n[CNT];
+
+	for (i = 0; i < CNT; i++)
+	{
+		r = asprintf(&n[i], "dummy.test.churn.%d", i);
+		assert(r != -1);
+	}
+
+	for (j = 0 ; j < SPL; j++)
+	{
+		/* Register + Cancel, new name each time (name_info_t churn) */
+		for (i = 0; i < CNT; i++)
+		{
+			r = notify_register_check(n[i], &t[i]);
+			bench_assert(r == 0);
+			r = notify_cancel(t[i]);
+			bench_assert(r == 0);
+		}
+
+		/* Register + Cancel, live name (client_t churn) */
+		for (i = 0; i < CNT; i++)
+		{
+			r = notify_register_plain(n[0], &t[i]);
+			bench_assert(r == 0);
+		}
+
+		for (i = 0; i < CNT; i++)
+		{
+			r = notify_cancel(t[i]);
+			bench_assert(r == 0);
+		}
+	}
+
+	for (i = 0; i < CNT; i++)
+	{
+		free(n[i]);
+	}
+
+	T_PASS("Notify Benchmark Succeeded!");
+}
+
+#define MT_MAX_THREADS 64
+#define MT_TOKENS 256
+#define MT_ROUNDS 2000
+
+T_DECL(notify_benchmark_check_threads,
+       "notify_check on memory tokens from N threads x M tokens",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	static int t[MT_MAX_THREADS][MT_TOKENS];
+	mach_timebase_info_data_t tbi;
+	int ncpu = 1;
+	size_t len = sizeof(ncpu);
+	double single = 0;
+
+	mach_timebase_info(&tbi);
+	sysctlbyname("hw.activecpu", &ncpu, &len, NULL, 0);
+	if (ncpu > MT_MAX_THREADS) ncpu = MT_MAX_THREADS;
+
+	for (int i = 0; i < ncpu; i++)
+	{
+		for (int k = 0; k < MT_TOKENS; k++)
+		{
+			T_QUIET; T_ASSERT_EQ(notify_register_check("com.apple.notify.test.check.mt", &t[i][k]), NOTIFY_STATUS_OK, NULL);
+		}
+	}
+
+	for (int n = 1; n <= ncpu; n *= 2)
+	{
+		uint64_t s = mach_absolute_time();
+		dispatch_apply(n, DISPATCH_APPLY_AUTO, ^(size_t i) {
+			int check;
+			for (int j = 0; j < MT_ROUNDS; j++)
+			{
+				for (int k = 0; k < MT_TOKENS; k++)
+				{
+					uint32_t r = notify_check(t[i][k], &check);
+					bench_assert(r == 0);
+				}
+			}
+		});
+		uint64_t ns = (mach_absolute_time() - s) * tbi.numer / tbi.denom;
+
+		double rate = (double)n * MT_ROUNDS * MT_TOKENS / ((double)ns / NSEC_PER_SEC);
+		if (n == 1) single = rate;
+		T_LOG("%2d threads x %d tokens: %.1f M checks/s (%.2fx one thread)", n, MT_TOKENS, rate / 1e6, rate / single);
+	}
+
+	for (int i = 0; i < ncpu; i++)
+	{
+		for (int k = 0; k < MT_TOKENS; k++)
+		{
+			notify_cancel(t[i][k]);
+		}
+	}
+
+	T_PASS("Notify Benchmark Succeeded!");
+}
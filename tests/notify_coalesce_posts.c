@@ -0,0 +1,76 @@
+//
+//  notify_coalesce_posts.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <mach/mach.h>
+#include <notify.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "../notify_private.h"
+
+#define POSTS 10000
+
+static uint64_t
+messages_sent(void)
+{
+	task_events_info_data_t info = {};
+	mach_msg_type_number_t count = TASK_EVENTS_INFO_COUNT;
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(task_info(mach_task_self(), TASK_EVENTS_INFO, (task_info_t)&info, &count), NULL);
+	return (uint64_t)info.messages_sent;
+}
+
+T_DECL(notify_coalesce_posts,
+       "a tight loop of posts sends far fewer messages, and the last post still arrives",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	char name[128];
+	uint64_t sent;
+	int token, check = 0;
+
+	snprintf(name, sizeof(name), "com.example.test.coalesce_posts.%d", getpid());
+	T_ASSERT_EQ(notify_register_check(name, &token), NOTIFY_STATUS_OK, NULL);
+
+	/* the first two posts of a name go by name, to fetch its name ID */
+	T_QUIET; T_ASSERT_EQ(notify_post(name), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_post(name), NOTIFY_STATUS_OK, NULL);
+
+	notify_set_options(NOTIFY_OPT_COALESCE_POSTS);
+	T_QUIET; T_ASSERT_EQ(notify_check(token, &check), NOTIFY_STATUS_OK, NULL);
+
+	sent = messages_sent();
+	for (uint32_t i = 0; i < POSTS; i++)
+	{
+		T_QUIET; T_ASSERT_EQ(notify_post(name), NOTIFY_STATUS_OK, NULL);
+	}
+	sent = messages_sent() - sent;
+
+	T_LOG("%llu messages sent for %d posts", sent, POSTS);
+	T_EXPECT_LT_ULLONG(sent, (unsigned long long)(POSTS / 10), "posts were coalesced");
+
+	/* posts are sent in the background, give them up to a second */
+	check = 0;
+	for (uint32_t tries = 0; (tries < 1000) && (check == 0); tries++)
+	{
+		T_QUIET; T_ASSERT_EQ(notify_check(token, &check), NOTIFY_STATUS_OK, NULL);
+		if (check == 0) usleep(1000);
+	}
+	T_EXPECT_EQ(check, 1, "the posts reached notifyd");
+
+	/* nothing is left pending after the last post went out */
+	usleep(100000);
+	T_QUIET; T_ASSERT_EQ(notify_check(token, &check), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_post(name), NOTIFY_STATUS_OK, NULL);
+	check = 0;
+	for (uint32_t tries = 0; (tries < 1000) && (check == 0); tries++)
+	{
+		T_QUIET; T_ASSERT_EQ(notify_check(token, &check), NOTIFY_STATUS_OK, NULL);
+		if (check == 0) usleep(1000);
+	}
+	T_EXPECT_EQ(check, 1, "a later post is sent too");
+
+	notify_cancel(token);
+}
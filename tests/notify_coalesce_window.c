@@ -0,0 +1,176 @@
+//
+//  notify_coalesce_window.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <dispatch/dispatch.h>
+#include <mach/mach_time.h>
+#include <notify.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../libnotify.h"
+
+#define CONFIG_PATH "/etc/notify.conf"
+#define WINDOW_MS 500
+#define BURST 20
+
+static char *saved_config;
+static size_t saved_config_len;
+
+static pid_t
+notifyd_pid(void)
+{
+	uint64_t state = 0;
+	int token;
+
+	if (notify_register_check(NOTIFY_IPC_VERSION_NAME, &token) != NOTIFY_STATUS_OK) return 0;
+	if (notify_get_state(token, &state) != NOTIFY_STATUS_OK) state = 0;
+	notify_cancel(token);
+
+	return (pid_t)(state >> 32);
+}
+
+/* notifyd only reads its config at startup */
+static void
+restart_notifyd(void)
+{
+	pid_t old_pid = notifyd_pid(), new_pid = 0;
+
+	T_QUIET; T_ASSERT_NE(old_pid, 0, "notifyd pid");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kill(old_pid, SIGKILL), "kill notifyd");
+
+	for (int i = 0; (i < 100) && (kill(old_pid, 0) == 0); i++) usleep(10000);
+
+	for (int i = 0; (i < 100) && ((new_pid == 0) || (new_pid == old_pid)); i++)
+	{
+		usleep(100000);
+		new_pid = notifyd_pid();
+	}
+
+	T_QUIET; T_ASSERT_NE(new_pid, 0, "notifyd restarted");
+	T_QUIET; T_ASSERT_NE(new_pid, old_pid, "notifyd restarted");
+}
+
+static void
+write_config(const char *line)
+{
+	FILE *f = fopen(CONFIG_PATH, "w");
+
+	T_QUIET; T_ASSERT_NOTNULL(f, "open %s", CONFIG_PATH);
+
+	/* ahead of the rest, since a "quit" line ends the file */
+	if (line != NULL) fprintf(f, "%s\n", line);
+	if (saved_config_len > 0) fwrite(saved_config, 1, saved_config_len, f);
+	fclose(f);
+}
+
+static void
+restore_config(void)
+{
+	write_config(NULL);
+	free(saved_config);
+	saved_config = NULL;
+	restart_notifyd();
+}
+
+static uint64_t
+elapsed_ms(uint64_t start)
+{
+	static mach_timebase_info_data_t tbi;
+
+	if (tbi.denom == 0) mach_timebase_info(&tbi);
+	return (mach_absolute_time() - start) * tbi.numer / tbi.denom / NSEC_PER_MSEC;
+}
+
+static uint32_t
+wait_deliveries(_Atomic uint32_t *deliveries, uint32_t count, uint32_t ms)
+{
+	for (uint32_t i = 0; (i < ms) && (atomic_load(deliveries) < count); i++) usleep(1000);
+	return atomic_load(deliveries);
+}
+
+T_DECL(notify_coalesce_window,
+       "posts to a name with a coalesce line are delivered once per window",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META_ASROOT(YES))
+{
+	static _Atomic uint32_t deliveries;
+	char name[128], line[256];
+	uint64_t start;
+	int d_token, c_token, check = 0;
+	FILE *f;
+
+	dispatch_queue_t dq = dispatch_queue_create("com.example.test.coalesce_window", NULL);
+
+	f = fopen(CONFIG_PATH, "r");
+	if (f != NULL)
+	{
+		saved_config = malloc(64 * 1024);
+		T_QUIET; T_ASSERT_NOTNULL(saved_config, NULL);
+		saved_config_len = fread(saved_config, 1, 64 * 1024, f);
+		T_QUIET; T_ASSERT_TRUE(feof(f), "%s fits the buffer", CONFIG_PATH);
+		fclose(f);
+	}
+
+	snprintf(name, sizeof(name), "com.example.test.coalesce_window.%d", getpid());
+	snprintf(line, sizeof(line), "coalesce %s %d", name, WINDOW_MS);
+	write_config(line);
+	T_ATEND(restore_config);
+	restart_notifyd();
+
+	T_QUIET; T_ASSERT_EQ(notify_register_dispatch(name, &d_token, dq, ^(int token __unused) {
+		atomic_fetch_add(&deliveries, 1);
+	}), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_register_check(name, &c_token), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_check(c_token, &check), NOTIFY_STATUS_OK, NULL);
+
+	/* the first post opens a window and is delivered right away */
+	start = mach_absolute_time();
+	T_QUIET; T_ASSERT_EQ(notify_post(name), NOTIFY_STATUS_OK, NULL);
+	T_ASSERT_EQ(wait_deliveries(&deliveries, 1, WINDOW_MS / 2), 1u, "first post delivered");
+	T_EXPECT_LT_ULLONG(elapsed_ms(start), (uint64_t)(WINDOW_MS / 2), "first post delivered without waiting for the window");
+	T_QUIET; T_ASSERT_EQ(notify_check(c_token, &check), NOTIFY_STATUS_OK, NULL);
+
+	/* posts inside the window change the value at once, but are held for delivery */
+	for (uint32_t i = 0; i < BURST; i++)
+	{
+		T_QUIET; T_ASSERT_EQ(notify_post(name), NOTIFY_STATUS_OK, NULL);
+	}
+
+	check = 0;
+	for (uint32_t i = 0; (i < 100) && (check == 0); i++)
+	{
+		T_QUIET; T_ASSERT_EQ(notify_check(c_token, &check), NOTIFY_STATUS_OK, NULL);
+		if (check == 0) usleep(1000);
+	}
+	T_EXPECT_EQ(check, 1, "notify_check sees posts inside the window");
+
+	if (elapsed_ms(start) < (WINDOW_MS / 2))
+	{
+		T_EXPECT_EQ(atomic_load(&deliveries), 1u, "posts inside the window are not delivered yet");
+	}
+	else
+	{
+		T_LOG("burst took %llu ms, too close to the end of the window to check it was held", elapsed_ms(start));
+	}
+
+	/* the window ends and the burst is delivered once */
+	T_EXPECT_EQ(wait_deliveries(&deliveries, 2, WINDOW_MS * 4), 2u, "burst delivered when the window ends");
+	usleep(WINDOW_MS * 2 * USEC_PER_MSEC + 100000);
+	T_EXPECT_EQ(atomic_load(&deliveries), 2u, "burst delivered only once");
+
+	/* a window with no posts has closed, so the next post goes out right away */
+	start = mach_absolute_time();
+	T_QUIET; T_ASSERT_EQ(notify_post(name), NOTIFY_STATUS_OK, NULL);
+	T_EXPECT_EQ(wait_deliveries(&deliveries, 3, WINDOW_MS / 2), 3u, "post after a quiet window delivered");
+	T_EXPECT_LT_ULLONG(elapsed_ms(start), (uint64_t)(WINDOW_MS / 2), "post after a quiet window not held");
+
+	notify_cancel(d_token);
+	notify_cancel(c_token);
+	dispatch_release(dq);
+}
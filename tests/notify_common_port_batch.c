@@ -0,0 +1,63 @@
+//
+//  notify_common_port_batch.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <dispatch/dispatch.h>
+#include <notify.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* more than one batch message worth of names */
+#define NAMES 200
+
+static atomic_uint fired[NAMES];
+
+T_DECL(notify_common_port_batch,
+       "notify_post_many reaches every dispatch registration exactly once",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	dispatch_queue_t q = dispatch_queue_create("notify_common_port_batch", NULL);
+	const char *names[NAMES];
+	int tokens[NAMES];
+	char *name;
+
+	for (uint32_t i = 0; i < NAMES; i++)
+	{
+		asprintf(&name, "com.example.test.common_port_batch.%d.%u", getpid(), i);
+		names[i] = name;
+		atomic_store(&fired[i], 0);
+
+		T_QUIET; T_ASSERT_EQ(notify_register_dispatch(names[i], &tokens[i], q, ^(int token) {
+			atomic_fetch_add(&fired[i], 1);
+		}), NOTIFY_STATUS_OK, NULL);
+	}
+
+	T_ASSERT_EQ(notify_post_many(names, NAMES), NOTIFY_STATUS_OK, NULL);
+
+	/* posts are asynchronous, give notifyd up to a second */
+	for (uint32_t tries = 0; tries < 1000; tries++)
+	{
+		uint32_t done = 0;
+		for (uint32_t i = 0; i < NAMES; i++) done += (atomic_load(&fired[i]) > 0);
+		if (done == NAMES) break;
+		usleep(1000);
+	}
+
+	/* let any duplicate deliveries arrive */
+	usleep(100000);
+	dispatch_sync(q, ^{});
+
+	for (uint32_t i = 0; i < NAMES; i++)
+	{
+		T_QUIET; T_EXPECT_EQ_UINT(atomic_load(&fired[i]), 1u, "%s fired once", names[i]);
+		notify_cancel(tokens[i]);
+		free((void *)names[i]);
+	}
+
+	T_PASS("%d names delivered through the common port", NAMES);
+}
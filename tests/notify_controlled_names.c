@@ -0,0 +1,117 @@
+//
+//  notify_controlled_names.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <mach/mach_time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "table.c"
+#include "libnotify.c"
+
+#define RESERVED_COUNT 10000
+#define CHECK_ROUNDS 100
+#define SAMPLE_STRIDE 97
+#define SAMPLE_COUNT (RESERVED_COUNT / SAMPLE_STRIDE)
+
+static const uid_t owner_uid = 501;
+static const gid_t owner_gid = 20;
+static const uid_t other_uid = 502;
+static const gid_t other_gid = 21;
+
+static uint32_t
+check_write(notify_state_t *ns, const char *name, uid_t uid, gid_t gid)
+{
+	return _notify_lib_check_controlled_access(ns, (char *)name, uid, gid, NOTIFY_ACCESS_WRITE);
+}
+
+T_DECL(notify_controlled_names,
+       "deepest controlled ancestor decides access",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	notify_state_t ns = {};
+
+	_notify_lib_notify_state_init(&ns, 0);
+
+	_notify_lib_set_owner(&ns, "com.example.restricted", owner_uid, owner_gid);
+	_notify_lib_set_access(&ns, "com.example.restricted", NOTIFY_ACCESS_USER_RW);
+	_notify_lib_set_owner(&ns, "com.example.restricted.open", owner_uid, owner_gid);
+	T_EXPECT_EQ_UINT(ns.controlled_name_count, 2u, "two controlled names");
+
+	T_EXPECT_EQ_UINT(check_write(&ns, "com.example.restricted", owner_uid, owner_gid), NOTIFY_STATUS_OK, "owner may post");
+	T_EXPECT_EQ_UINT(check_write(&ns, "com.example.restricted", other_uid, other_gid), NOTIFY_STATUS_NOT_AUTHORIZED, "others may not post");
+	T_EXPECT_EQ_UINT(check_write(&ns, "com.example.restricted.sub", other_uid, other_gid), NOTIFY_STATUS_NOT_AUTHORIZED, "subtree inherits");
+	T_EXPECT_EQ_UINT(check_write(&ns, "com.example.restrictedX", other_uid, other_gid), NOTIFY_STATUS_NOT_AUTHORIZED, "prefixes match byte-wise");
+	T_EXPECT_EQ_UINT(check_write(&ns, "com.example.restricted.open.sub", other_uid, other_gid), NOTIFY_STATUS_OK, "deeper controlled name wins");
+	T_EXPECT_EQ_UINT(check_write(&ns, "com.example.restricte", other_uid, other_gid), NOTIFY_STATUS_OK, "ancestors are not restricted");
+	T_EXPECT_EQ_UINT(check_write(&ns, "com.example.restricted", 0, 0), NOTIFY_STATUS_OK, "root may do anything");
+}
+
+T_DECL(notify_controlled_names_benchmark,
+       "access checks against 10k reserved namespaces",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	notify_state_t ns = {};
+	mach_timebase_info_data_t tbi;
+	char name[128];
+	uint64_t s, denied, allowed;
+
+	mach_timebase_info(&tbi);
+	_notify_lib_notify_state_init(&ns, 0);
+
+	for (uint32_t i = 0; i < RESERVED_COUNT; i++)
+	{
+		snprintf(name, sizeof(name), "com.example.reserved.%u", i);
+		_notify_lib_set_owner(&ns, name, owner_uid, owner_gid);
+		_notify_lib_set_access(&ns, name, NOTIFY_ACCESS_USER_RW);
+	}
+	T_EXPECT_EQ_UINT(ns.controlled_name_count, RESERVED_COUNT, "all namespaces reserved");
+
+	char *restricted[SAMPLE_COUNT], *public[SAMPLE_COUNT];
+	for (uint32_t i = 0; i < SAMPLE_COUNT; i++)
+	{
+		asprintf(&restricted[i], "com.example.reserved.%u.event", i * SAMPLE_STRIDE);
+		asprintf(&public[i], "com.example.public.%u.event", i * SAMPLE_STRIDE);
+	}
+
+	s = mach_absolute_time();
+	for (uint32_t j = 0; j < CHECK_ROUNDS; j++)
+	{
+		for (uint32_t i = 0; i < SAMPLE_COUNT; i++)
+		{
+			if (check_write(&ns, restricted[i], other_uid, other_gid) != NOTIFY_STATUS_NOT_AUTHORIZED)
+			{
+				T_FAIL("%s should be restricted", restricted[i]);
+			}
+		}
+	}
+	denied = mach_absolute_time() - s;
+
+	s = mach_absolute_time();
+	for (uint32_t j = 0; j < CHECK_ROUNDS; j++)
+	{
+		for (uint32_t i = 0; i < SAMPLE_COUNT; i++)
+		{
+			if (check_write(&ns, public[i], other_uid, other_gid) != NOTIFY_STATUS_OK)
+			{
+				T_FAIL("%s should not be restricted", public[i]);
+			}
+		}
+	}
+	allowed = mach_absolute_time() - s;
+
+	for (uint32_t i = 0; i < SAMPLE_COUNT; i++)
+	{
+		free(restricted[i]);
+		free(public[i]);
+	}
+
+	uint32_t checks = CHECK_ROUNDS * SAMPLE_COUNT;
+	T_LOG("restricted name: %llu ns/check", denied * tbi.numer / tbi.denom / checks);
+	T_LOG("public name:     %llu ns/check", allowed * tbi.numer / tbi.denom / checks);
+	T_PASS("controlled name benchmark done");
+}
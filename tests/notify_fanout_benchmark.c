@@ -0,0 +1,97 @@
+//
+//  notify_fanout_benchmark.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <mach/mach_time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "table.c"
+#include "libnotify.c"
+
+#define SUBSCRIBERS 10000
+#define PROCS 1000
+#define POST_ROUNDS 200
+
+static const char *fanout_name = "com.example.test.fanout";
+
+/* the list walk _internal_post_name did before the subscriber array */
+static void
+list_post(notify_state_t *ns, name_info_t *n)
+{
+	client_t *c;
+
+	n->val++;
+	LIST_FOREACH(c, &n->subscriptions, client_subscription_entry) {
+		_internal_send(ns, c, NULL, NULL);
+	}
+}
+
+T_DECL(notify_fanout_benchmark,
+       "posting a name with 10k subscribers",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	notify_state_t ns = {};
+	mach_timebase_info_data_t tbi;
+	proc_data_t *procs = calloc(PROCS, sizeof(proc_data_t));
+	uint64_t nid, s, walked, scanned;
+
+	T_QUIET; T_ASSERT_NOTNULL(procs, NULL);
+
+	mach_timebase_info(&tbi);
+	_notify_lib_notify_state_init(&ns, 0);
+
+	for (uint32_t i = 0; i < PROCS; i++)
+	{
+		LIST_INIT(&procs[i].clients);
+		procs[i].pid = 1000 + i;
+		_nc_table_insert_n(&ns.proc_table, &procs[i].pid);
+	}
+
+	for (uint32_t i = 0; i < SUBSCRIBERS; i++)
+	{
+		T_QUIET; T_ASSERT_EQ(_notify_lib_register_plain(&ns, fanout_name, 1000 + (i % PROCS), i, SLOT_NONE, 0, 0, &nid), NOTIFY_STATUS_OK, NULL);
+	}
+
+	name_info_t *n = _nc_table_find(&ns.name_table, fanout_name);
+	T_QUIET; T_ASSERT_NOTNULL(n, NULL);
+	T_EXPECT_EQ_UINT(n->subscriber_count, SUBSCRIBERS, "every client is in the subscriber array");
+
+	/* cancel a spread of clients and put them back, so the array has been reshuffled */
+	for (uint32_t i = 0; i < SUBSCRIBERS; i += 7)
+	{
+		_notify_lib_cancel(&ns, 1000 + (i % PROCS), i);
+		T_QUIET; T_ASSERT_EQ(_notify_lib_register_plain(&ns, fanout_name, 1000 + (i % PROCS), i, SLOT_NONE, 0, 0, &nid), NOTIFY_STATUS_OK, NULL);
+	}
+	T_EXPECT_EQ_UINT(n->subscriber_count, SUBSCRIBERS, "cancel and register keep the array packed");
+
+	for (uint32_t i = 0; i < n->subscriber_count; i++)
+	{
+		if (n->subscribers[i].client->subscriber_index != i) T_FAIL("subscriber %u has index %u", i, n->subscribers[i].client->subscriber_index);
+	}
+
+	/* warm both paths */
+	list_post(&ns, n);
+	_notify_lib_post(&ns, fanout_name, 0, 0);
+
+	s = mach_absolute_time();
+	for (uint32_t j = 0; j < POST_ROUNDS; j++) list_post(&ns, n);
+	walked = mach_absolute_time() - s;
+
+	s = mach_absolute_time();
+	for (uint32_t j = 0; j < POST_ROUNDS; j++) _notify_lib_post(&ns, fanout_name, 0, 0);
+	scanned = mach_absolute_time() - s;
+
+	for (uint32_t i = 0; i < SUBSCRIBERS; i++)
+	{
+		_notify_lib_cancel(&ns, 1000 + (i % PROCS), i);
+	}
+	free(procs);
+
+	T_LOG("subscription list:  %llu ns/post", walked * tbi.numer / tbi.denom / POST_ROUNDS);
+	T_LOG("subscriber array:   %llu ns/post", scanned * tbi.numer / tbi.denom / POST_ROUNDS);
+	T_PASS("fan-out benchmark done");
+}
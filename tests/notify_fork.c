@@ -0,0 +1,76 @@
+//
+//  notify_fork.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <notify.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define PARENT_TOKENS 300
+#define CHILD_OK 0
+#define CHILD_FAILED 1
+#define CHILD_DISABLED 2
+
+/* self names stay in the process, so the child is not disabled for having talked to notifyd */
+static int
+child_main(void)
+{
+	char name[128];
+	uint64_t state = 0;
+	int token, check = 0;
+	uint32_t status;
+
+	snprintf(name, sizeof(name), "self.com.example.test.fork.child.%d", getpid());
+
+	/* the child's tokens start over, so they collide with the parent's if its registrations were kept */
+	status = notify_register_check(name, &token);
+	if (status == NOTIFY_STATUS_OPT_DISABLE) return CHILD_DISABLED;
+	if (status != NOTIFY_STATUS_OK) return CHILD_FAILED;
+
+	if (notify_set_state(token, 42) != NOTIFY_STATUS_OK) return CHILD_FAILED;
+	if ((notify_get_state(token, &state) != NOTIFY_STATUS_OK) || (state != 42)) return CHILD_FAILED;
+
+	if (notify_check(token, &check) != NOTIFY_STATUS_OK) return CHILD_FAILED;
+	if (notify_post(name) != NOTIFY_STATUS_OK) return CHILD_FAILED;
+	check = 0;
+	if ((notify_check(token, &check) != NOTIFY_STATUS_OK) || (check != 1)) return CHILD_FAILED;
+
+	if (notify_cancel(token) != NOTIFY_STATUS_OK) return CHILD_FAILED;
+	if (notify_check(token, &check) != NOTIFY_STATUS_INVALID_TOKEN) return CHILD_FAILED;
+
+	return CHILD_OK;
+}
+
+T_DECL(notify_fork,
+       "a fork child registers without finding its parent's registrations",
+       T_META("owner", "Core Darwin Daemons & Tools"))
+{
+	char name[128];
+	int tokens[PARENT_TOKENS];
+	int status;
+	pid_t child;
+
+	for (int i = 0; i < PARENT_TOKENS; i++)
+	{
+		snprintf(name, sizeof(name), "self.com.example.test.fork.parent.%d.%d", getpid(), i);
+		T_QUIET; T_ASSERT_EQ(notify_register_check(name, &tokens[i]), NOTIFY_STATUS_OK, NULL);
+	}
+
+	/* free some, so the free list is not empty at the fork either */
+	for (int i = 0; i < PARENT_TOKENS; i += 2) notify_cancel(tokens[i]);
+
+	child = fork();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(child, "fork");
+	if (child == 0) _exit(child_main());
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(waitpid(child, &status, 0), NULL);
+	T_QUIET; T_ASSERT_TRUE(WIFEXITED(status), "child exited");
+
+	if (WEXITSTATUS(status) == CHILD_DISABLED) T_SKIP("notify is disabled in the fork child of this process");
+	T_EXPECT_EQ(WEXITSTATUS(status), CHILD_OK, "child registered, posted and cancelled");
+
+	for (int i = 1; i < PARENT_TOKENS; i += 2) notify_cancel(tokens[i]);
+}
@@ -0,0 +1,134 @@
+//
+//  notify_hash_benchmark.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "table.c"
+
+static const char *names[] = {
+	"com.apple.system.DirectoryService.InvalidateCache.user",
+	"com.apple.system.DirectoryService.InvalidateCache.group",
+	"com.apple.system.config.network_change",
+	"com.apple.system.timezone",
+	"com.apple.system.lowpowermode",
+	"com.apple.springboard.lockstate",
+	"com.apple.mobile.keybagd.lock_status",
+	"com.apple.notify.test",
+	"self.example.test",
+	"user.uid.501.com.apple.LaunchServices.database",
+};
+
+#define NAME_COUNT (sizeof(names) / sizeof(names[0]))
+#define ITERATIONS 1000000
+
+/* the byte-at-a-time hash table.c used before _nc_string_hash */
+static uint32_t
+one_at_a_time_hash(const char *key)
+{
+	uint32_t hash = 0;
+
+	for (; *key; key++) {
+		hash += (unsigned char)(*key);
+		hash += (hash << 10);
+		hash ^= (hash >> 6);
+	}
+
+	hash += (hash << 3);
+	hash ^= (hash >> 11);
+	hash += (hash << 15);
+
+	return hash;
+}
+
+static double
+to_ns_per_name(uint64_t delta)
+{
+	mach_timebase_info_data_t tbi;
+
+	mach_timebase_info(&tbi);
+	return (double)delta * tbi.numer / tbi.denom / ((double)ITERATIONS * NAME_COUNT);
+}
+
+T_DECL(notify_hash_benchmark,
+       "per-name cost of the table string hash",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	volatile uint64_t sink = 0;
+	size_t lens[NAME_COUNT];
+	uint64_t s, old_time, new_time, strlen_time;
+
+	for (size_t i = 0; i < NAME_COUNT; i++) {
+		lens[i] = strlen(names[i]);
+	}
+
+	s = mach_absolute_time();
+	for (uint32_t j = 0; j < ITERATIONS; j++) {
+		for (size_t i = 0; i < NAME_COUNT; i++) {
+			sink += one_at_a_time_hash(names[i]);
+		}
+	}
+	old_time = mach_absolute_time() - s;
+
+	s = mach_absolute_time();
+	for (uint32_t j = 0; j < ITERATIONS; j++) {
+		for (size_t i = 0; i < NAME_COUNT; i++) {
+			sink += string_hash(names[i]);
+		}
+	}
+	strlen_time = mach_absolute_time() - s;
+
+	s = mach_absolute_time();
+	for (uint32_t j = 0; j < ITERATIONS; j++) {
+		for (size_t i = 0; i < NAME_COUNT; i++) {
+			sink += _nc_string_hash(names[i], lens[i]);
+		}
+	}
+	new_time = mach_absolute_time() - s;
+
+	T_LOG("one-at-a-time:          %.2f ns/name", to_ns_per_name(old_time));
+	T_LOG("_nc_string_hash+strlen: %.2f ns/name", to_ns_per_name(strlen_time));
+	T_LOG("_nc_string_hash:        %.2f ns/name", to_ns_per_name(new_time));
+	T_PASS("hash benchmark done (%llu)", sink);
+}
+
+T_DECL(notify_hash_cached,
+       "tables find names by cached hash and by string",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	struct entry {
+		char *name;
+		uint64_t hash;
+	} entries[NAME_COUNT];
+	table_t t;
+
+	_nc_table_init(&t, offsetof(struct entry, name));
+
+	for (size_t i = 0; i < NAME_COUNT; i++) {
+		entries[i].name = (char *)names[i];
+		entries[i].hash = _nc_string_hash(names[i], strlen(names[i]));
+		_nc_table_insert_hashed(&t, &entries[i].name, entries[i].hash);
+	}
+
+	for (size_t i = 0; i < NAME_COUNT; i++) {
+		T_QUIET; T_EXPECT_EQ_PTR(_nc_table_find(&t, names[i]), (void *)&entries[i], "find %s", names[i]);
+		T_QUIET; T_EXPECT_EQ_PTR(_nc_table_find_hashed(&t, names[i], entries[i].hash), (void *)&entries[i], "find_hashed %s", names[i]);
+	}
+
+	for (size_t i = 0; i < NAME_COUNT; i += 2) {
+		_nc_table_delete_hashed(&t, entries[i].name, entries[i].hash);
+	}
+
+	for (size_t i = 0; i < NAME_COUNT; i++) {
+		void *expected = (i % 2) ? &entries[i] : NULL;
+		T_QUIET; T_EXPECT_EQ_PTR(_nc_table_find(&t, names[i]), expected, "find after delete %s", names[i]);
+	}
+
+	T_PASS("cached hashes agree with string lookups");
+}
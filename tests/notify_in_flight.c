@@ -0,0 +1,213 @@
+//
+//  notify_in_flight.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <mach/mach.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "table.c"
+#include "libnotify.c"
+
+#define TOKENS 3
+#define POSTS 1000
+
+static const char *in_flight_name = "com.example.test.in_flight";
+
+static uint32_t
+queued(mach_port_t port)
+{
+	mach_port_status_t status = {};
+	mach_msg_type_number_t count = MACH_PORT_RECEIVE_STATUS_COUNT;
+
+	mach_port_get_attributes(mach_task_self(), port, MACH_PORT_RECEIVE_STATUS, (mach_port_info_t)&status, &count);
+	return status.mps_msgcount;
+}
+
+/* read everything on the port, counting deliveries per token; returns how many messages asked for an ack */
+static uint32_t
+drain(mach_port_t port, uint32_t *seen)
+{
+	struct {
+		notify_port_batch_msg_t batch;
+		mach_msg_trailer_t trailer;
+	} msg;
+	uint32_t ack_msgs = 0;
+
+	for (;;)
+	{
+		memset(&msg.batch.header, 0, sizeof(mach_msg_header_t));
+		if (mach_msg(&msg.batch.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(msg), port, 0, MACH_PORT_NULL) != KERN_SUCCESS) return ack_msgs;
+
+		if ((msg.batch.header.msgh_id == NOTIFY_PORT_BATCH_MSG_ID) || (msg.batch.header.msgh_id == NOTIFY_PORT_BATCH_ACK_MSG_ID))
+		{
+			if (msg.batch.header.msgh_id == NOTIFY_PORT_BATCH_ACK_MSG_ID) ack_msgs++;
+			for (uint32_t i = 0; i < msg.batch.count; i++) seen[msg.batch.tokens[i]]++;
+		}
+		else
+		{
+			seen[msg.batch.header.msgh_id]++;
+		}
+	}
+}
+
+/* a queue of one message, so a second unread send times out */
+static void
+limit_queue(mach_port_t port)
+{
+	mach_port_limits_t limits = { .mpl_qlimit = 1 };
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mach_port_set_attributes(mach_task_self(), port, MACH_PORT_LIMITS_INFO, (mach_port_info_t)&limits, MACH_PORT_LIMITS_INFO_COUNT), NULL);
+}
+
+static void
+expect_each_once(uint32_t *seen, const char *what)
+{
+	for (int t = 1; t <= TOKENS; t++)
+	{
+		T_EXPECT_EQ_UINT(seen[t], 1u, "token %d delivered once %s", t, what);
+		seen[t] = 0;
+	}
+}
+
+static void
+setup(notify_state_t *ns, uint32_t flags, mach_port_t *port, port_data_t *pd, proc_data_t *proc)
+{
+	uint64_t nid;
+
+	_notify_lib_notify_state_init(ns, flags);
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, port), NULL);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mach_port_insert_right(mach_task_self(), *port, *port, MACH_MSG_TYPE_MAKE_SEND), NULL);
+
+	LIST_INIT(&pd->clients);
+	pd->port = *port;
+	pd->flags = NOTIFY_PORT_FLAG_COMMON;
+	_nc_table_insert_n(&ns->port_table, &pd->port);
+
+	LIST_INIT(&proc->clients);
+	proc->pid = getpid();
+	proc->common_port_data = pd;
+	_nc_table_insert_n(&ns->proc_table, &proc->pid);
+
+	for (int t = 1; t <= TOKENS; t++)
+	{
+		T_QUIET; T_ASSERT_EQ(_notify_lib_register_common_port(ns, in_flight_name, getpid(), t, 0, 0, &nid), NOTIFY_STATUS_OK, NULL);
+	}
+}
+
+T_DECL(notify_in_flight,
+       "a receiver that has fallen behind has at most one message queued per token",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	notify_state_t ns = {};
+	mach_port_t port;
+	port_data_t pd = {};
+	proc_data_t proc = {};
+	uint32_t seen[TOKENS + 1] = {};
+	int tokens[TOKENS];
+
+	setup(&ns, NOTIFY_STATE_BATCH_COMMON_PORT | NOTIFY_STATE_TRACK_IN_FLIGHT, &port, &pd, &proc);
+	limit_queue(port);
+	for (int t = 1; t <= TOKENS; t++) tokens[t - 1] = t;
+
+	/* a receiver that keeps up gets plain messages and is never held back */
+	_notify_lib_post(&ns, in_flight_name, 0, 0);
+	T_EXPECT_EQ_UINT(drain(port, seen), 0u, "no ack asked of a receiver that keeps up");
+	expect_each_once(seen, "while keeping up");
+	_notify_lib_post(&ns, in_flight_name, 0, 0);
+	drain(port, seen);
+	expect_each_once(seen, "again without an ack");
+
+	/* the second unread post times out, so the port is backlogged */
+	_notify_lib_post(&ns, in_flight_name, 0, 0);
+	_notify_lib_post(&ns, in_flight_name, 0, 0);
+	T_EXPECT_TRUE(pd.flags & NOTIFY_PORT_FLAG_BACKLOGGED, "a timed out send marks the port backlogged");
+	drain(port, seen);
+	for (int t = 1; t <= TOKENS; t++) seen[t] = 0;
+
+	/* the receiver is asleep while the name is posted in a tight loop */
+	for (uint32_t i = 0; i < POSTS; i++) _notify_lib_post(&ns, in_flight_name, 0, 0);
+	T_EXPECT_LE_UINT(queued(port), 1u, "one message queued after %d posts", POSTS);
+
+	T_EXPECT_EQ_UINT(drain(port, seen), 1u, "the message asks for an ack");
+	expect_each_once(seen, "while backlogged");
+
+	/* acking the tokens delivers the posts that were held back */
+	_notify_lib_ack(&ns, getpid(), tokens, TOKENS);
+	T_EXPECT_LE_UINT(queued(port), 1u, "one message queued after the ack");
+
+	drain(port, seen);
+	expect_each_once(seen, "after the ack");
+
+	/* nothing was posted since, so another ack sends nothing and ends the backlog */
+	_notify_lib_ack(&ns, getpid(), tokens, TOKENS);
+	T_EXPECT_EQ_UINT(queued(port), 0u, "nothing queued after an idle ack");
+	T_EXPECT_FALSE(pd.flags & NOTIFY_PORT_FLAG_BACKLOGGED, "an idle ack ends the backlog");
+
+	_notify_lib_post(&ns, in_flight_name, 0, 0);
+	T_EXPECT_EQ_UINT(drain(port, seen), 0u, "no ack asked once caught up");
+	expect_each_once(seen, "once caught up");
+
+	for (int t = 1; t <= TOKENS; t++) _notify_lib_cancel(&ns, getpid(), t);
+	mach_port_destruct(mach_task_self(), port, -1, 0);
+}
+
+T_DECL(notify_in_flight_ack_timeout,
+       "a receiver that never acks is not held back past the ack timeout",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	notify_state_t ns = {};
+	mach_port_t port;
+	port_data_t pd = {};
+	proc_data_t proc = {};
+	uint32_t seen[TOKENS + 1] = {};
+
+	setup(&ns, NOTIFY_STATE_BATCH_COMMON_PORT | NOTIFY_STATE_TRACK_IN_FLIGHT, &port, &pd, &proc);
+	limit_queue(port);
+
+	_notify_lib_post(&ns, in_flight_name, 0, 0);
+	_notify_lib_post(&ns, in_flight_name, 0, 0);
+	T_QUIET; T_ASSERT_TRUE(pd.flags & NOTIFY_PORT_FLAG_BACKLOGGED, NULL);
+	drain(port, seen);
+
+	/* the receiver reads the message but never acks it */
+	_notify_lib_post(&ns, in_flight_name, 0, 0);
+	T_QUIET; T_ASSERT_EQ_UINT(drain(port, seen), 1u, NULL);
+	for (int t = 1; t <= TOKENS; t++) seen[t] = 0;
+
+	_notify_lib_post(&ns, in_flight_name, 0, 0);
+	T_EXPECT_EQ_UINT(queued(port), 0u, "a post before the timeout is held back");
+
+	usleep((NOTIFY_ACK_TIMEOUT_MSEC + 100) * USEC_PER_MSEC);
+	_notify_lib_post(&ns, in_flight_name, 0, 0);
+	drain(port, seen);
+	expect_each_once(seen, "after the ack timeout");
+
+	for (int t = 1; t <= TOKENS; t++) _notify_lib_cancel(&ns, getpid(), t);
+	mach_port_destruct(mach_task_self(), port, -1, 0);
+}
+
+T_DECL(notify_in_flight_untracked,
+       "without tracking the same posts fill the port queue",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	notify_state_t ns = {};
+	mach_port_t port;
+	port_data_t pd = {};
+	proc_data_t proc = {};
+
+	setup(&ns, NOTIFY_STATE_BATCH_COMMON_PORT, &port, &pd, &proc);
+
+	for (uint32_t i = 0; i < POSTS; i++) _notify_lib_post(&ns, in_flight_name, 0, 0);
+	T_EXPECT_GT_UINT(queued(port), 1u, "posts pile up in the queue");
+	T_LOG("%u messages queued without tracking", queued(port));
+
+	for (int t = 1; t <= TOKENS; t++) _notify_lib_cancel(&ns, getpid(), t);
+	mach_port_destruct(mach_task_self(), port, -1, 0);
+}
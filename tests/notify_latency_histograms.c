@@ -0,0 +1,84 @@
+//
+//  notify_latency_histograms.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <errno.h>
+#include <notify.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../libnotify.h"
+
+#define POSTS 100
+
+/* the count column of a histogram line in a section of the status dump */
+static unsigned long long
+section_count(const char *path, const char *section, const char *row)
+{
+	char line[512], name[128];
+	unsigned long long count = 0;
+	bool in_section = false;
+	FILE *f = fopen(path, "r");
+
+	if (f == NULL) return 0;
+
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		if (!strncmp(line, "--- ", 4)) in_section = (strstr(line, section) != NULL);
+		else if (in_section && (sscanf(line, "%127s %llu", name, &count) == 2) && !strcmp(name, row)) break;
+		count = 0;
+	}
+
+	fclose(f);
+	return count;
+}
+
+T_DECL(notify_latency_histograms,
+       "the status dump reports handler latency and post fan-out",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META_ASROOT(YES))
+{
+	char name[128];
+	char *status_file;
+	uint64_t state;
+	unsigned long long posts = 0, fanout = 0;
+	int v_token, token;
+	pid_t server_pid;
+
+	T_QUIET; T_ASSERT_EQ(notify_register_check(NOTIFY_IPC_VERSION_NAME, &v_token), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_get_state(v_token, &state), NOTIFY_STATUS_OK, NULL);
+	server_pid = (pid_t)(state >> 32);
+	asprintf(&status_file, "/var/run/notifyd_%u.status", server_pid);
+
+	snprintf(name, sizeof(name), "com.example.test.latency_histograms.%d", getpid());
+	T_ASSERT_EQ(notify_register_check(name, &token), NOTIFY_STATUS_OK, NULL);
+
+	for (uint32_t i = 0; i < POSTS; i++)
+	{
+		T_QUIET; T_ASSERT_EQ(notify_post(name), NOTIFY_STATUS_OK, NULL);
+	}
+
+	/* posts are asynchronous, keep asking for a dump for up to a second */
+	for (uint32_t tries = 0; (tries < 10) && (posts < (POSTS - 2)); tries++)
+	{
+		unlink(status_file);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(kill(server_pid, SIGUSR1), "signal notifyd");
+		usleep(100000);
+
+		posts = section_count(status_file, "LATENCY", "_notify_server_post_3");
+		fanout = section_count(status_file, "FAN-OUT", "post");
+	}
+
+	/* the first two posts of a name go by name, to fetch its name ID */
+	T_EXPECT_GE_ULLONG(posts, (unsigned long long)(POSTS - 2), "post by name ID latency has the posts");
+	T_EXPECT_GE_ULLONG(fanout, (unsigned long long)POSTS, "fan-out has every post");
+
+	unlink(status_file);
+	free(status_file);
+	notify_cancel(token);
+	notify_cancel(v_token);
+}
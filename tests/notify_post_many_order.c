@@ -0,0 +1,77 @@
+//
+//  notify_post_many_order.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <mach/mach.h>
+#include <notify.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NAMES 8
+#define ROUNDS 4
+
+/* the next token delivered to the port, or -1 if nothing arrives within a second */
+static int
+next_token(mach_port_t port)
+{
+	mach_msg_empty_rcv_t msg;
+
+	memset(&msg, 0, sizeof(msg));
+	if (mach_msg(&msg.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(msg), port, 1000, MACH_PORT_NULL) != KERN_SUCCESS) return -1;
+	return msg.header.msgh_id;
+}
+
+T_DECL(notify_post_many_order,
+       "notify_post_many posts its names in the order given, however each one is sent",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	char storage[NAMES][128];
+	const char *names[NAMES];
+	int tokens[NAMES];
+	mach_port_t port = MACH_PORT_NULL;
+
+	for (int i = 0; i < NAMES; i++)
+	{
+		snprintf(storage[i], sizeof(storage[i]), "com.example.test.post_many_order.%d.%d", getpid(), i);
+		names[i] = storage[i];
+		T_QUIET; T_ASSERT_EQ(notify_register_mach_port(names[i], &port, (i == 0) ? 0 : NOTIFY_REUSE, &tokens[i]), NOTIFY_STATUS_OK, NULL);
+	}
+
+	/*
+	 * Posting some names beforehand leaves them cold, posted once, or with
+	 * a known name ID, so one call mixes strings, IDs and names posted on
+	 * their own.  Every post moves a name along, so each round sees a
+	 * different mix.
+	 */
+	for (int i = 0; i < NAMES; i++)
+	{
+		for (int j = 0; j < i % 3; j++)
+		{
+			T_QUIET; T_ASSERT_EQ(notify_post(names[i]), NOTIFY_STATUS_OK, NULL);
+		}
+	}
+	for (int i = 0; i < NAMES; i++)
+	{
+		for (int j = 0; j < i % 3; j++)
+		{
+			T_QUIET; T_ASSERT_EQ(next_token(port), tokens[i], NULL);
+		}
+	}
+
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		T_QUIET; T_ASSERT_EQ(notify_post_many(names, NAMES), NOTIFY_STATUS_OK, NULL);
+
+		for (int i = 0; i < NAMES; i++)
+		{
+			T_EXPECT_EQ(next_token(port), tokens[i], "round %d: %s delivered in order", round, names[i]);
+		}
+	}
+
+	for (int i = 0; i < NAMES; i++) notify_cancel(tokens[i]);
+	mach_port_deallocate(mach_task_self(), port);
+}
@@ -0,0 +1,117 @@
+//
+//  notify_regenerate_many.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <notify.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../libnotify.h"
+
+/* enough registrations for more than one regenerate buffer */
+#define REGISTRATIONS 8000
+#define NAMES 100
+#define CHILD_STATE 24301ULL
+#define CHILD_STATE_STRING "24301"
+
+extern char **environ;
+
+T_DECL(notify_regenerate_many,
+       "registrations and name state come back in bulk after notifyd is killed",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META_ASROOT(YES))
+{
+	char name[128], child_name[128];
+	char *argv[] = { "notifyutil", "-s", child_name, CHILD_STATE_STRING, NULL };
+	int *tokens, v_token, c_token, check;
+	uint64_t state;
+	pid_t old_pid, new_pid, child;
+	int child_status;
+	uint32_t bad = 0;
+
+	T_QUIET; T_ASSERT_EQ(notify_register_check(NOTIFY_IPC_VERSION_NAME, &v_token), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_get_state(v_token, &state), NOTIFY_STATUS_OK, NULL);
+	old_pid = (pid_t)(state >> 32);
+
+	tokens = calloc(REGISTRATIONS, sizeof(int));
+	T_QUIET; T_ASSERT_NOTNULL(tokens, NULL);
+
+	for (uint32_t i = 0; i < REGISTRATIONS; i++)
+	{
+		snprintf(name, sizeof(name), "com.example.test.regenerate_many.%d.%u", getpid(), i % NAMES);
+		T_QUIET; T_ASSERT_EQ(notify_register_check(name, &tokens[i]), NOTIFY_STATUS_OK, NULL);
+	}
+
+	for (uint32_t i = 0; i < NAMES; i++)
+	{
+		T_QUIET; T_ASSERT_EQ(notify_set_state(tokens[i], i + 1), NOTIFY_STATUS_OK, NULL);
+	}
+
+	/* state set by a process that is gone by the time notifyd restarts only survives in the journal */
+	snprintf(child_name, sizeof(child_name), "com.example.test.regenerate_many.%d.child", getpid());
+	T_QUIET; T_ASSERT_EQ(notify_register_check(child_name, &c_token), NOTIFY_STATUS_OK, NULL);
+
+	/* a fork child of a process that has talked to notifyd has notify disabled, so the setter is spawned */
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn(&child, "/usr/bin/notifyutil", NULL, NULL, argv, environ), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(waitpid(child, &child_status, 0), NULL);
+	T_QUIET; T_ASSERT_EQ(notify_get_state(c_token, &state), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ_ULLONG(state, CHILD_STATE, "child set the state");
+
+	T_ASSERT_POSIX_SUCCESS(kill(old_pid, SIGKILL), "kill notifyd");
+
+	/* the old notifyd is gone once its pid can't be signalled */
+	for (int i = 0; (i < 100) && (kill(old_pid, 0) == 0); i++) usleep(10000);
+	T_QUIET; T_ASSERT_EQ(kill(old_pid, 0), -1, "old notifyd exited");
+
+	/* the new notifyd sets the ipc version name's pid from init_config, not from the journal */
+	new_pid = old_pid;
+	for (int i = 0; (i < 100) && (new_pid == old_pid); i++)
+	{
+		usleep(100000);
+		state = 0;
+		if (notify_get_state(v_token, &state) == NOTIFY_STATUS_OK) new_pid = (pid_t)(state >> 32);
+	}
+	T_ASSERT_NE(old_pid, new_pid, "notifyd restarted");
+	T_ASSERT_NE(new_pid, 0, "notifyd restarted");
+
+	for (uint32_t i = 0; i < NAMES; i++)
+	{
+		snprintf(name, sizeof(name), "com.example.test.regenerate_many.%d.%u", getpid(), i);
+		T_QUIET; T_ASSERT_EQ(notify_post(name), NOTIFY_STATUS_OK, NULL);
+	}
+
+	/* posts are asynchronous, the last registration of the last name is checked until it sees its post */
+	check = 0;
+	for (int i = 0; (i < 1000) && (check == 0); i++)
+	{
+		T_QUIET; T_ASSERT_EQ(notify_check(tokens[REGISTRATIONS - 1], &check), NOTIFY_STATUS_OK, NULL);
+		if (check == 0) usleep(1000);
+	}
+
+	for (uint32_t i = 0; i < REGISTRATIONS; i++)
+	{
+		check = 0;
+		if ((notify_check(tokens[i], &check) != NOTIFY_STATUS_OK) || ((i != (REGISTRATIONS - 1)) && (check == 0))) bad++;
+	}
+	T_EXPECT_EQ_UINT(bad, 0u, "every registration sees posts after the restart");
+
+	bad = 0;
+	for (uint32_t i = 0; i < NAMES; i++)
+	{
+		if ((notify_get_state(tokens[i], &state) != NOTIFY_STATUS_OK) || (state != (i + 1))) bad++;
+	}
+	T_EXPECT_EQ_UINT(bad, 0u, "names keep the state this process set");
+
+	T_ASSERT_EQ(notify_get_state(c_token, &state), NOTIFY_STATUS_OK, NULL);
+	T_EXPECT_EQ_ULLONG(state, CHILD_STATE, "name keeps the state an exited process set");
+
+	for (uint32_t i = 0; i < REGISTRATIONS; i++) notify_cancel(tokens[i]);
+	notify_cancel(c_token);
+	notify_cancel(v_token);
+	free(tokens);
+}
@@ -0,0 +1,64 @@
+//
+//  notify_shm_growth.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <notify.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* enough to run past the first segment even with other clients around */
+#define SEGMENTS 3
+
+T_DECL(notify_shm_growth,
+       "check registrations past the first shared memory segment keep their own slot",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	uint32_t count = SEGMENTS * (getpagesize() / sizeof(uint32_t));
+	int *tokens = calloc(count, sizeof(int));
+	char name[128];
+	int check;
+
+	T_QUIET; T_ASSERT_NOTNULL(tokens, NULL);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		snprintf(name, sizeof(name), "com.example.test.shm_growth.%d.%u", getpid(), i);
+		T_QUIET; T_ASSERT_EQ(notify_register_check(name, &tokens[i]), NOTIFY_STATUS_OK, NULL);
+
+		/* the first check after registering always reports a change */
+		T_QUIET; T_ASSERT_EQ(notify_check(tokens[i], &check), NOTIFY_STATUS_OK, NULL);
+	}
+
+	/* post every 97th name, its neighbours must not see it */
+	for (uint32_t i = 1; i + 1 < count; i += 97)
+	{
+		snprintf(name, sizeof(name), "com.example.test.shm_growth.%d.%u", getpid(), i);
+		T_QUIET; T_ASSERT_EQ(notify_post(name), NOTIFY_STATUS_OK, NULL);
+
+		/* posts are asynchronous, give notifyd up to a second */
+		check = 0;
+		for (uint32_t tries = 0; (check == 0) && (tries < 1000); tries++)
+		{
+			T_QUIET; T_ASSERT_EQ(notify_check(tokens[i], &check), NOTIFY_STATUS_OK, NULL);
+			if (check == 0) usleep(1000);
+		}
+		T_QUIET; T_EXPECT_EQ(check, 1, "token %u saw its post", i);
+
+		T_QUIET; T_ASSERT_EQ(notify_check(tokens[i - 1], &check), NOTIFY_STATUS_OK, NULL);
+		T_QUIET; T_EXPECT_EQ(check, 0, "token %u did not see its neighbour's post", i - 1);
+		T_QUIET; T_ASSERT_EQ(notify_check(tokens[i + 1], &check), NOTIFY_STATUS_OK, NULL);
+		T_QUIET; T_EXPECT_EQ(check, 0, "token %u did not see its neighbour's post", i + 1);
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		notify_cancel(tokens[i]);
+	}
+	free(tokens);
+
+	T_PASS("%u check registrations across %u segments", count, SEGMENTS);
+}
@@ -0,0 +1,69 @@
+//
+//  notify_slot_release.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <notify.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* posts are asynchronous, give notifyd up to a second */
+static int
+wait_check(int token)
+{
+	int check = 0;
+
+	for (uint32_t tries = 0; (check == 0) && (tries < 1000); tries++)
+	{
+		T_QUIET; T_ASSERT_EQ(notify_check(token, &check), NOTIFY_STATUS_OK, NULL);
+		if (check == 0) usleep(1000);
+	}
+
+	return check;
+}
+
+T_DECL(notify_slot_release,
+       "a name gives its slot back with its last check registration, and posts to it no longer reach the slot",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	char name_a[128], name_b[128], name_c[128];
+	int a1, a2, b, c, check;
+
+	snprintf(name_a, sizeof(name_a), "com.example.test.slot_release.%d.a", getpid());
+	snprintf(name_b, sizeof(name_b), "com.example.test.slot_release.%d.b", getpid());
+	snprintf(name_c, sizeof(name_c), "com.example.test.slot_release.%d.c", getpid());
+
+	/* the first check after registering always reports a change */
+	T_QUIET; T_ASSERT_EQ(notify_register_check(name_a, &a1), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_check(a1, &check), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_register_check(name_a, &a2), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_check(a2, &check), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_register_check(name_c, &c), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_check(c, &check), NOTIFY_STATUS_OK, NULL);
+
+	/* the name keeps its slot while one registration is left */
+	T_QUIET; T_ASSERT_EQ(notify_cancel(a1), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_post(name_a), NOTIFY_STATUS_OK, NULL);
+	T_EXPECT_EQ(wait_check(a2), 1, "the remaining registration sees the post");
+
+	/* the slot is free now, and may well be the one the next name gets */
+	T_QUIET; T_ASSERT_EQ(notify_cancel(a2), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_register_check(name_b, &b), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_check(b, &check), NOTIFY_STATUS_OK, NULL);
+
+	/* notifyd handles posts in order, so once c sees its post the post to a has been handled */
+	T_QUIET; T_ASSERT_EQ(notify_post(name_a), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_post(name_c), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(wait_check(c), 1, NULL);
+
+	T_QUIET; T_ASSERT_EQ(notify_check(b, &check), NOTIFY_STATUS_OK, NULL);
+	T_EXPECT_EQ(check, 0, "a post to the first name does not reach the second name's slot");
+
+	T_QUIET; T_ASSERT_EQ(notify_post(name_b), NOTIFY_STATUS_OK, NULL);
+	T_EXPECT_EQ(wait_check(b), 1, "the second name sees its own post");
+
+	notify_cancel(b);
+	notify_cancel(c);
+}
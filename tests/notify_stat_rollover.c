@@ -0,0 +1,84 @@
+//
+//  notify_stat_rollover.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "table.c"
+#include "libnotify.c"
+
+#define NAMES 64
+#define HOURS 20
+
+/* the counts the old hourly walk of the name table kept */
+typedef struct
+{
+	uint32_t postcount;
+	uint32_t last_hour_postcount;
+} eager_counts_t;
+
+T_DECL(notify_stat_rollover,
+       "lazily rolled post counts match a walk of every name each hour",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	notify_state_t ns = {};
+	name_info_t *names[NAMES];
+	eager_counts_t eager[NAMES] = {};
+	char name[64];
+	uint64_t nid;
+
+	_notify_lib_notify_state_init(&ns, 0);
+	srandom(1);
+
+	for (uint32_t i = 0; i < NAMES; i++)
+	{
+		snprintf(name, sizeof(name), "com.example.test.stat_rollover.%u", i);
+		T_QUIET; T_ASSERT_EQ(_notify_lib_register_plain(&ns, name, -1, i, SLOT_NONE, 0, 0, &nid), NOTIFY_STATUS_OK, NULL);
+		names[i] = _nc_table_find_64(&ns.name_id_table, nid);
+		T_QUIET; T_ASSERT_NOTNULL(names[i], NULL);
+	}
+
+	for (uint32_t hour = 0; hour < HOURS; hour++)
+	{
+		/* some names are posted every hour, some now and then, some skip several hours */
+		for (uint32_t i = 0; i < NAMES; i++)
+		{
+			uint32_t posts = ((random() % ((i % 4) + 1)) == 0) ? (uint32_t)(random() % 4) : 0;
+
+			for (uint32_t p = 0; p < posts; p++)
+			{
+				_notify_lib_name_posted(&ns, names[i]);
+				eager[i].postcount++;
+			}
+		}
+
+		/* only some names are read, the rest catch up later */
+		for (uint32_t i = hour % 3; i < NAMES; i += 3)
+		{
+			_notify_lib_name_stats(&ns, names[i]);
+			T_QUIET; T_EXPECT_EQ_UINT(names[i]->postcount, eager[i].postcount, "hour %u name %u postcount", hour, i);
+			T_QUIET; T_EXPECT_EQ_UINT(names[i]->last_hour_postcount, eager[i].last_hour_postcount, "hour %u name %u last hour", hour, i);
+		}
+
+		_notify_lib_stats_reset(&ns);
+		for (uint32_t i = 0; i < NAMES; i++)
+		{
+			eager[i].last_hour_postcount = eager[i].postcount;
+			eager[i].postcount = 0;
+		}
+	}
+
+	for (uint32_t i = 0; i < NAMES; i++)
+	{
+		_notify_lib_name_stats(&ns, names[i]);
+		T_QUIET; T_EXPECT_EQ_UINT(names[i]->postcount, eager[i].postcount, "name %u postcount", i);
+		T_QUIET; T_EXPECT_EQ_UINT(names[i]->last_hour_postcount, eager[i].last_hour_postcount, "name %u last hour", i);
+		_notify_lib_cancel(&ns, -1, i);
+	}
+
+	T_PASS("%d names agree over %d hours", NAMES, HOURS);
+}
@@ -0,0 +1,132 @@
+//
+//  notify_state_shm.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <mach/mach.h>
+#include <notify.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define ROUNDS 10000
+#define OTHER_STATE 31337ULL
+#define OTHER_STATE_STRING "31337"
+
+extern char **environ;
+
+static uint64_t
+messages_sent(void)
+{
+	task_events_info_data_t info = {};
+	mach_msg_type_number_t count = TASK_EVENTS_INFO_COUNT;
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(task_info(mach_task_self(), TASK_EVENTS_INFO, (task_info_t)&info, &count), NULL);
+	return (uint64_t)info.messages_sent;
+}
+
+T_DECL(notify_state_shm,
+       "notify_get_state on check tokens sees every notify_set_state",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	int check_token, set_token;
+	uint64_t state;
+	char name[128];
+
+	snprintf(name, sizeof(name), "com.example.test.state_shm.%d", getpid());
+
+	T_ASSERT_EQ(notify_register_check(name, &check_token), NOTIFY_STATUS_OK, NULL);
+	T_ASSERT_EQ(notify_register_check(name, &set_token), NOTIFY_STATUS_OK, NULL);
+
+	T_ASSERT_EQ(notify_get_state(check_token, &state), NOTIFY_STATUS_OK, NULL);
+	T_EXPECT_EQ_ULLONG(state, 0ULL, "state starts at zero");
+
+	/* sets are asynchronous; reads from this process must still see them */
+	for (uint64_t i = 1; i <= ROUNDS; i++)
+	{
+		T_QUIET; T_ASSERT_EQ(notify_set_state(set_token, i), NOTIFY_STATUS_OK, NULL);
+		T_QUIET; T_ASSERT_EQ(notify_get_state(check_token, &state), NOTIFY_STATUS_OK, NULL);
+		T_QUIET; T_ASSERT_EQ_ULLONG(state, i, "get after set %llu", i);
+		T_QUIET; T_ASSERT_EQ(notify_get_state(check_token, &state), NOTIFY_STATUS_OK, NULL);
+		T_QUIET; T_ASSERT_EQ_ULLONG(state, i, "second get after set %llu", i);
+	}
+
+	notify_cancel(check_token);
+	notify_cancel(set_token);
+
+	T_PASS("state reads agree with %d sets", ROUNDS);
+}
+
+T_DECL(notify_state_shm_other_process,
+       "notify_get_state reads a state set by another process from shared memory, without IPC",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	char name[128];
+	char *argv[] = { "notifyutil", "-s", name, OTHER_STATE_STRING, NULL };
+	int token, child_status;
+	uint64_t state = 0, sent;
+	pid_t child;
+
+	snprintf(name, sizeof(name), "com.example.test.state_shm.other.%d", getpid());
+
+	/* the first get goes to notifyd, and tells this process the name's ID */
+	T_QUIET; T_ASSERT_EQ(notify_register_check(name, &token), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_get_state(token, &state), NOTIFY_STATUS_OK, NULL);
+
+	/* a fork child of a process that has talked to notifyd has notify disabled, so the setter is spawned */
+	T_QUIET; T_ASSERT_POSIX_ZERO(posix_spawn(&child, "/usr/bin/notifyutil", NULL, NULL, argv, environ), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(waitpid(child, &child_status, 0), NULL);
+	T_QUIET; T_ASSERT_TRUE(WIFEXITED(child_status) && (WEXITSTATUS(child_status) == 0), "notifyutil -s");
+
+	/* sets are asynchronous, give notifyd up to a second */
+	for (uint32_t tries = 0; (tries < 1000) && (state != OTHER_STATE); tries++)
+	{
+		T_QUIET; T_ASSERT_EQ(notify_get_state(token, &state), NOTIFY_STATUS_OK, NULL);
+		if (state != OTHER_STATE) usleep(1000);
+	}
+	T_ASSERT_EQ_ULLONG(state, OTHER_STATE, "the other process's set is seen");
+
+	sent = messages_sent();
+	for (uint32_t i = 0; i < ROUNDS; i++)
+	{
+		T_QUIET; T_ASSERT_EQ(notify_get_state(token, &state), NOTIFY_STATUS_OK, NULL);
+		T_QUIET; T_ASSERT_EQ_ULLONG(state, OTHER_STATE, NULL);
+	}
+	T_EXPECT_EQ_ULLONG(messages_sent() - sent, 0ULL, "%d gets sent no messages", ROUNDS);
+
+	notify_cancel(token);
+}
+
+T_DECL(notify_state_shm_restricted,
+       "notify_get_state on a user.uid. name asks notifyd rather than reading shared memory",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	char name[128];
+	int token;
+	uint64_t state, sent;
+
+	snprintf(name, sizeof(name), "user.uid.%d.com.example.test.state_shm.%d", getuid(), getpid());
+
+	T_QUIET; T_ASSERT_EQ(notify_register_check(name, &token), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_set_state(token, OTHER_STATE), NOTIFY_STATUS_OK, NULL);
+
+	/* once a get has seen this process's set, only the name's restriction keeps it off shared memory */
+	T_QUIET; T_ASSERT_EQ(notify_get_state(token, &state), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ_ULLONG(state, OTHER_STATE, NULL);
+
+	for (uint32_t i = 0; i < 10; i++)
+	{
+		sent = messages_sent();
+		T_QUIET; T_ASSERT_EQ(notify_get_state(token, &state), NOTIFY_STATUS_OK, NULL);
+		T_QUIET; T_EXPECT_GT_ULLONG(messages_sent() - sent, 0ULL, "get %u went to notifyd", i);
+		T_QUIET; T_ASSERT_EQ_ULLONG(state, OTHER_STATE, NULL);
+	}
+
+	notify_cancel(token);
+	T_PASS("gets of a restricted name went to notifyd");
+}
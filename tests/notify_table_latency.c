@@ -0,0 +1,90 @@
+//
+//  notify_table_latency.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+
+#include "table.c"
+
+#define STORM_CLIENTS 500000
+
+/* generous enough for loaded test machines, far below a full rehash */
+#define STORM_P999_BOUND_NS (50 * NSEC_PER_USEC)
+
+/*
+ * Inserts that grow a table holding at least this many entries.  Moving
+ * all of them at once takes hundreds of microseconds, which is what the
+ * incremental resize is there to avoid.
+ */
+#define STORM_LARGE_RESIZE_COUNT 65536
+#define STORM_RESIZE_BOUND_NS (50 * NSEC_PER_USEC)
+
+static uint64_t client_ids[STORM_CLIENTS];
+static uint64_t insert_latency[STORM_CLIENTS];
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	const uint64_t l = *(const uint64_t *)a;
+	const uint64_t r = *(const uint64_t *)b;
+	return l == r ? 0 : (l < r ? -1 : 1);
+}
+
+T_DECL(notify_table_insert_latency,
+       "client table insert latency stays bounded under a registration storm",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	mach_timebase_info_data_t tbi;
+	table_64_t client_table;
+	uint64_t s, p999, max, resize_min = UINT64_MAX;
+	uint32_t size, resizes = 0;
+
+	mach_timebase_info(&tbi);
+	_nc_table_init_64(&client_table, 0);
+
+	/* same shape as make_client_id(pid, token) */
+	for (uint32_t i = 0; i < STORM_CLIENTS; i++) {
+		client_ids[i] = ((uint64_t)(100 + i % 1000) << 32) | i;
+	}
+
+	for (uint32_t i = 0; i < STORM_CLIENTS; i++) {
+		size = client_table.size;
+		s = mach_absolute_time();
+		_nc_table_insert_64(&client_table, &client_ids[i]);
+		insert_latency[i] = mach_absolute_time() - s;
+
+		if ((client_table.size != size) && (i >= STORM_LARGE_RESIZE_COUNT)) {
+			resizes++;
+			if (insert_latency[i] < resize_min) resize_min = insert_latency[i];
+		}
+	}
+
+	for (uint32_t i = 0; i < STORM_CLIENTS; i++) {
+		if (_nc_table_find_64(&client_table, client_ids[i]) != &client_ids[i]) {
+			T_FAIL("client %u missing after the storm", i);
+		}
+	}
+
+	qsort(insert_latency, STORM_CLIENTS, sizeof(uint64_t), compare_u64);
+	p999 = insert_latency[(uint64_t)STORM_CLIENTS * 999 / 1000] * tbi.numer / tbi.denom;
+	max = insert_latency[STORM_CLIENTS - 1] * tbi.numer / tbi.denom;
+
+	T_LOG("insert latency p50 %llu ns, p99.9 %llu ns, max %llu ns",
+	      insert_latency[STORM_CLIENTS / 2] * tbi.numer / tbi.denom, p999, max);
+	T_EXPECT_LE_ULLONG(p999, (uint64_t)STORM_P999_BOUND_NS, "p99.9 insert latency is bounded");
+
+	/* preemption only makes an insert slower, so the fastest large resize is what the table itself costs */
+	T_QUIET; T_ASSERT_GT_UINT(resizes, 0u, "the storm grows a large table");
+	resize_min = resize_min * tbi.numer / tbi.denom;
+	T_LOG("%u inserts grew a table of %u or more entries, fastest %llu ns", resizes, STORM_LARGE_RESIZE_COUNT, resize_min);
+	T_EXPECT_LE_ULLONG(resize_min, (uint64_t)STORM_RESIZE_BOUND_NS, "an insert that grows a large table does not move it all at once");
+
+	for (uint32_t i = 0; i < STORM_CLIENTS; i++) {
+		_nc_table_delete_64(&client_table, client_ids[i]);
+	}
+	T_EXPECT_EQ_UINT(client_table.count, 0u, "table is empty after cancelling every client");
+}
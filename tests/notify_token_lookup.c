@@ -0,0 +1,134 @@
+//
+//  notify_token_lookup.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <dispatch/dispatch.h>
+#include <mach/mach_time.h>
+#include <notify.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/sysctl.h>
+
+#define TOKENS_PER_THREAD 64
+#define LOOKUPS_PER_THREAD 2000000
+#define MAX_THREADS 64
+
+static int tokens[MAX_THREADS][TOKENS_PER_THREAD];
+
+static uint32_t
+ncpu(void)
+{
+	int n = 1;
+	size_t len = sizeof(n);
+
+	sysctlbyname("hw.activecpu", &n, &len, NULL, 0);
+	if (n > MAX_THREADS) n = MAX_THREADS;
+	return (uint32_t)n;
+}
+
+T_DECL(notify_token_lookup_stress,
+       "token lookups stay correct while other threads register and cancel",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	uint32_t threads = ncpu();
+	dispatch_queue_t q = dispatch_queue_create("notify_token_lookup", NULL);
+	static atomic_bool done;
+	static atomic_uint failures;
+
+	atomic_store(&done, false);
+	atomic_store(&failures, 0);
+
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		for (uint32_t i = 0; i < TOKENS_PER_THREAD; i++)
+		{
+			T_QUIET; T_ASSERT_EQ(notify_register_check("com.example.test.lookup", &tokens[t][i]), NOTIFY_STATUS_OK, NULL);
+		}
+	}
+
+	/* churn: register and cancel in the background, as parallel_register_cancel does */
+	dispatch_group_t churn = dispatch_group_create();
+	dispatch_group_async(churn, dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0), ^{
+		dispatch_apply(threads, DISPATCH_APPLY_AUTO, ^(size_t t) {
+			int token;
+			while (!atomic_load(&done))
+			{
+				if (notify_register_dispatch("com.example.test.lookup.churn", &token, q, ^(int x){}) != NOTIFY_STATUS_OK) atomic_fetch_add(&failures, 1);
+				if (!notify_is_valid_token(token)) atomic_fetch_add(&failures, 1);
+				if (notify_cancel(token) != NOTIFY_STATUS_OK) atomic_fetch_add(&failures, 1);
+			}
+		});
+	});
+
+	dispatch_apply(threads, DISPATCH_APPLY_AUTO, ^(size_t t) {
+		int check;
+		for (uint32_t i = 0; i < LOOKUPS_PER_THREAD / 10; i++)
+		{
+			int token = tokens[t][i % TOKENS_PER_THREAD];
+			if (!notify_is_valid_token(token)) atomic_fetch_add(&failures, 1);
+			if (notify_check(token, &check) != NOTIFY_STATUS_OK) atomic_fetch_add(&failures, 1);
+		}
+	});
+
+	atomic_store(&done, true);
+	dispatch_group_wait(churn, DISPATCH_TIME_FOREVER);
+
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		for (uint32_t i = 0; i < TOKENS_PER_THREAD; i++)
+		{
+			notify_cancel(tokens[t][i]);
+		}
+	}
+
+	T_EXPECT_EQ_UINT(atomic_load(&failures), 0u, "no lookup saw a wrong answer");
+}
+
+T_DECL(notify_token_lookup_scaling,
+       "token lookup throughput as threads are added",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	uint32_t threads = ncpu();
+	mach_timebase_info_data_t tbi;
+	double single = 0;
+
+	mach_timebase_info(&tbi);
+
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		for (uint32_t i = 0; i < TOKENS_PER_THREAD; i++)
+		{
+			T_QUIET; T_ASSERT_EQ(notify_register_check("com.example.test.lookup", &tokens[t][i]), NOTIFY_STATUS_OK, NULL);
+		}
+	}
+
+	for (uint32_t n = 1; n <= threads; n *= 2)
+	{
+		uint64_t s = mach_absolute_time();
+		dispatch_apply(n, DISPATCH_APPLY_AUTO, ^(size_t t) {
+			for (uint32_t i = 0; i < LOOKUPS_PER_THREAD; i++)
+			{
+				(void)notify_is_valid_token(tokens[t][i % TOKENS_PER_THREAD]);
+			}
+		});
+		uint64_t ns = (mach_absolute_time() - s) * tbi.numer / tbi.denom;
+
+		double rate = (double)n * LOOKUPS_PER_THREAD / ((double)ns / NSEC_PER_SEC);
+		if (n == 1) single = rate;
+		T_LOG("%2u threads: %.1f M lookups/s (%.2fx one thread)", n, rate / 1e6, rate / single);
+	}
+
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		for (uint32_t i = 0; i < TOKENS_PER_THREAD; i++)
+		{
+			notify_cancel(tokens[t][i]);
+		}
+	}
+
+	T_PASS("token lookup scaling done");
+}
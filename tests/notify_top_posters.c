@@ -0,0 +1,83 @@
+//
+//  notify_top_posters.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <errno.h>
+#include <notify.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../libnotify.h"
+
+#define POSTS 5000
+
+/* does the TOP POSTERS section of a status dump mention needle? */
+static bool
+report_mentions(const char *path, const char *needle)
+{
+	char line[512];
+	bool in_report = false, found = false;
+	FILE *f = fopen(path, "r");
+
+	if (f == NULL) return false;
+
+	while (!found && (fgets(line, sizeof(line), f) != NULL))
+	{
+		if (!strncmp(line, "--- ", 4)) in_report = (strstr(line, "TOP POSTERS") != NULL);
+		else if (in_report && (strstr(line, needle) != NULL)) found = true;
+	}
+
+	fclose(f);
+	return found;
+}
+
+T_DECL(notify_top_posters,
+       "a name posted in a storm shows up in the status dump's top posters",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META_ASROOT(YES))
+{
+	char name[128], pid_label[32];
+	char *status_file;
+	uint64_t state;
+	bool name_found = false, pid_found = false;
+	int v_token, token;
+	pid_t server_pid;
+
+	T_QUIET; T_ASSERT_EQ(notify_register_check(NOTIFY_IPC_VERSION_NAME, &v_token), NOTIFY_STATUS_OK, NULL);
+	T_QUIET; T_ASSERT_EQ(notify_get_state(v_token, &state), NOTIFY_STATUS_OK, NULL);
+	server_pid = (pid_t)(state >> 32);
+	asprintf(&status_file, "/var/run/notifyd_%u.status", server_pid);
+
+	/* a registration gives the name a name ID, so posts after the first go by ID */
+	snprintf(name, sizeof(name), "com.example.test.top_posters.%d", getpid());
+	snprintf(pid_label, sizeof(pid_label), " %d (", getpid());
+	T_ASSERT_EQ(notify_register_check(name, &token), NOTIFY_STATUS_OK, NULL);
+
+	for (uint32_t i = 0; i < POSTS; i++)
+	{
+		T_QUIET; T_ASSERT_EQ(notify_post(name), NOTIFY_STATUS_OK, NULL);
+	}
+
+	/* posts are asynchronous, keep asking for a dump for up to a second */
+	for (uint32_t tries = 0; (tries < 10) && !(name_found && pid_found); tries++)
+	{
+		unlink(status_file);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(kill(server_pid, SIGUSR1), "signal notifyd");
+		usleep(100000);
+
+		name_found = report_mentions(status_file, name);
+		pid_found = report_mentions(status_file, pid_label);
+	}
+
+	T_EXPECT_TRUE(name_found, "%s is a top poster", name);
+	T_EXPECT_TRUE(pid_found, "pid %d is a top poster", getpid());
+
+	unlink(status_file);
+	free(status_file);
+	notify_cancel(token);
+	notify_cancel(v_token);
+}
@@ -0,0 +1,124 @@
+//
+//  notify_user_uid.c
+//  Libnotify
+//
+
+#include <darwintest.h>
+#include <mach/mach_time.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "notify_internal.h"
+
+#define ITERATIONS 1000000
+
+/* the formatted-print check _notify_user_uid_name replaced */
+static bool
+snprintf_allowed(const char *name, uid_t uid)
+{
+	char str[64];
+	size_t len;
+
+	snprintf(str, sizeof(str) - 1, "%s%d", USER_PROTECTED_UID_PREFIX, uid);
+	len = strlen(str);
+
+	return ((!strncmp(name, str, len)) && ((name[len] == '\0') || (name[len] == '.')));
+}
+
+static bool
+parsed_allowed(const char *name, uid_t uid)
+{
+	bool allowed;
+
+	if (!_notify_user_uid_name(name, uid, &allowed)) return true;
+	return allowed;
+}
+
+T_DECL(notify_user_uid_boundaries,
+       "user.uid. names match their owner exactly",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	static const struct {
+		const char *name;
+		uid_t uid;
+		bool allowed;
+	} cases[] = {
+		{ "user.uid.10", 10, true },
+		{ "user.uid.10", 100, false },
+		{ "user.uid.100", 10, false },
+		{ "user.uid.100", 100, true },
+		{ "user.uid.10.foo", 10, true },
+		{ "user.uid.100.foo", 10, false },
+		{ "user.uid.10.foo", 100, false },
+		{ "user.uid.10foo", 10, false },
+		{ "user.uid.010", 10, false },
+		{ "user.uid.0", 0, true },
+		{ "user.uid.00", 0, false },
+		{ "user.uid.", 501, false },
+		{ "user.uid..", 501, false },
+		{ "user.uid.-2", 4294967294u, true },
+		{ "user.uid.-0", 0, false },
+		{ "user.uid.4294967294", 4294967294u, false },
+		{ "user.uid.2147483647", 2147483647u, true },
+		{ "user.uid.-2147483648", 2147483648u, true },
+		{ "user.uid.2147483648", 2147483648u, false },
+		{ "user.uid.99999999999999999999", 501, false },
+	};
+	const char *suffixes[] = { "", ".", ".a.b", "x", "0", "9" };
+	char name[128];
+	bool allowed;
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		T_EXPECT_TRUE(_notify_user_uid_name(cases[i].name, cases[i].uid, &allowed), "%s is user-protected", cases[i].name);
+		T_EXPECT_EQ_INT((int)allowed, (int)cases[i].allowed, "%s for uid %u", cases[i].name, cases[i].uid);
+	}
+
+	T_EXPECT_FALSE(_notify_user_uid_name("user.uix.501", 501, &allowed), "other names are not user-protected");
+	T_EXPECT_FALSE(_notify_user_uid_name("com.apple.user.uid.501", 501, &allowed), "only the prefix counts");
+
+	/* every uid below 100k, against its neighbours and every suffix */
+	for (int64_t v = -1000; v < 100000; v++)
+	{
+		for (size_t s = 0; s < sizeof(suffixes) / sizeof(suffixes[0]); s++)
+		{
+			snprintf(name, sizeof(name), "user.uid.%lld%s", v, suffixes[s]);
+			for (int64_t d = -1; d <= 1; d++)
+			{
+				uid_t uid = (uid_t)(v + d);
+				if (parsed_allowed(name, uid) != snprintf_allowed(name, uid))
+				{
+					T_FAIL("%s for uid %u disagrees with the formatted check", name, uid);
+				}
+			}
+		}
+	}
+
+	T_PASS("user.uid. checks agree with the formatted check");
+}
+
+T_DECL(notify_user_uid_benchmark,
+       "cost of the user.uid. check",
+       T_META("owner", "Core Darwin Daemons & Tools"),
+       T_META("as_root", "false"))
+{
+	const char *name = "user.uid.501.com.apple.LaunchServices.database";
+	mach_timebase_info_data_t tbi;
+	volatile uint32_t sink = 0;
+	uint64_t s, formatted, parsed;
+
+	mach_timebase_info(&tbi);
+
+	s = mach_absolute_time();
+	for (uint32_t i = 0; i < ITERATIONS; i++) sink += snprintf_allowed(name, 501);
+	formatted = mach_absolute_time() - s;
+
+	s = mach_absolute_time();
+	for (uint32_t i = 0; i < ITERATIONS; i++) sink += parsed_allowed(name, 501);
+	parsed = mach_absolute_time() - s;
+
+	T_LOG("snprintf check: %.2f ns", (double)formatted * tbi.numer / tbi.denom / ITERATIONS);
+	T_LOG("parsed check:   %.2f ns", (double)parsed * tbi.numer / tbi.denom / ITERATIONS);
+	T_PASS("user.uid. benchmark done (%u)", sink);
+}